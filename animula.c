@@ -71,3 +71,24 @@ vm_t animula_start (lef_loader_t lef_loader)
 
   return vm;
 }
+
+#ifdef USE_AOT
+/* NOTE:
+ * Run the program translated by lef2c, the LEF is embedded in the image.
+ */
+vm_t animula_start_aot (const struct AotImage *image)
+{
+  vm_t vm = animula_init ();
+  lef_t lef = load_lef_from_memory (image->lef, image->lef_size);
+
+  if (!lef)
+    PANIC ("AOT: invalid LEF image!\n");
+
+  vm_load_lef (vm, lef);
+  vm_load_aot (vm, image);
+  vm_run (vm);
+  free_lef (lef);
+
+  return vm;
+}
+#endif
@@ -0,0 +1,83 @@
+/*  Copyright (C) 2020-2021
+ *        "Mu Lei" known as "NalaGinrut" <NalaGinrut@gmail.com>
+ *  Animula is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Lesser General Public License as
+ *  published by the Free Software Foundation, either version 3 of the
+ *  License, or  (at your option) any later version.
+
+ *  Animula is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Lesser General Public License for more details.
+
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this program.
+ *  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "bytecode.h"
+
+#if (4 == PC_SIZE)
+#  define WIDE_GROUP WIDE
+#else
+#  define WIDE_GROUP SMALL // the wide encoding is invalid in PC_SIZE 2
+#endif
+
+#define ENCODE_OF(t)            \
+  ((t) <= 0b0111   ? SINGLE     \
+   : 0b1000 == (t) ? QUADRUPLE  \
+   : 0b1001 == (t) ? WIDE_GROUP \
+   : 0b1010 == (t) ? DOUBLE     \
+   : 0b1011 == (t) ? TRIPLE     \
+                   : SPECIAL)
+
+// the free-var ops and local-assign take one more byte
+#define SINGLE_LEN(t)                                         \
+  ((FREE_REF == (t) || CALL_FREE == (t) || FREE_ASSIGN == (t) \
+    || LOCAL_ASSIGN == (t))                                   \
+     ? 2                                                      \
+     : 1)
+
+// the extended globals take the index in the byte after the encoding
+#define TRIPLE_LEN(d) \
+  ((GLOBAL_VAR_ASSIGN_EXTEND <= (d) && CALL_GLOBAL_VAR_EXTEND >= (d)) ? 4 : 3)
+
+#if (4 == PC_SIZE)
+#  define WIDE_LEN(d)                    \
+    ((WIDE_JMP >= (d))               ? 5 \
+     : (WIDE_CLOSURE_ON_HEAP == (d)) ? 6 \
+     : (WIDE_PROCEDURE == (d))       ? 7 \
+                                     : 0)
+#else
+#  define WIDE_LEN(d) 0
+#endif
+
+// the general object is variable
+#define OBJECT_LEN(d) \
+  ((CHAR == (d)) ? 2 : (SYMBOL == (d)) ? 3 : (GENERAL_OBJECT == (d)) ? 0 : 1)
+
+#define LEN_OF(t, d)                       \
+  ((t) <= 0b0111          ? SINGLE_LEN (t) \
+   : 0b1000 == (t)        ? 4              \
+   : 0b1001 == (t)        ? WIDE_LEN (d)   \
+   : 0b1010 == (t)        ? 2              \
+   : 0b1011 == (t)        ? TRIPLE_LEN (d) \
+   : PRIMITIVE_EXT == (t) ? 2              \
+   : OBJECT == (t)        ? OBJECT_LEN (d) \
+                          : 1)
+
+#define D(b)                                               \
+  {                                                        \
+    .encode = ENCODE_OF ((b) >> 4), .type = (b) >> 4,      \
+    .data = (b) & 0xF, .len = LEN_OF ((b) >> 4, (b) & 0xF) \
+  }
+
+#define ROW(h)                                                          \
+  D (h), D (h + 1), D (h + 2), D (h + 3), D (h + 4), D (h + 5),         \
+    D (h + 6), D (h + 7), D (h + 8), D (h + 9), D (h + 10), D (h + 11), \
+    D (h + 12), D (h + 13), D (h + 14), D (h + 15)
+
+const decode_t bytecode_decode[256]
+  = {ROW (0x00), ROW (0x10), ROW (0x20), ROW (0x30), ROW (0x40), ROW (0x50),
+     ROW (0x60), ROW (0x70), ROW (0x80), ROW (0x90), ROW (0xA0), ROW (0xB0),
+     ROW (0xC0), ROW (0xD0), ROW (0xE0), ROW (0xF0)};
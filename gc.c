@@ -27,67 +27,100 @@
 
 static int get_gc_from_node (otype_t type, void *value);
 /* The GC in LambdaChip is "object-based generational GC".
-   We don't perform mark/sweep, or any reference counting.
+   The reachable inner objects are marked from the frames, then each pool is
+   swept linearly by the mark bit in gattr, there's no reference counting.
 
    The meaning of `gc' field in Object:
    * 3 means permarnent.
    * 1~2 means the generation, 0 means free.
    * The `gc' will increase by 1 when it survives from GC.
    * For stack-allocated object, `gc' field is always 0.
+   * For the plain object in obj_free_pool, 2 means it's reached by a marked
+     container, and the survivors are set back to 1 in the sweep, see collect.
 
  */
 
-static RB_HEAD (ActiveRoot, ActiveRootNode)
-  ActiveRootHead = RB_INITIALIZER (&ActiveRootHead);
-
-RB_GENERATE_STATIC (ActiveRoot, ActiveRootNode, entry, active_root_compare);
+static ObjectPool pair_free_pool;
+static ObjectPool vector_free_pool;
+static ObjectPool list_free_pool;
+static ObjectPool closure_free_pool;
+static ObjectPool bytevector_free_pool;
+static ObjectPool mut_bytevector_free_pool;
+static ObjectPool obj_free_pool;
+
+#  ifdef USE_GEN_GC
+/* NOTE:
+ * The minor GC marks from the frames and the remembered set, it stops at the
+ * old objects, and it only collects the young part of each pool. The young
+ * survivors are aged to gen-2, and the old garbage is left to the full GC.
+ */
+static bool gc_minor = false;
+static u8_t gc_minor_runs = 0;
+static bool remset_overflow = false;
+static u8_t remset_cnt = 0;
+static gattr *remset[GC_REMSET_SIZE];
+#    define GC_MINOR()            (gc_minor)
+#    define YOUNG_END(pool, node) (gc_minor && ((node) == (pool)->old))
+#  else
+#    define GC_MINOR()            false
+#    define YOUNG_END(pool, node) false
+#  endif
+#  define IS_OLD(attr) (GC_MINOR () && (GEN_1_OBJ != (attr)->gc))
 
-static ListHead pair_free_pool;
-static ListHead vector_free_pool;
-static ListHead list_free_pool;
-static ListHead closure_free_pool;
-static ListHead bytevector_free_pool;
-static ListHead mut_bytevector_free_pool;
-static ListHead obj_free_pool;
+/* NOTE:
+ * oattr has no room for the mark bit, since the type codes of the constants
+ * take 6 bits, so the plain object reached from a container is marked by
+ * GEN_2_OBJ. The survivors are unmarked to GEN_1_OBJ in the sweep.
+ */
+#  define PLAIN_MARK(obj)                 \
+    do                                    \
+      {                                   \
+        if (GEN_1_OBJ == (obj)->attr.gc)  \
+          (obj)->attr.gc = GEN_2_OBJ;     \
+      }                                   \
+    while (0)
+
+#  ifdef USE_INCREMENTAL_GC
+/* NOTE:
+ * The incremental GC shades the current frame gray at the beginning of a
+ * cycle, then each step shades the other frames, scans the gray objects or
+ * sweeps the pools for GC_PAUSE_US at most. Each root, each field of a pair
+ * and each element of a list is a unit of the work. The colour of the mark bit
+ * is flipped in each cycle, so the survivors are left black, and they're white
+ * in the next cycle without clearing. The objects booked in a cycle are black,
+ * see RESET_MARK.
+ */
+typedef enum
+{
+  GC_IDLE,
+  GC_MARK,
+  GC_SWEEP
+} gc_phase_t;
+
+static gc_phase_t gc_phase = GC_IDLE;
+static u8_t gc_black = 1;
+static gattr *gray[GC_GRAY_SIZE];
+static u16_t gray_cnt = 0;
+static bool gray_overflow = false;
+reg_t gc_root_fp = 0;
+#    define MARKED(attr)     ((attr)->mark == gc_black)
+#    define SET_MARK(attr)   ((attr)->mark = gc_black)
+#    define RESET_MARK(attr) ((attr)->mark = gc_black)
+#  else
+#    define MARKED(attr)     ((attr)->mark)
+#    define SET_MARK(attr)   ((attr)->mark = 1)
+#    define RESET_MARK(attr) ((attr)->mark = 0)
+#  endif
 
-static struct Pre_ARN _arn = {0};
 // TODO: static
 struct Pre_OLN _oln = {0};
 
-static void pre_allocate_active_nodes (void)
-{
-  for (int i = 0; i < PRE_ARN; i++)
-    {
-      _arn.arn[i] = (ActiveRootNode *)os_malloc (sizeof (ActiveRootNode));
-
-      if (NULL == _arn.arn[i])
-        {
-          os_printk ("GC: We're doomed! Did you set a too large PRE_ARN?");
-          PANIC ("Try to set PRE_ARN smaller!");
-        }
-    }
-
-  _arn.index = 0;
-  VM_DEBUG ("PRE_ARN: %d, pre-allocate %d bytes.\n", PRE_ARN,
-            PRE_ARN * sizeof (ActiveRootNode));
-}
-
-static ActiveRootNode *arn_alloc (void)
-{
-  if (PRE_ARN == _arn.index)
-    {
-      PANIC ("GC: We're doomed! Did you set a too small PRE_ARN?"
-             "Try to set PRE_ARN larger!");
-    }
-  return _arn.arn[_arn.index++];
-}
-
 static void object_list_node_pre_allocate (void)
 {
   int i = 0;
   for (; i < PRE_OLN; i++)
     {
-      list_node_t ptr = (list_node_t)os_malloc (sizeof (ListNode));
+      list_node_t ptr = (list_node_t)slab_malloc (sizeof (ListNode));
       if (NULL == ptr)
         {
           PANIC ("GC: We're doomed! Did you set a too large PRE_OLN?"
@@ -136,17 +169,6 @@ size_t object_list_node_available (void)
   return (PRE_OLN - _oln.index);
 }
 
-static void active_nodes_clean (void)
-{
-  for (int i = 0; i < PRE_ARN; i++)
-    {
-      os_free (_arn.arn[i]);
-    }
-
-  _arn.index = 0;
-  VM_DEBUG ("ARN clean!\n");
-}
-
 static void object_list_node_clean (void)
 {
   // do not modify i to start from 0, which will cost you at least $2000 USD
@@ -172,24 +194,6 @@ static void object_list_node_clean (void)
   VM_DEBUG ("OLN clean!\n");
 }
 
-static inline void insert (ActiveRootNode *an)
-{
-  RB_INSERT (ActiveRoot, &ActiveRootHead, an);
-}
-
-static inline bool exist (object_t obj)
-{
-  ActiveRootNode node = {.value = (void *)obj};
-  return (NULL != RB_FIND (ActiveRoot, &ActiveRootHead, &node));
-}
-
-static void insert_value (void *value)
-{
-  ActiveRootNode *an = arn_alloc ();
-  an->value = value;
-  insert (an);
-}
-
 void free_object (object_t obj)
 {
   if (0xDEADBEEF == (uintptr_t)obj)
@@ -430,7 +434,9 @@ static void recycle_object (object_t obj)
   obj->attr.gc = FREE_OBJ;
 }
 
-static void active_root_insert (object_t obj)
+static void mark_inner (otype_t type, void *value);
+
+static void mark_object (object_t obj)
 {
   if (0xDEADBEEF == (uintptr_t)obj)
     {
@@ -439,39 +445,18 @@ static void active_root_insert (object_t obj)
 
   if (!obj)
     {
-      PANIC ("BUG: active_root_insert - null obj!\n");
+      PANIC ("BUG: mark_object - null obj!\n");
     }
 
-  if (exist (obj))
-    return;
+  PLAIN_MARK (obj);
 
   switch (obj->attr.type)
     {
     case pair:
-      {
-        pair_t p = (pair_t)obj->value;
-        active_root_insert (p->car);
-        active_root_insert (p->cdr);
-
-        insert_value (obj->value);
-        break;
-      }
     case vector:
-      {
-        PANIC ("GC: Hey, did we support Vector now? If so, please fix me!\n");
-        break;
-      }
     case list:
       {
-        list_node_t node = NULL;
-        ListHead *head = &((list_t)obj->value)->list;
-
-        SLIST_FOREACH (node, head, next)
-        {
-          active_root_insert (node->obj);
-        }
-
-        insert_value (obj->value);
+        mark_inner (obj->attr.type, obj->value);
         break;
       }
     default:
@@ -488,29 +473,20 @@ static void active_root_insert (object_t obj)
         break;
       }
     }
-
-  insert_value ((void *)obj);
 }
 
-static void active_root_inner_insert (otype_t type, void *value)
+/* NOTE:
+ * The mark bit is set before marking the children, so the shared and the
+ * circular structures are visited only once.
+ */
+static void mark_inner (otype_t type, void *value)
 {
-  /* printf ("insert!\n"); */
-
-  /* if (!value) */
-  /*   printf ("active_root_inner_insert: oh null! %d\n", type); */
-
-  /* if (exist (obj)) */
-  /*   printf ("oh exist!\n"); */
-
   if (NULL == value)
     {
       // Some self-contain object may have NULL value
       return;
     }
 
-  if (exist (value))
-    return;
-
   switch (type)
     {
     case imm_int:
@@ -531,9 +507,13 @@ static void active_root_inner_insert (otype_t type, void *value)
     case pair:
       {
         pair_t p = (pair_t)value;
-        active_root_insert (p->car);
-        active_root_insert (p->cdr);
-        insert_value (value);
+
+        if (MARKED (&p->attr) || IS_OLD (&p->attr))
+          return;
+
+        SET_MARK (&p->attr);
+        mark_object (p->car);
+        mark_object (p->cdr);
         break;
       }
     case vector:
@@ -544,58 +524,74 @@ static void active_root_inner_insert (otype_t type, void *value)
     case list:
       {
         list_node_t node = NULL;
-        ListHead *head = &((list_t)value)->list;
+        list_t l = (list_t)value;
 
-        SLIST_FOREACH (node, head, next)
+        if (MARKED (&l->attr) || IS_OLD (&l->attr))
+          return;
+
+        SET_MARK (&l->attr);
+
+        SLIST_FOREACH (node, &l->list, next)
         {
-          active_root_insert (node->obj);
+          mark_object (node->obj);
         }
-
-        insert_value (value);
         break;
       }
     default:
       {
-        PANIC ("BUG: active_root_inner_insert encountered a wrong type %d!\n",
-               type);
+        PANIC ("BUG: mark_inner encountered a wrong type %d!\n", type);
         break;
       }
     }
 }
 
-static void active_root_insert_frame (const u8_t *stack, u32_t local, u8_t cnt)
+#  ifdef USE_INCREMENTAL_GC
+static void shade_inner (otype_t type, void *value);
+#  endif
+
+// The roots are shaded gray in the incremental cycle, or marked through
+static void mark_root (object_t obj)
+{
+#  ifdef USE_INCREMENTAL_GC
+  if (GC_MARK == gc_phase)
+    {
+      shade_inner (obj->attr.type, obj->value);
+      return;
+    }
+#  endif
+
+  mark_inner (obj->attr.type, obj->value);
+}
+
+static void mark_frame (const u8_t *stack, u32_t local, u8_t cnt)
 {
-  /* printf ("insert frame %d, %d\n", local, cnt); */
-  /* getchar (); */
   for (u8_t i = 0; i < cnt; i++)
     {
       object_t obj = (object_t) (stack + local + i * sizeof (Object));
 
       if (!obj)
-        PANIC ("active_root_insert_frame: Invalid object address!");
+        PANIC ("mark_frame: Invalid object address!");
 
-      active_root_inner_insert (obj->attr.type, obj->value);
+      mark_root (obj);
     }
 }
 
-static void build_active_root (const gc_info_t gci)
+static void mark_roots (const gc_info_t gci)
 {
-  // 1. Count frames and get each fp
-  // 2. Generate Active Root Tree
+  // Walk the frames from fp and mark the objects reachable from them
 
   u8_t *stack = gci->stack;
   reg_t fp = gci->fp;
   reg_t sp = gci->sp;
-  bool run = true;
 
   for (; ((fp > 0) && (NO_PREV_FP != fp)); sp = fp, fp = NEXT_FP ())
     {
       reg_t local = fp + FPS;
       u8_t obj_cnt = (sp - local) / sizeof (Object);
-      active_root_insert_frame (stack, local, obj_cnt);
+      mark_frame (stack, local, obj_cnt);
 
-      /* NOTE: The closure captured heap-allocated object should be in
-       *        active_root too.
+      /* NOTE: The closure captured heap-allocated object should be marked
+       *        too.
        */
 
       closure_t closure = *((closure_t *)(stack + local - sizeof (closure_t)));
@@ -604,32 +600,100 @@ static void build_active_root (const gc_info_t gci)
           for (int i = 0; i < closure->frame_size; i++)
             {
               object_t obj = (&((object_t) (stack + closure->local))[i]);
-              active_root_inner_insert (obj->attr.type, obj->value);
+              mark_root (obj);
+            }
+        }
+    }
+}
+
+#  ifdef USE_GEN_GC
+/* NOTE:
+ * The children of the remembered containers are marked in the minor GC, the
+ * containers are old, so they're not marked. The mark bits are cleared in
+ * either GC, since they only mean the containers were remembered.
+ */
+static void mark_remembered (void)
+{
+  for (u8_t i = 0; i < remset_cnt; i++)
+    {
+      gattr *attr = remset[i];
+      list_node_t node = NULL;
+
+      attr->mark = 0;
+
+      if (!gc_minor)
+        continue;
+
+      switch (attr->type)
+        {
+        case pair:
+          {
+            mark_object (((pair_t)attr)->car);
+            mark_object (((pair_t)attr)->cdr);
+            break;
+          }
+        case list:
+          {
+            SLIST_FOREACH (node, &((list_t)attr)->list, next)
+            {
+              mark_object (node->obj);
             }
+            break;
+          }
+        default:
+          {
+            // no child objects to be marked
+            break;
+          }
         }
     }
+
+  remset_cnt = 0;
+  remset_overflow = false;
 }
 
-static void clean_active_root ()
+// The remembered containers may be released, so the next GC is a full one
+static void forget_remembered (void)
 {
-  /* NOTE: Don't waste time to clean one by one. */
-  _arn.index = 0;
-  RB_INIT (&ActiveRootHead);
+  gc_minor = false;
+  mark_remembered ();
+  remset_overflow = true;
 }
 
-static void collect (size_t *count, ListHead *head, bool hurt, bool force)
+void gc_remember (gattr *attr)
+{
+  if (GC_REMSET_SIZE == remset_cnt)
+    {
+      // Too many old containers were written, the next GC is a full one
+      remset_overflow = true;
+      return;
+    }
+
+  attr->mark = 1;
+  remset[remset_cnt++] = attr;
+}
+#  endif
+
+static void collect (size_t *count, ObjectPool *pool, bool hurt, bool force)
 {
   list_node_t node = NULL;
 
   /* GC algo:
       1. Skip permanent object.
-      2. If it 's in active root, it get aged if it' s gen-1, keep age if it's
-         gen-2.
-      3. If it's not in active root, release it.
+      2. Skip the released object, it's released with its container by
+         free_inner_object.
+      3. Release the unmarked one, say, the element replaced by list-set!.
+         The minor GC doesn't walk the old containers, so it leaves them to
+         the full GC.
       4. Collect all gen-2 object in hurt collect.
+
+     NOTE: The mark of the plain object is GEN_2_OBJ, see PLAIN_MARK.
    */
-  SLIST_FOREACH (node, head, next)
+  SLIST_FOREACH (node, &pool->live, next)
   {
+    if (YOUNG_END (pool, node))
+      break;
+
     if (force)
       {
         node->obj->attr.gc = FREE_OBJ;
@@ -638,26 +702,18 @@ static void collect (size_t *count, ListHead *head, bool hurt, bool force)
       {
         int gc = node->obj->attr.gc;
 
-        if (PERMANENT_OBJ == gc)
+        if (PERMANENT_OBJ == gc || FREE_OBJ == gc)
           {
             continue;
           }
-        else if (exist (node->obj))
+        else if (GEN_1_OBJ == gc && !GC_MINOR ())
           {
-            if (GEN_1_OBJ == gc)
-              {
-                // younger object aged
-                node->obj->attr.gc = GEN_2_OBJ;
-              }
-            else if (GEN_2_OBJ == gc && hurt)
-              {
-                // hurtfully collect
-                node->obj->attr.gc = FREE_OBJ;
-              }
+            // not reached by any container
+            node->obj->attr.gc = FREE_OBJ;
           }
-        else
+        else if (GEN_2_OBJ == gc && hurt)
           {
-            // Not alive, release it
+            // hurtfully collect
             node->obj->attr.gc = FREE_OBJ;
           }
       }
@@ -748,27 +804,31 @@ static void set_gc_to_node (otype_t type, void *value, int gc)
     }
 }
 
-static void collect_inner (size_t *count, ListHead *head, otype_t type,
+static void collect_inner (size_t *count, ObjectPool *pool, otype_t type,
                            bool hurt, bool force)
 {
   list_node_t node = NULL;
 
   /* GC algo:
       1. Skip permanent object.
-      2. If it's in active root, it get aged if it's gen-1, keep age if it's
-         gen-2.
-      3. If it's not in active root, release it.
+      2. If it's marked, it get aged if it's gen-1, keep age if it's gen-2.
+      3. If it's not marked, release it.
       4. Collect all gen-2 object in hurt collect.
+     The mark bit is cleared in sweep, since the hurt collect checks it again.
+     The minor GC stops at the old objects.
    */
-  SLIST_FOREACH (node, head, next)
+  SLIST_FOREACH (node, &pool->live, next)
   {
+    if (YOUNG_END (pool, node))
+      break;
+
     u8_t gc = force ? FREE_OBJ : get_gc_from_node (type, (void *)node->obj);
 
     if (PERMANENT_OBJ == gc)
       {
         continue;
       }
-    else if (exist (node->obj))
+    else if (MARKED (INNER_ATTR (node->obj)))
       {
         if (GEN_1_OBJ == gc)
           {
@@ -811,57 +871,567 @@ static size_t count_me (ListHead *head)
   return cnt;
 }
 
-static void release_all_free_objects (ListHead *head, bool force)
+static void release_object (list_node_t node)
+{
+  os_free (node->obj);
+  // instead of free node, put node into OLN for future use
+  object_list_node_recycle (node);
+}
+
+/* NOTE:
+ * The free slots left from the last sweep are released, so the RAM is given
+ * back if they're not reused for a GC cycle. Then the freed objects are
+ * unlinked from the live list in one pass, and they're pushed to the free
+ * stack for gc_pool_malloc, or released if they can't be reused.
+ * The survivors are all old after the sweep.
+ */
+static void sweep_pool (ObjectPool *pool, bool inner, bool reuse, bool force)
 {
   list_node_t node = NULL;
+  list_node_t prev = NULL;
   list_node_t nxt = NULL;
 
-  if (!SLIST_EMPTY (head))
+  while (pool->free)
+    os_free (pop_free_slot (pool));
+
+  node = SLIST_FIRST (&pool->live);
+  while (node && !YOUNG_END (pool, node))
     {
-      node = SLIST_FIRST (head);
-      while (node)
+      nxt = SLIST_NEXT (node, next);
+
+      if ((FREE_OBJ == node->obj->attr.gc) || force)
         {
-          // call free_object recursively since node->obj can be a
-          // composite object
-          if ((FREE_OBJ == node->obj->attr.gc) || force)
+          if (prev)
+            SLIST_NEXT (prev, next) = nxt;
+          else
+            SLIST_FIRST (&pool->live) = nxt;
+
+          if (reuse && !force)
             {
-              /* printf ("release node: %p, obj: %p, value: %p\n", node,
-               * node->obj, */
-              /*         node->obj->value); */
-              os_free (node->obj);
-              // instead of free node, put node into OLN for future use
-              SLIST_REMOVE (head, node, ListNode, next);
-              nxt = SLIST_NEXT (node, next);
+              push_free_slot (pool, node->obj);
               object_list_node_recycle (node);
-              node = nxt;
             }
           else
             {
-              node = SLIST_NEXT (node, next);
+              release_object (node);
             }
         }
+      else
+        {
+          if (inner)
+            RESET_MARK (INNER_ATTR (node->obj));
+          else if (GEN_2_OBJ == node->obj->attr.gc)
+            node->obj->attr.gc = GEN_1_OBJ;
+
+          prev = node;
+        }
+
+      node = nxt;
     }
+
+#  ifdef USE_GEN_GC
+  pool->old = SLIST_FIRST (&pool->live);
+#  endif
 }
 
 static void sweep (bool force)
 
 {
   VM_DEBUG ("sweep pair\n");
-  release_all_free_objects (&pair_free_pool, force);
+  sweep_pool (&pair_free_pool, true, true, force);
   VM_DEBUG ("sweep vector\n");
-  release_all_free_objects (&vector_free_pool, force);
+  sweep_pool (&vector_free_pool, true, true, force);
   VM_DEBUG ("sweep list\n");
-  release_all_free_objects (&list_free_pool, force);
+  sweep_pool (&list_free_pool, true, true, force);
   VM_DEBUG ("sweep closure\n");
-  release_all_free_objects (&closure_free_pool, force);
+  // closures are not fixed size object, see gc_pool_malloc
+  sweep_pool (&closure_free_pool, true, false, force);
   VM_DEBUG ("sweep bytevector\n");
-  release_all_free_objects (&bytevector_free_pool, force);
+  sweep_pool (&bytevector_free_pool, true, true, force);
   VM_DEBUG ("sweep mut_bytevector\n");
-  release_all_free_objects (&mut_bytevector_free_pool, force);
+  sweep_pool (&mut_bytevector_free_pool, true, true, force);
   VM_DEBUG ("sweep obj\n");
-  release_all_free_objects (&obj_free_pool, force);
+  sweep_pool (&obj_free_pool, false, true, force);
+}
+
+#  ifdef USE_INCREMENTAL_GC
+typedef struct SweepPool
+{
+  ObjectPool *pool;
+  otype_t type;
+  bool inner;
+  bool reuse;
+} SweepPool;
+
+// The same order as sweep, closures are not fixed size object
+static const SweepPool sweep_pools[] = {
+  {&pair_free_pool, pair, true, true},
+  {&vector_free_pool, vector, true, true},
+  {&list_free_pool, list, true, true},
+  {&closure_free_pool, closure_on_heap, true, false},
+  {&bytevector_free_pool, bytevector, true, true},
+  {&mut_bytevector_free_pool, mut_bytevector, true, true},
+  {&obj_free_pool, imm_int, false, true},
+};
+
+#    define SWEEP_POOLS (sizeof (sweep_pools) / sizeof (SweepPool))
+
+/* NOTE:
+ * The new objects are booked at the head of the live list, so they're never
+ * behind the cursor. `prev' is the last survivor, or NULL at the head.
+ */
+static struct
+{
+  u8_t idx;
+  list_node_t prev;
+  list_node_t node;
+  free_slot_t stale; // the free slots left from the last cycle
+  list_node_t first; // the first plain object booked before the cycle
+  bool old;
+} sweeper;
+
+static void shade_object (object_t obj)
+{
+  if (0xDEADBEEF == (uintptr_t)obj)
+    {
+      return;
+    }
+
+  if (!obj)
+    {
+      PANIC ("BUG: shade_object - null obj!\n");
+    }
+
+  PLAIN_MARK (obj);
+
+  switch (obj->attr.type)
+    {
+    case pair:
+    case vector:
+    case list:
+      {
+        shade_inner (obj->attr.type, obj->value);
+        break;
+      }
+    default:
+      {
+        break;
+      }
+    }
+}
+
+static void shade_inner (otype_t type, void *value)
+{
+  if (NULL == value)
+    {
+      return;
+    }
+
+  switch (type)
+    {
+    case pair:
+    case list:
+      {
+        gattr *attr = INNER_ATTR (value);
+
+        if (MARKED (attr))
+          return;
+
+        SET_MARK (attr);
+
+        if (GC_GRAY_SIZE == gray_cnt)
+          {
+            // The gray stack is full, leave it to rescan_step
+            gray_overflow = true;
+            return;
+          }
+
+        gray[gray_cnt++] = attr;
+        break;
+      }
+    default:
+      {
+        mark_inner (type, value);
+        break;
+      }
+    }
+}
+
+/* NOTE:
+ * The gray object in scanning, a long list is resumed from `node' in the next
+ * unit, and a pair is scanned in two units.
+ */
+static struct
+{
+  gattr *attr;
+  list_node_t node;
+  u8_t field;
+} scanning;
+
+static void scan_begin (gattr *attr)
+{
+  scanning.attr = attr;
+  scanning.field = 0;
+
+  if (list == attr->type)
+    scanning.node = SLIST_FIRST (&((list_t)attr)->list);
+}
+
+static void scan_step (void)
+{
+  gattr *attr = scanning.attr;
+
+  switch (attr->type)
+    {
+    case pair:
+      {
+        if (0 == scanning.field++)
+          {
+            shade_object (((pair_t)attr)->car);
+            return;
+          }
+
+        shade_object (((pair_t)attr)->cdr);
+        break;
+      }
+    case list:
+      {
+        list_node_t node = scanning.node;
+
+        if (node)
+          {
+            scanning.node = SLIST_NEXT (node, next);
+            shade_object (node->obj);
+
+            if (scanning.node)
+              return;
+          }
+        break;
+      }
+    default:
+      {
+        PANIC ("BUG: scan_step encountered a wrong type %d!\n", attr->type);
+        break;
+      }
+    }
+
+  scanning.attr = NULL;
 }
 
+/* NOTE:
+ * The object shaded when the gray stack is full is left black with the
+ * children unscanned. So the marked pairs and lists are scanned again when
+ * there's no gray object, until no one overflows in a round.
+ */
+static ObjectPool *const rescan_pools[] = {&pair_free_pool, &list_free_pool};
+
+#    define RESCAN_POOLS (sizeof (rescan_pools) / sizeof (ObjectPool *))
+
+static struct
+{
+  u8_t idx;
+  list_node_t node;
+} rescan = {.idx = RESCAN_POOLS};
+
+static void rescan_step (void)
+{
+  list_node_t node = rescan.node;
+
+  if (!node)
+    {
+      if (++rescan.idx < RESCAN_POOLS)
+        rescan.node = SLIST_FIRST (&rescan_pools[rescan.idx]->live);
+
+      return;
+    }
+
+  rescan.node = SLIST_NEXT (node, next);
+
+  if (MARKED (INNER_ATTR (node->obj)))
+    scan_begin (INNER_ATTR (node->obj));
+}
+
+// The frame gc_root_fp in shading, `i' counts the closure after the locals
+static struct
+{
+  const u8_t *stack;
+  reg_t sp;
+  size_t i;
+} roots;
+
+// Shade one root of the frame gc_root_fp, it's mark_roots for one object
+static void root_step (void)
+{
+  reg_t local = gc_root_fp + FPS;
+  size_t cnt = (roots.sp - local) / sizeof (Object);
+  size_t i = roots.i++;
+
+  if (i < cnt)
+    {
+      mark_root ((object_t) (roots.stack + local + i * sizeof (Object)));
+      return;
+    }
+
+  closure_t closure = FRAME_CLOSURE_OF (roots.stack, gc_root_fp);
+
+  if (closure && (i - cnt) < closure->frame_size)
+    {
+      mark_root (&((object_t) (roots.stack + closure->local))[i - cnt]);
+      return;
+    }
+
+  // The frame is done, go on with the caller
+  reg_t fp = FRAME_REG (roots.stack, gc_root_fp, FRAME_LAST_FP);
+
+  roots.sp = gc_root_fp;
+  roots.i = 0;
+  gc_root_fp = (NO_PREV_FP == fp) ? 0 : fp;
+}
+
+/* NOTE:
+ * The frame returned to must be shaded before it's popped, and the ones above
+ * it are shaded already, so finish it in place.
+ */
+void gc_return_barrier (const u8_t *stack)
+{
+  reg_t fp = gc_root_fp;
+
+  if (GC_MARK != gc_phase || !fp)
+    return;
+
+  roots.stack = stack;
+
+  while (fp == gc_root_fp)
+    root_step ();
+}
+
+void gc_satb_shade (object_t obj)
+{
+  if (GC_MARK == gc_phase)
+    shade_object (obj);
+}
+
+static void sweep_begin (u8_t idx)
+{
+  ObjectPool *pool = sweep_pools[idx].pool;
+
+  sweeper.idx = idx;
+  sweeper.prev = NULL;
+  sweeper.node = SLIST_FIRST (&pool->live);
+  sweeper.stale = pool->free;
+  pool->free = NULL;
+}
+
+/* NOTE:
+ * Sweep one object, it's collect_inner and sweep_pool for one node.
+ * Return false when all the pools are swept.
+ */
+static bool sweep_step (void)
+{
+  const SweepPool *sp = &sweep_pools[sweeper.idx];
+  ObjectPool *pool = sp->pool;
+  list_node_t node = sweeper.node;
+  list_node_t nxt = NULL;
+
+  if (sweeper.stale)
+    {
+      free_slot_t slot = sweeper.stale;
+      sweeper.stale = slot->next;
+      os_free (slot);
+      return true;
+    }
+
+  if (!node)
+    {
+      if (SWEEP_POOLS == sweeper.idx + 1)
+        {
+          gc_phase = GC_IDLE;
+          return false;
+        }
+
+      sweep_begin (sweeper.idx + 1);
+      return true;
+    }
+
+  if (!sweeper.prev && (SLIST_FIRST (&pool->live) != node))
+    {
+      // New objects were booked at the head since the last step
+      list_node_t p = SLIST_FIRST (&pool->live);
+
+      while (SLIST_NEXT (p, next) != node)
+        p = SLIST_NEXT (p, next);
+
+      sweeper.prev = p;
+    }
+
+  nxt = SLIST_NEXT (node, next);
+
+  if (sp->inner)
+    {
+      gattr *attr = INNER_ATTR (node->obj);
+
+      if (PERMANENT_OBJ != attr->gc)
+        {
+          if (!MARKED (attr))
+            free_inner_object (sp->type, (void *)node->obj);
+          else if (GEN_1_OBJ == attr->gc)
+            attr->gc = GEN_2_OBJ;
+        }
+    }
+  else
+    {
+      // The plain objects before `first' were booked in the cycle
+      if (node == sweeper.first)
+        sweeper.old = true;
+
+      if (GEN_2_OBJ == node->obj->attr.gc)
+        node->obj->attr.gc = GEN_1_OBJ; // unmark it, see PLAIN_MARK
+      else if (GEN_1_OBJ == node->obj->attr.gc && sweeper.old)
+        node->obj->attr.gc = FREE_OBJ; // not reached by any container
+    }
+
+  if (FREE_OBJ == node->obj->attr.gc)
+    {
+      if (sweeper.prev)
+        SLIST_NEXT (sweeper.prev, next) = nxt;
+      else
+        SLIST_FIRST (&pool->live) = nxt;
+
+      if (sp->reuse)
+        {
+          push_free_slot (pool, node->obj);
+          object_list_node_recycle (node);
+        }
+      else
+        {
+          release_object (node);
+        }
+    }
+  else
+    {
+      if (sp->inner)
+        RESET_MARK (INNER_ATTR (node->obj));
+
+      sweeper.prev = node;
+    }
+
+  sweeper.node = nxt;
+  return true;
+}
+
+// Do one unit of the cycle, return false when the cycle is done
+static bool gc_work (void)
+{
+  if (GC_MARK == gc_phase)
+    {
+      if (scanning.attr)
+        {
+          scan_step ();
+        }
+      else if (gray_cnt)
+        {
+          scan_begin (gray[--gray_cnt]);
+        }
+      else if (gc_root_fp)
+        {
+          root_step ();
+        }
+      else if (rescan.idx < RESCAN_POOLS)
+        {
+          rescan_step ();
+        }
+      else if (gray_overflow)
+        {
+          gray_overflow = false;
+          rescan.idx = 0;
+          rescan.node = SLIST_FIRST (&rescan_pools[0]->live);
+        }
+      else
+        {
+          gc_phase = GC_SWEEP;
+          sweep_begin (0);
+        }
+
+      return true;
+    }
+
+  if (GC_SWEEP == gc_phase)
+    return sweep_step ();
+
+  return false;
+}
+
+/* NOTE:
+ * Finish the cycle in progress without the pause budget. The stack is NULL
+ * when all the frames were popped, so there's no root to shade.
+ */
+static void gc_finish (const u8_t *stack)
+{
+  roots.stack = stack;
+
+  if (!stack)
+    gc_root_fp = 0;
+
+  while (gc_work ())
+    ;
+}
+
+#    ifdef ANIMULA_LINUX
+static u32_t gc_clock (void)
+{
+  struct timeval tv;
+  gettimeofday (&tv, NULL);
+  return tv.tv_sec * 1000000L + tv.tv_usec;
+}
+#      define GC_IN_BUDGET(t0) ((gc_clock () - (t0)) < GC_PAUSE_US)
+#    elif defined(ANIMULA_ZEPHYR)
+#      define gc_clock()       k_cyc_to_us_floor32 (k_cycle_get_32 ())
+#      define GC_IN_BUDGET(t0) ((gc_clock () - (t0)) < GC_PAUSE_US)
+#    else
+// No clock, each step does GC_STEP_WORK objects
+#      define gc_clock()       0
+#      define GC_IN_BUDGET(t0) false
+#    endif
+
+void gc_step (const gc_info_t gci)
+{
+  u32_t t0 = 0;
+
+  if (GC_IDLE == gc_phase)
+    {
+      if (object_list_node_available () > GC_START_OLN)
+        return;
+
+      // Begin a cycle, the current frame is shaded at once, see root_step
+      t0 = gc_clock ();
+      gc_black ^= 1;
+      gc_phase = GC_MARK;
+      sweeper.first = SLIST_FIRST (&obj_free_pool.live);
+      sweeper.old = false;
+      gc_root_fp = (NO_PREV_FP == gci->fp) ? 0 : gci->fp;
+      roots.sp = gci->sp;
+      roots.i = 0;
+      gc_return_barrier (gci->stack);
+    }
+  else
+    {
+      t0 = gc_clock ();
+    }
+
+  roots.stack = gci->stack;
+
+  do
+    {
+      for (u8_t i = 0; i < GC_STEP_WORK; i++)
+        {
+          if (!gc_work ())
+            return;
+        }
+    }
+  while (GC_IN_BUDGET (t0));
+}
+#  endif
+
 bool gc (const gc_info_t gci)
 {
   /* TODO:
@@ -889,7 +1459,23 @@ bool gc (const gc_info_t gci)
   uint32_t t0 = k_cycle_get_32 ();
 #  endif
 
-  build_active_root (gci);
+#  ifdef USE_GEN_GC
+  gc_minor = !remset_overflow && (gc_minor_runs < GC_MINOR_MAX);
+  mark_remembered ();
+#  endif
+
+#  ifdef USE_INCREMENTAL_GC
+  if (GC_IDLE != gc_phase)
+    {
+      // Out of memory in a cycle, so finish it instead of a new one
+      gc_finish (gci->stack);
+      return true;
+    }
+
+  gc_black ^= 1;
+#  endif
+
+  mark_roots (gci);
 
 #  ifdef ANIMULA_LINUX
   gettimeofday (&tv, &tz);
@@ -916,7 +1502,7 @@ bool gc (const gc_info_t gci)
   uint32_t t2 = k_cycle_get_32 ();
 #  endif
 
-  if (0 == count && gci->hurt)
+  if (0 == count && gci->hurt && !GC_MINOR ())
     {
       /*
         NOTE: No memory and no freed object, hurtly collect to release all
@@ -939,33 +1525,32 @@ bool gc (const gc_info_t gci)
 
   sweep (false);
 
-#  ifdef ANIMULA_LINUX
-  gettimeofday (&tv, &tz);
-  long long t3 = tv.tv_sec * TICKS_PER_SECOND + tv.tv_usec;
-#  elif defined(ANIMULA_ZEPHYR)
-  uint32_t t3 = k_cycle_get_32 ();
-#  endif
+#  ifdef USE_GEN_GC
+  if (gc_minor)
+    {
+      // Nothing young was dead, so the next GC is a full one
+      gc_minor_runs = count ? (gc_minor_runs + 1) : GC_MINOR_MAX;
+    }
+  else
+    {
+      gc_minor_runs = 0;
+    }
 
-#  ifdef ANIMULA_LINUX
-  gettimeofday (&tv, &tz);
-  long long t4 = tv.tv_sec * TICKS_PER_SECOND + tv.tv_usec;
-#  elif defined(ANIMULA_ZEPHYR)
-  uint32_t t4 = k_cycle_get_32 ();
+  VM_DEBUG ("%s GC, %d freed\n", gc_minor ? "minor" : "full", (int)count);
+  gc_minor = false;
 #  endif
-  clean_active_root ();
+
 #  ifdef ANIMULA_LINUX
   gettimeofday (&tv, &tz);
-  long long t5 = tv.tv_sec * TICKS_PER_SECOND + tv.tv_usec;
+  long long t3 = tv.tv_sec * TICKS_PER_SECOND + tv.tv_usec;
 #  elif defined(ANIMULA_ZEPHYR)
-  uint32_t t5 = k_cycle_get_32 ();
+  uint32_t t3 = k_cycle_get_32 ();
 #  endif
 
 #  ifdef ANIMULA_LINUX
-  VM_DEBUG ("%lld, %lld, %lld, %lld, %lld\n", t1 - t0, t2 - t0, t3 - t0,
-            t4 - t0, t5 - t0);
+  VM_DEBUG ("%lld, %lld, %lld\n", t1 - t0, t2 - t0, t3 - t0);
 #  elif defined(ANIMULA_ZEPHYR)
-  VM_DEBUG ("%d, %d, %d, %d, %d\n", t1 - t0, t2 - t0, t3 - t0, t4 - t0,
-            t5 - t0);
+  VM_DEBUG ("%d, %d, %d\n", t1 - t0, t2 - t0, t3 - t0);
 #  endif
 
   return true;
@@ -974,6 +1559,15 @@ bool gc (const gc_info_t gci)
 void gc_clean_cache (void)
 {
   size_t cnt = 0;
+
+#  ifdef USE_INCREMENTAL_GC
+  gc_finish (NULL);
+#  endif
+
+#  ifdef USE_GEN_GC
+  forget_remembered ();
+#  endif
+
   collect_inner (&cnt, &pair_free_pool, pair, false, true);
   collect_inner (&cnt, &vector_free_pool, vector, false, true);
   collect_inner (&cnt, &list_free_pool, list, false, true);
@@ -995,7 +1589,7 @@ void gc_obj_book (void *obj)
       PANIC ("gc_book 0: We're doomed! There're even no RAMs for GC!\n");
     }
   node->obj = obj;
-  SLIST_INSERT_HEAD (&obj_free_pool, node, next);
+  SLIST_INSERT_HEAD (&obj_free_pool.live, node, next);
 }
 
 void gc_inner_obj_book (otype_t t, void *obj)
@@ -1009,38 +1603,46 @@ void gc_inner_obj_book (otype_t t, void *obj)
     }
 
   node->obj = obj;
+  /* NOTE:
+   * The header may be left from malloc or from a freed slot, and the inner
+   * objects from NEW_INNER_OBJ don't have the type set. The callers may set
+   * the gc again, say, PERMANENT_OBJ for the globals.
+   */
+  INNER_ATTR (obj)->type = t;
+  INNER_ATTR (obj)->gc = GEN_1_OBJ;
+  RESET_MARK (INNER_ATTR (obj));
 
   switch (t)
     {
     case pair:
       {
-        SLIST_INSERT_HEAD (&pair_free_pool, node, next);
+        SLIST_INSERT_HEAD (&pair_free_pool.live, node, next);
         break;
       }
     case vector:
       {
-        SLIST_INSERT_HEAD (&vector_free_pool, node, next);
+        SLIST_INSERT_HEAD (&vector_free_pool.live, node, next);
         break;
       }
     case list:
       {
-        SLIST_INSERT_HEAD (&list_free_pool, node, next);
+        SLIST_INSERT_HEAD (&list_free_pool.live, node, next);
         break;
       }
     case closure_on_heap:
     case closure_on_stack:
       {
-        SLIST_INSERT_HEAD (&closure_free_pool, node, next);
+        SLIST_INSERT_HEAD (&closure_free_pool.live, node, next);
         break;
       }
     case bytevector:
       {
-        SLIST_INSERT_HEAD (&bytevector_free_pool, node, next);
+        SLIST_INSERT_HEAD (&bytevector_free_pool.live, node, next);
         break;
       }
     case mut_bytevector:
       {
-        SLIST_INSERT_HEAD (&mut_bytevector_free_pool, node, next);
+        SLIST_INSERT_HEAD (&mut_bytevector_free_pool.live, node, next);
         break;
       }
     default:
@@ -1063,8 +1665,10 @@ void *gc_pool_malloc (otype_t type)
 
   /* NOTE: If object was freed, then the internal obj was freed, so we don't
    *       have to maintain `gc' fields in the internal obj.
+   *       The slot is popped from the free stack, and the caller books it
+   *       again, say, NEW_INNER_OBJ.
    */
-  list_node_t node = NULL;
+  void *slot = NULL;
 
   switch (type)
     {
@@ -1081,22 +1685,22 @@ void *gc_pool_malloc (otype_t type)
     case primitive:
     case procedure:
       {
-        node = get_free_obj_node (&obj_free_pool);
+        slot = pop_free_slot (&obj_free_pool);
         break;
       }
     case list:
       {
-        node = get_free_obj_node (&list_free_pool);
+        slot = pop_free_slot (&list_free_pool);
         break;
       }
     case pair:
       {
-        node = get_free_obj_node (&pair_free_pool);
+        slot = pop_free_slot (&pair_free_pool);
         break;
       }
     case vector:
       {
-        node = get_free_obj_node (&vector_free_pool);
+        slot = pop_free_slot (&vector_free_pool);
         break;
       }
     case closure_on_heap:
@@ -1107,12 +1711,12 @@ void *gc_pool_malloc (otype_t type)
       }
     case bytevector:
       {
-        node = get_free_obj_node (&bytevector_free_pool);
+        slot = pop_free_slot (&bytevector_free_pool);
         break;
       }
     case mut_bytevector:
       {
-        node = get_free_obj_node (&mut_bytevector_free_pool);
+        slot = pop_free_slot (&mut_bytevector_free_pool);
         break;
       }
     default:
@@ -1121,22 +1725,41 @@ void *gc_pool_malloc (otype_t type)
       }
     }
 
-  return node ? node->obj : NULL;
+  return slot;
 }
 
-void simple_collect (ListHead *head)
+void simple_collect (ObjectPool *pool)
 {
-  list_node_t node = NULL;
+  list_node_t node = SLIST_FIRST (&pool->live);
+  list_node_t prev = NULL;
+  list_node_t nxt = NULL;
 
-  SLIST_FOREACH (node, head, next)
-  {
-    object_t obj = (object_t)node->obj;
+  while (node)
+    {
+      object_t obj = (object_t)node->obj;
+      nxt = SLIST_NEXT (node, next);
 
-    if (PERMANENT_OBJ != obj->attr.gc)
-      {
-        obj->attr.gc = FREE_OBJ;
-      }
-  }
+      if (PERMANENT_OBJ != obj->attr.gc)
+        {
+          if (prev)
+            SLIST_NEXT (prev, next) = nxt;
+          else
+            SLIST_FIRST (&pool->live) = nxt;
+
+          push_free_slot (pool, obj);
+          object_list_node_recycle (node);
+        }
+      else
+        {
+          prev = node;
+        }
+
+      node = nxt;
+    }
+
+#  ifdef USE_GEN_GC
+  pool->old = SLIST_FIRST (&pool->live);
+#  endif
 }
 
 // collect all composite object, including vector, list, pair
@@ -1145,6 +1768,12 @@ void simple_collect (ListHead *head)
 void gc_try_to_recycle (void)
 {
   /* FIXME: The runtime created globals shouldn't be recycled */
+#  ifdef USE_GEN_GC
+  forget_remembered ();
+#  endif
+#  ifdef USE_INCREMENTAL_GC
+  gc_finish (NULL);
+#  endif
   simple_collect (&obj_free_pool);
   simple_collect (&list_free_pool);
   simple_collect (&vector_free_pool);
@@ -1153,15 +1782,20 @@ void gc_try_to_recycle (void)
   /* NOTE:
    * Closures are not fixed size object, so we have to free it.
    */
-  release_all_free_objects (&closure_free_pool, true);
+  sweep_pool (&closure_free_pool, true, false, true);
 }
 
+#  ifdef GC_RECYCLE_CURRENT_FRAME
 void gc_recycle_current_frame (const u8_t *stack, u32_t local, u32_t sp)
 {
-#  if defined GC_RECYCLE_CURRENT_FRAME == 1
   size_t size = sizeof (Object);
   size_t cnt = (sp - local) / size;
 
+#    ifdef USE_INCREMENTAL_GC
+  // The objects can't be released behind the sweeper
+  gc_finish (stack);
+#    endif
+
   for (size_t i = 0; i < cnt; i++)
     {
       object_t obj = (object_t) (stack + local + i * size);
@@ -1215,40 +1849,49 @@ void gc_recycle_current_frame (const u8_t *stack, u32_t local, u32_t sp)
           }
         }
     }
-#  endif
 }
+#  endif
 
 void gc_init (void)
 {
-  pre_allocate_active_nodes ();
   object_list_node_pre_allocate ();
 
-  SLIST_INIT (&obj_free_pool);
-  SLIST_INIT (&list_free_pool);
-  SLIST_INIT (&vector_free_pool);
-  SLIST_INIT (&pair_free_pool);
-  SLIST_INIT (&closure_free_pool);
-  SLIST_INIT (&bytevector_free_pool);
-  SLIST_INIT (&mut_bytevector_free_pool);
+  SLIST_INIT (&obj_free_pool.live);
+  obj_free_pool.free = NULL;
+  SLIST_INIT (&list_free_pool.live);
+  list_free_pool.free = NULL;
+  SLIST_INIT (&vector_free_pool.live);
+  vector_free_pool.free = NULL;
+  SLIST_INIT (&pair_free_pool.live);
+  pair_free_pool.free = NULL;
+  SLIST_INIT (&closure_free_pool.live);
+  closure_free_pool.free = NULL;
+  SLIST_INIT (&bytevector_free_pool.live);
+  bytevector_free_pool.free = NULL;
+  SLIST_INIT (&mut_bytevector_free_pool.live);
+  mut_bytevector_free_pool.free = NULL;
 }
 
 void gc_clean (void)
 {
-  active_nodes_clean ();
   object_list_node_clean ();
 }
 
-// remove first find object in LIST head
-static void free_object_from_pool (ListHead *head, object_t o)
+// remove first find object in the live list of the pool
+static void free_object_from_pool (ObjectPool *pool, object_t o)
 {
   list_node_t node = NULL;
-  SLIST_FOREACH (node, (head), next)
+  SLIST_FOREACH (node, &pool->live, next)
   {
     if (node->obj == (o))
       {
         os_free (node->obj);
         node->obj = NULL;
-        SLIST_REMOVE (head, node, ListNode, next);
+#  ifdef USE_GEN_GC
+        if (node == pool->old)
+          pool->old = SLIST_NEXT (node, next);
+#  endif
+        SLIST_REMOVE (&pool->live, node, ListNode, next);
         object_list_node_recycle (node);
         break;
       }
@@ -17,6 +17,7 @@
  *  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include "aot.h"
 #include "debug.h"
 #include "gc.h"
 #include "memory.h"
@@ -41,4 +42,7 @@ typedef struct LEF_Loader
 vm_t animula_init (void);
 void animula_clean (vm_t vm);
 vm_t animula_start (lef_loader_t lef_loader);
+#ifdef USE_AOT
+vm_t animula_start_aot (const struct AotImage *image);
+#endif
 #endif // End of __ANIMULA_H__
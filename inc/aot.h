@@ -0,0 +1,62 @@
+#ifndef __ANIMULA_AOT_H__
+#define __ANIMULA_AOT_H__
+/*  Copyright (C) 2020-2021
+ *        "Mu Lei" known as "NalaGinrut" <NalaGinrut@gmail.com>
+ *  Animula is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Lesser General Public License as
+ *  published by the Free Software Foundation, either version 3 of the
+ *  License, or  (at your option) any later version.
+
+ *  Animula is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Lesser General Public License for more details.
+
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this program.
+ *  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "lef.h"
+#include "predecode.h"
+#include "types.h"
+
+#ifdef USE_AOT
+#  if !defined USE_PREDECODE
+#    error "USE_AOT runs in the pre-decoded interpreter, define USE_PREDECODE!"
+#  endif
+
+/* NOTE:
+ * A translated procedure runs the instructions from vm->pc, and returns to
+ * run_predecoded when it calls, returns or leaves its code, see lef2c.c.
+ */
+typedef void (*aot_proc_t) (vm_t vm);
+
+typedef struct AotEntry
+{
+  reg_t pc;
+  aot_proc_t proc;
+} aot_entry_t;
+
+/* NOTE:
+ * The image is generated by lef2c, the LEF is embedded as it is, so the
+ * constants, the globals and the symbols are loaded by the runtime as usual.
+ * The generated code must be built with the same flags as the runtime.
+ */
+typedef struct AotImage
+{
+  const u8_t *lef;  // the LEF file
+  size_t lef_size;  // the size of the LEF file
+  const aot_entry_t *entries;
+  size_t cnt;
+} *aot_image_t;
+
+void vm_exec_insn (vm_t vm, insn_t *insn);
+void vm_load_aot (vm_t vm, const struct AotImage *image);
+#endif
+
+#if defined ANIMULA_LINUX && defined USE_PREDECODE
+bool lef2c (const char *lef_file, const char *c_file);
+#endif
+
+#endif // End of __ANIMULA_AOT_H__
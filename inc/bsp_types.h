@@ -120,7 +120,6 @@ typedef __u32_t __mutex_t;
 // types bsp should use;
 typedef __u32_t frame_pt;
 typedef __u32_t ereg_t;
-typedef __u16_t reg_t;
 
 // gcc attributes;
 // may be need some mechnism to check GCC, but do it later...;
@@ -46,7 +46,7 @@
  * 5. Closure arity is no more than 64
  * 6. Closure frame-size is no more than 64
  * 7. Procedure entry is no more than 65KB, which means the LEF size is no more
-      than 65KB.
+      than 65KB. With PC_SIZE 4, the entries beyond it use the wide encoding.
  * 8. Globals are limited to the first 256 + 65536 bytes RAMs,
       8208 objects in total
 
@@ -101,8 +101,16 @@
                                         entry is code[a]
  1000 0010 ffffffff aaaaaaaa aaaaaaaa   Closure on stack
 
- -> Reserved
- 1001
+ -> wide encoding, only with PC_SIZE 4 (start from 1001)
+ 1001 0000 a*32                 Call proc at code[a]
+ 1001 0001 a*32                 Jump to code[a] when TOS is false
+ 1001 0010 a*32                 Jump to code[a] without condition
+ 1001 0011 ffffffff a*32        Closure on heap with frame, and the entry is
+                                code[a]
+ 1001 0100 a*32 nnnnnnnn oooooooo
+                                Procedure object, the entry is code[a], n is
+                                the arity, o is the optional args
+ a*32 is the 4 bytes address in big endian, the same as the 16 bits ones.
 
  -> Speical encoding
  1100xxxx                   Basic primitives
@@ -125,6 +133,7 @@
 #define DOUBLE_ENCODE(bc)    (0b1010 == (bc).type)
 #define TRIPLE_ENCODE(bc)    (0b1011 == (bc).type)
 #define QUADRUPLE_ENCODE(bc) (0b1000 == (bc).type)
+#define WIDE_ENCODE(bc)      (0b1001 == (bc).type)
 #define IS_SPECIAL(bc)       (0b1100 & (bc).type)
 
 // single encode
@@ -159,6 +168,13 @@
 #define CLOSURE_ON_HEAP  0b0001
 #define CLOSURE_ON_STACK 0b0010
 
+// wide encoding
+#define WIDE_CALL_PROC       0b0000
+#define WIDE_F_JMP           0b0001
+#define WIDE_JMP             0b0010
+#define WIDE_CLOSURE_ON_HEAP 0b0011
+#define WIDE_PROCEDURE       0b0100
+
 // special encoding
 #define PRIMITIVE     0b1100
 #define PRIMITIVE_EXT 0b1101
@@ -166,4 +182,23 @@
 #define CONTROL       0b1111
 #define HALT          0b1111
 
+/* NOTE:
+ * The decode table is indexed by the first byte of an instruction, so the
+ * dispatchers take the encoding, the nibbles and the length by one lookup
+ * rather than the bit-fields of bytecode8_t, which depend on the bits endian.
+ * The len is the size of the whole instruction, 0 for the variable one and the
+ * invalid one. See bytecode.c.
+ */
+typedef struct ByteCodeDecode
+{
+  u8_t encode; // encode_t, SMALL for the invalid one
+  u8_t type;   // the high nibble
+  u8_t data;   // the low nibble
+  u8_t len;
+} decode_t;
+
+extern const decode_t bytecode_decode[256];
+
+#define DECODE(byte) (&bytecode_decode[(u8_t) (byte)])
+
 #endif // End of __ANIMULA_BYTECODE_H__
@@ -54,7 +54,15 @@ static inline void panic (const char *reason)
 #    define assert(e) ((void)((e) ? 0 : __assert (#    e, __FILE__, __LINE__)))
 #  endif
 #else
-#  define VM_DEBUG
+/* NOTE:
+ * The arguments are still passed to a function, so the variables which are
+ * only printed are used, and there's no comma expression without effect.
+ */
+static inline void vm_debug_nop (const char *format, ...)
+{
+  (void)format;
+}
+#  define VM_DEBUG(...) vm_debug_nop (__VA_ARGS__)
 #  ifndef assert
 #    define assert
 #  endif
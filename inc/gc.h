@@ -38,10 +38,15 @@
 #  define gc_try_to_recycle()                // tiny gc doesn't need it
 #  define object_list_node_available()  1    // always true
 #  define gc_pool_malloc(te)            NULL // always NULL
+#  define GC_WRITE_BARRIER(...)              // tiny gc doesn't need it
+#  define GC_SATB_BARRIER(...)               // tiny gc doesn't need it
+#  define GC_RETURN_BARRIER()                // tiny gc doesn't need it
+#  define GC_STEP()                          // tiny gc doesn't need it
 #else
 #  include "obg_gc.h"
 #  define ANIMULA_GC_INIT() gc_init ()
 #  define GC()              ODB_GC ()
+#  define GC_STEP()         ODB_GC_STEP ()
 #  define GC_MALLOC(n)      ODB_GC_MALLOC (n)
 #  define GC_CLEAN()        gc_clean ()
 #endif
@@ -0,0 +1,73 @@
+#ifndef __ANIMULA_JIT_H__
+#define __ANIMULA_JIT_H__
+/*  Copyright (C) 2020-2021
+ *        "Mu Lei" known as "NalaGinrut" <NalaGinrut@gmail.com>
+ *  Animula is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Lesser General Public License as
+ *  published by the Free Software Foundation, either version 3 of the
+ *  License, or  (at your option) any later version.
+
+ *  Animula is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Lesser General Public License for more details.
+
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this program.
+ *  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "predecode.h"
+#include "types.h"
+
+#ifdef USE_JIT
+#  if !defined USE_PREDECODE
+#    error "USE_JIT compiles the pre-decoded program, define USE_PREDECODE!"
+#  endif
+#  if !defined ANIMULA_LINUX || !defined __x86_64__
+#    error "USE_JIT only supports x86-64 GNU/Linux!"
+#  endif
+
+#  define JIT_THRESHOLD 32           // calls before an entry is compiled
+#  define JIT_CODE_SIZE (256 * 1024) // the executable region
+
+/* NOTE:
+ * A helper executes one pre-decoded instruction exactly like run_predecoded,
+ * the JIT code sets vm->pc to the next instruction before calling it.
+ */
+typedef void (*jit_helper_t) (vm_t vm, insn_t *insn);
+
+typedef struct Jit
+{
+  u8_t *code;  // the executable region
+  size_t used; // the emitted bytes in code
+  size_t size; // the size of the program
+  void **map;  // the native code of each pc, NULL if it's not compiled
+  u8_t *hits;  // the calls of each entry
+  u8_t proc;   // the native code runs for apply_proc, see run_predecoded
+  void (*enter) (vm_t vm, void *native);
+  u8_t *dispatch; // jump to the native code of vm->pc, or exit
+  u8_t *exit;     // return to the interpreter
+} *jit_t;
+
+extern const jit_helper_t jit_helpers[INSN_OP_MAX];
+
+jit_t jit_init (size_t size);
+void jit_clean (jit_t jit);
+void jit_compile (vm_t vm, reg_t entry);
+
+static inline void jit_hot (vm_t vm, reg_t entry)
+{
+  jit_t jit = vm->jit;
+
+  if (jit && entry < jit->size && JIT_THRESHOLD > jit->hits[entry]
+      && JIT_THRESHOLD == ++jit->hits[entry])
+    jit_compile (vm, entry);
+}
+
+#  define JIT_HOT(entry) jit_hot (vm, (entry))
+#else
+#  define JIT_HOT(entry)
+#endif
+
+#endif // End of __ANIMULA_JIT_H__
@@ -109,5 +109,6 @@ void free_lef (lef_t lef);
 lef_t load_lef_from_file (const char *filename);
 lef_t load_lef_from_uart (void);
 lef_t load_lef_from_flash (size_t offset);
+lef_t load_lef_from_memory (const u8_t *image, size_t size);
 
 #endif // End of __ANIMULA_LEF_H__
@@ -28,4 +28,5 @@ void init_ram_heap (void);
 void *os_malloc (size_t size);
 void *os_calloc (size_t n, size_t size);
 void os_free (void *ptr);
+void *slab_malloc (size_t size);
 #endif // End of __ANIMULA_MEMORY_H__
@@ -19,7 +19,6 @@
 
 #include "debug.h"
 #include "memory.h"
-#include "rbtree.h"
 #include "types.h"
 
 extern vm_t vm; // magic to make gcc happy
@@ -35,34 +34,107 @@ extern vm_t vm; // magic to make gcc happy
     }                                         \
   while (0)
 
-#define ODB_GC_MALLOC(size)             \
-  ({                                    \
-    void *ret = NULL;                   \
-    do                                  \
-      {                                 \
-        ret = (void *)os_malloc (size); \
-        if (ret)                        \
-          break;                        \
-        GC ();                          \
-      }                                 \
-    while (1);                          \
-    ret;                                \
+#define ODB_GC_MALLOC(size)               \
+  ({                                      \
+    void *ret = NULL;                     \
+    do                                    \
+      {                                   \
+        ret = (void *)slab_malloc (size); \
+        if (ret)                          \
+          break;                          \
+        GC ();                            \
+      }                                   \
+    while (1);                            \
+    ret;                                  \
   })
 
-typedef struct ActiveRoot ActiveRoot;
-typedef struct ActiveRootNode ActiveRootNode;
+#ifdef USE_INCREMENTAL_GC
+#  ifdef USE_GEN_GC
+#    error "USE_INCREMENTAL_GC and USE_GEN_GC can't be used together!"
+#  endif
+#  define ODB_GC_STEP()                           \
+    do                                            \
+      {                                           \
+        GCInfo gci = {.fp = vm->fp,               \
+                      .sp = vm->sp,               \
+                      .stack = vm->stack,         \
+                      .hurt = ANIMULA_GC_HURT};   \
+        gc_step (&gci);                           \
+      }                                           \
+    while (0)
+
+/* NOTE:
+ * The incremental GC marks the objects reachable at the beginning of the
+ * cycle, so the object to be overwritten in a container must be shaded.
+ */
+#  define GC_SATB_BARRIER(obj) gc_satb_shade (obj)
 
-struct ActiveRootNode
+/* NOTE:
+ * The frames are shaded from the top a few roots in each step, and the
+ * mutator never pops an unshaded slot, since the frame returned to is
+ * finished first. gc_root_fp is the frame in shading, or 0 when it's done.
+ */
+extern reg_t gc_root_fp;
+#  define GC_RETURN_BARRIER()             \
+    do                                    \
+      {                                   \
+        if (gc_root_fp == vm->fp)         \
+          gc_return_barrier (vm->stack);  \
+      }                                   \
+    while (0)
+#else
+#  define ODB_GC_STEP()
+#  define GC_SATB_BARRIER(obj)
+#  define GC_RETURN_BARRIER()
+#endif
+
+// NOTE: all the inner objects begin with gattr
+#define INNER_ATTR(value) ((gattr *)(value))
+
+#ifdef USE_GEN_GC
+/* NOTE:
+ * The minor GC doesn't walk the old objects, so storing an object into an old
+ * container must remember the container, say, list-set!. Between two GCs, the
+ * mark bit means the container is in the remembered set already.
+ */
+void gc_remember (gattr *attr);
+#  define GC_WRITE_BARRIER(value)                  \
+    do                                             \
+      {                                            \
+        gattr *a = INNER_ATTR (value);             \
+        if ((GEN_1_OBJ != a->gc) && !a->mark)      \
+          gc_remember (a);                         \
+      }                                            \
+    while (0)
+#else
+#  define GC_WRITE_BARRIER(value)
+#endif
+
+/* NOTE:
+ * The slot of a freed object is linked through its own memory, so the free
+ * stack takes no node of OLN, and the slot is booked again when it's reused.
+ * The attr is kept at the same place, and the gc is FREE_OBJ.
+ */
+typedef struct FreeSlot
 {
-  RB_ENTRY (ActiveRootNode) entry;
-  void *value;
-};
-
-struct Pre_ARN
+  oattr attr;
+  struct FreeSlot *next;
+} __packed FreeSlot, *free_slot_t;
+
+/* NOTE:
+ * The booked objects are in the live list, the GC relinks the freed ones to
+ * the free stack, so both allocation and release are O(1).
+ * The new objects are booked at the head, so the live list begins with the
+ * young objects, and `old' is the first node which survived a GC.
+ */
+typedef struct ObjectPool
 {
-  int index;
-  ActiveRootNode *arn[PRE_ARN];
-};
+  ListHead live;
+  free_slot_t free;
+#ifdef USE_GEN_GC
+  list_node_t old;
+#endif
+} ObjectPool;
 
 struct Pre_OLN
 {
@@ -70,28 +142,26 @@ struct Pre_OLN
   list_node_t oln[PRE_OLN];
 };
 
-static inline int active_root_compare (ActiveRootNode *a, ActiveRootNode *b)
+static inline void push_free_slot (ObjectPool *pool, void *obj)
 {
-  // NOTE: Don't use uintptr_t for minus comparison
-  return ((intptr_t)b->value - (intptr_t)a->value);
+  free_slot_t slot = (free_slot_t)obj;
+
+  slot->attr.gc = FREE_OBJ;
+  slot->next = pool->free;
+  pool->free = slot;
 }
 
-static inline list_node_t get_free_obj_node (ListHead *lst)
+static inline void *pop_free_slot (ObjectPool *pool)
 {
-  list_node_t node = NULL;
-
-  SLIST_FOREACH (node, lst, next)
-  {
-    /* NOTE: when it's free, gc is 0.
-     */
-    if (FREE_OBJ == node->obj->attr.gc)
-      {
-        node->obj->attr.gc = 1; // allocated, as the 1st generation
-        break;
-      }
-  }
-
-  return node;
+  free_slot_t slot = pool->free;
+
+  if (slot)
+    {
+      pool->free = slot->next;
+      slot->attr.gc = GEN_1_OBJ; // allocated, see collect in gc.c
+    }
+
+  return slot;
 }
 
 /* static inline list_node_t get_free_node (ListHead *lst) */
@@ -137,16 +207,26 @@ static inline list_node_t get_free_obj_node (ListHead *lst)
   while (0)
 
 static void object_list_node_recycle (list_node_t node);
-static void free_object_from_pool (ListHead *head, object_t o);
+static void free_object_from_pool (ObjectPool *pool, object_t o);
 void free_object (object_t obj);
 void gc_init (void);
 bool gc (const gc_info_t gci);
+#ifdef USE_INCREMENTAL_GC
+void gc_step (const gc_info_t gci);
+void gc_satb_shade (object_t obj);
+void gc_return_barrier (const u8_t *stack);
+#endif
 void gc_clean_cache (void);
 void *gc_pool_malloc (otype_t type);
 void gc_inner_obj_book (otype_t t, void *obj);
 void gc_obj_book (void *obj);
 void gc_try_to_recycle (void);
+#ifdef GC_RECYCLE_CURRENT_FRAME
 void gc_recycle_current_frame (const u8_t *stack, u32_t local, u32_t sp);
+#else
+// NOTE: the frames are left to the GC, so don't scan them on each call
+#  define gc_recycle_current_frame(...)
+#endif
 size_t object_list_node_available (void);
 list_node_t object_list_node_alloc (void);
 void gc_clean (void);
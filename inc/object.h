@@ -102,6 +102,7 @@ static inline bool is_unspecified (object_t obj)
 #define NEW_OBJ(t)                              \
   ({                                            \
     object_t obj = NULL;                        \
+    GC_STEP ();                                 \
     do                                          \
       {                                         \
         if (0 == object_list_node_available ()) \
@@ -121,6 +122,7 @@ static inline bool is_unspecified (object_t obj)
 #define NEW_INNER_OBJ(t)                        \
   ({                                            \
     t##_t x = NULL;                             \
+    GC_STEP ();                                 \
     do                                          \
       {                                         \
         if (0 == object_list_node_available ()) \
@@ -255,6 +257,41 @@ static inline bool is_unspecified (object_t obj)
 
 #define OBJ_IS_ON_STACK(o) ((o)->attr.gc)
 
+#ifdef USE_IMM_BOX
+/* NOTE:
+ * The range of the fixnums to be shared, the chars are shared in 0~127.
+ * Builders may define them in compiling, say, -D IMM_BOX_INT_MAX=1023
+ */
+#  ifndef IMM_BOX_INT_MIN
+#    define IMM_BOX_INT_MIN -16
+#  endif
+#  ifndef IMM_BOX_INT_MAX
+#    define IMM_BOX_INT_MAX 255
+#  endif
+#  define IMM_BOX_CHAR_MAX 127
+object_t imm_box (object_t obj);
+#  define IMM_BOX(obj) imm_box (obj)
+#else
+#  define IMM_BOX(obj) NULL
+#endif
+
+/* NOTE:
+ * Box the object to store it in a pair, a list or a vector. The immediates are
+ * shared by the permanent boxes with USE_IMM_BOX, the others are copied to a
+ * new object. The object must be still reachable, since NEW_OBJ may trigger GC.
+ */
+#define BOX_OBJ(t, obj, g)        \
+  ({                              \
+    object_t box = IMM_BOX (obj); \
+    if (!box)                     \
+      {                           \
+        box = NEW_OBJ (t);        \
+        *box = *(obj);            \
+        box->attr.gc = (g);       \
+      }                           \
+    box;                          \
+  })
+
 closure_t make_closure (u8_t arity, u8_t frame_size, reg_t entry);
 list_node_t animula_new_list_node (void);
 list_t animula_new_list (void);
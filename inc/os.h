@@ -144,12 +144,57 @@ int zephyr_stat (const char *path, struct fs_dirent *entry);
 #  define MEMORY_HARD_LIMIT           12000
 #endif
 
-#ifndef PRE_ARN
-#  define PRE_ARN 100
-#endif
-
 #ifndef PRE_OLN
 #  define PRE_OLN 100
 #endif
 
+#ifdef USE_GEN_GC
+/* NOTE:
+ * GC_MINOR_MAX minor collections are run between two full collections, the
+ * remembered set holds GC_REMSET_SIZE old containers at most. Builders may
+ * define them in compiling, say, -D GC_MINOR_MAX=4 -D GC_REMSET_SIZE=16
+ */
+#  ifndef GC_MINOR_MAX
+#    define GC_MINOR_MAX 8
+#  endif
+#  ifndef GC_REMSET_SIZE
+#    define GC_REMSET_SIZE 32
+#  endif
+#endif
+
+#ifdef USE_INCREMENTAL_GC
+/* NOTE:
+ * A cycle is begun when there're GC_START_OLN nodes left in OLN, then each
+ * allocation runs a step of GC_PAUSE_US microseconds at most. The clock is
+ * read every GC_STEP_WORK objects, and the gray stack holds GC_GRAY_SIZE
+ * objects. Builders may define them in compiling, say, -D GC_PAUSE_US=100
+ */
+#  ifndef GC_PAUSE_US
+#    define GC_PAUSE_US 200
+#  endif
+#  ifndef GC_START_OLN
+#    define GC_START_OLN (PRE_OLN / 2)
+#  endif
+#  ifndef GC_STEP_WORK
+#    define GC_STEP_WORK 16
+#  endif
+#  ifndef GC_GRAY_SIZE
+#    define GC_GRAY_SIZE 64
+#  endif
+#endif
+
+#ifdef USE_SLAB
+/* NOTE:
+ * The slab arena has SLAB_PAGES pages of SLAB_PAGE_SIZE bytes, each page serves
+ * only one size class. Builders may define them in compiling, say,
+ * -D SLAB_PAGE_SIZE=1024 -D SLAB_PAGES=16
+ */
+#  ifndef SLAB_PAGE_SIZE
+#    define SLAB_PAGE_SIZE 4096
+#  endif
+#  ifndef SLAB_PAGES
+#    define SLAB_PAGES 64
+#  endif
+#endif
+
 #endif // End of __ANIMULA_OS_H__
@@ -0,0 +1,243 @@
+#ifndef __ANIMULA_PREDECODE_H__
+#define __ANIMULA_PREDECODE_H__
+/*  Copyright (C) 2020-2021
+ *        "Mu Lei" known as "NalaGinrut" <NalaGinrut@gmail.com>
+ *  Animula is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Lesser General Public License as
+ *  published by the Free Software Foundation, either version 3 of the
+ *  License, or  (at your option) any later version.
+
+ *  Animula is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Lesser General Public License for more details.
+
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this program.
+ *  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "bytecode.h"
+#include "debug.h"
+#include "memory.h"
+#include "object.h"
+#include "os.h"
+#include "primitives.h"
+#include "types.h"
+
+/* NOTE:
+ * The pre-decoded stream is indexed by the byte offset of the instruction in
+ * the program segment, so vm->pc, the saved frames, the procedure objects and
+ * the closures keep using the same offsets as the raw bytecode.
+ * Only the entries which start an instruction are decoded, the others are
+ * INSN_RAW, so that any pc still has a correct meaning: INSN_RAW falls back to
+ * the bytecode interpreter on the raw bytes.
+ */
+typedef enum insn_op
+{
+  INSN_RAW = 0,
+  INSN_NOP,
+  INSN_LOCAL_REF,
+  INSN_LOCAL_ASSIGN,
+  INSN_FREE_REF,
+  INSN_FREE_ASSIGN,
+  INSN_CALL_LOCAL,
+  INSN_CALL_FREE,
+  INSN_PRELUDE,
+  INSN_GLOBAL_REF,
+  INSN_GLOBAL_ASSIGN,
+  INSN_CALL_GLOBAL,
+  INSN_CALL_PROC,
+  INSN_FJUMP,
+  INSN_JUMP,
+  INSN_CLOSURE_ON_HEAP,
+  INSN_PRIMITIVE,
+  INSN_RESTORE,
+  INSN_PUSH_CONST,
+  INSN_HALT,
+  /* NOTE:
+   * The superinstructions, see fuse_program in predecode.c.
+   * The fused entry covers the whole sequence, so len is the sum of the
+   * components, and the entries of the components are left intact for the
+   * jumps into the middle of the sequence.
+   */
+  INSN_LOCAL_PRIM,         // local a; primitive b
+  INSN_CONST_PRIM,         // const obj; primitive b
+  INSN_LOCAL_CONST_PRIM,   // local a; const obj; primitive b
+  INSN_PRIM_FJUMP,         // primitive b; fjump
+  INSN_LOCAL_CONST_FJUMP,  // local a; const obj; primitive b; fjump
+  INSN_GLOBAL_CALL_GLOBAL, // global a; call-global b
+  /* NOTE:
+   * The quickened ops for the fixnums, see quicken in vm.c.
+   * They're rewritten in place from the generic ones at run time, so they
+   * never appear in the verifier.
+   */
+  INSN_PRIM_INT,
+  INSN_LOCAL_PRIM_INT,
+  INSN_CONST_PRIM_INT,
+  INSN_LOCAL_CONST_PRIM_INT,
+  INSN_PRIM_FJUMP_INT,
+  INSN_LOCAL_CONST_FJUMP_INT,
+  /* NOTE:
+   * The register form, see to_register_form in predecode.c.
+   * The operands are read where they live rather than pushed, a is the
+   * first one, c is the second one, and b is the prim number.
+   */
+  INSN_PRIM_REG,       // push (prim b a c)
+  INSN_PRIM_REG_FJUMP, // fjump if (prim b a c) is false
+  /* NOTE:
+   * The tail-recursive call with the args moved in place, see fuse_tail_calls
+   * in predecode.c. a is the arity, b is the prelude descriptor, and c is the
+   * offset of the first arg.
+   */
+  INSN_TAIL_MOVE, // prelude b; arg ...; call-proc
+  /* NOTE:
+   * The call of a leaf procedure with the slim frame, see fuse_leaf_calls in
+   * predecode.c. a is the arity, and its prelude is rewritten into INSN_NOP.
+   */
+  INSN_LEAF_CALL, // call-proc
+  INSN_OP_MAX
+} insn_op_t;
+
+#define INSN_START   0x1  // the entry starts an instruction
+#define INSN_REACHED 0x2  // the instruction is reachable, see verifier.c
+#define INSN_HIT     0x4  // the counter of the quickening in the rest bits
+#define INSN_HITS    0xFC // see quicken in vm.c
+
+/* NOTE:
+ * The monomorphic inline cache of a call site, see op_call_cached in vm.c.
+ * The global call sites are valid while the version of the global is
+ * unchanged, see vm->gversion, the others are valid while the callee has the
+ * same type and value.
+ */
+typedef enum call_cache_kind
+{
+  IC_EMPTY = 0,
+  IC_PROC,       // procedure without optional args
+  IC_PROC_VARGS, // procedure with optional args
+  IC_PRIM,       // primitive
+  IC_CLOSURE     // closure on heap
+} call_cache_kind_t;
+
+typedef struct CallCache
+{
+  u8_t kind;   // call_cache_kind_t
+  u8_t type;   // the type of the callee
+  u16_t epoch; // the version of the global when it's filled
+  reg_t entry; // procedure entry
+  void *value; // the value of the callee
+} call_cache_t;
+
+typedef struct Insn
+{
+  u8_t op;    // insn_op_t
+  u8_t flags; // INSN_START, INSN_REACHED, INSN_HITS
+  u16_t len;  // the size of the raw encoding in bytes, 0 for INSN_RAW
+  u16_t need; // max stack growth from here in bytes, see verifier.c
+  /* NOTE:
+   * a: local offset, up of free var, global index, prim number, arity,
+   *    the objects popped by the raw pair, list or vector
+   * b: offset of free var, closure frame size, prelude descriptor,
+   *    prim number or global index of the superinstructions
+   * c: the second operand of the register form, the first arg of tail move
+   */
+  u16_t a;
+  u16_t b;
+  u16_t c;
+  union
+  {
+    reg_t target; // resolved jump, call or closure entry
+    prim_t prim;  // resolved primitive
+    Object obj;   // immediate object
+#ifdef USE_INLINE_CACHE
+    call_cache_t cache; // the call sites
+#endif
+  };
+} insn_t;
+
+#if defined USE_SUPERINSN && !defined USE_PREDECODE
+#  error "USE_SUPERINSN works on the pre-decoded program, define USE_PREDECODE!"
+#endif
+
+#if defined USE_INLINE_CACHE && !defined USE_PREDECODE
+#  error "USE_INLINE_CACHE works on the pre-decoded program, define USE_PREDECODE!"
+#endif
+
+#if defined USE_QUICKENING && !defined USE_PREDECODE
+#  error "USE_QUICKENING works on the pre-decoded program, define USE_PREDECODE!"
+#endif
+
+#if defined USE_CACHED_REGS && !defined USE_PREDECODE
+#  error "USE_CACHED_REGS works on the pre-decoded program, define USE_PREDECODE!"
+#endif
+
+#if defined USE_TAIL_MOVE && !defined USE_PREDECODE
+#  error "USE_TAIL_MOVE works on the pre-decoded program, define USE_PREDECODE!"
+#endif
+
+#define TAIL_MOVE_MAX 8 // the max arity of INSN_TAIL_MOVE
+
+#if defined USE_LEAF_FRAME && !defined USE_PREDECODE
+#  error "USE_LEAF_FRAME works on the pre-decoded program, define USE_PREDECODE!"
+#endif
+
+#if defined USE_REGISTER_IR && !defined USE_PREDECODE
+#  error "USE_REGISTER_IR works on the pre-decoded program, define USE_PREDECODE!"
+#endif
+
+/* NOTE:
+ * The operands of the register form, the kind is in the top 2 bits.
+ * REG_STACK is popped, so it's always before the others, and REG_CONST is
+ * kept in obj, so there's one at most.
+ */
+#define REG_STACK  0
+#define REG_LOCAL  1 // local offset
+#define REG_CONST  2
+#define REG_GLOBAL 3 // global index
+
+#define REG(kind, index) ((u16_t)(((kind) << 14) | (index)))
+#define REG_KIND(r)      ((r) >> 14)
+#define REG_INDEX(r)     ((r)&0x3FFF)
+#define REG_INDEX_MAX    0x3FFF
+
+#define INSN_IS_CALL(op)                                          \
+  (INSN_CALL_LOCAL == (op) || INSN_CALL_FREE == (op)              \
+   || INSN_CALL_GLOBAL == (op) || INSN_GLOBAL_CALL_GLOBAL == (op))
+
+// The primitives which take 2 objects and return one
+#define PRIM_IS_ARITH2(pn) (int_add <= (pn) && (pn) <= fract_div)
+#define PRIM_IS_LOGIC2(pn)                                         \
+  ((int_eq <= (pn) && (pn) <= int_ge) || eqv == (pn) || eq == (pn) \
+   || equal == (pn))
+
+// The primitives which have the fixnum fast path
+#define PRIM_IS_QUICK(pn) \
+  ((int_add <= (pn) && (pn) <= int_mul) || (int_eq <= (pn) && (pn) <= int_ge))
+
+#define INSN_IS_BRANCH(op)                                          \
+  (INSN_FJUMP == (op) || INSN_JUMP == (op) || INSN_PRIM_FJUMP == (op) \
+   || INSN_LOCAL_CONST_FJUMP == (op) || INSN_PRIM_FJUMP_INT == (op)   \
+   || INSN_LOCAL_CONST_FJUMP_INT == (op) || INSN_PRIM_REG_FJUMP == (op))
+
+/* NOTE:
+ * The fused branches keep the target in the fjump entry, which is the last
+ * 3 bytes of the sequence, since the union is taken by the other operands.
+ * The wide branches of PC_SIZE 4 copy the target to that entry as well.
+ */
+static inline reg_t insn_branch_target (const insn_t *insns, reg_t pc)
+{
+  const insn_t *insn = &insns[pc];
+
+  if (INSN_FJUMP == insn->op || INSN_JUMP == insn->op)
+    return insn->target;
+
+  return insns[pc + insn->len - 3].target;
+}
+
+insn_t *decode_program (const u8_t *code, size_t size);
+#ifdef USE_LEAF_FRAME
+void fuse_leaf_calls (insn_t *insns, size_t size);
+#endif
+insn_t *predecode_program (const u8_t *code, size_t size);
+
+#endif // End of __ANIMULA_PREDECODE_H__
@@ -195,8 +195,8 @@ typedef struct Primitive
 {
 #if defined ANIMULA_DEBUG
   char name[PRIM_NAME_SIZE];
-  u8_t arity;
 #endif
+  u8_t arity; // the popped args, see stack_effect in verifier.c
   void *fn;
 } __packed *prim_t;
 
@@ -222,9 +222,8 @@ static inline void def_prim (u16_t pn, const char *name, u8_t arity, void *fn)
   size_t len = os_strnlen (name, PRIM_NAME_SIZE);
   os_memcpy (prim->name, name, len);
   // #  pragma GCC diagnostic pop
-
-  prim->arity = arity;
 #endif
+  prim->arity = arity;
   prim->fn = fn;
   GLOBAL_REF (prim_table)[pn] = prim;
 }
@@ -20,6 +20,11 @@
 #include "os.h"
 #include "qlist.h"
 
+#ifdef USE_BUDGET
+// for the preemption flag, see vm_preempt
+#  include <signal.h>
+#endif
+
 #define PERMANENT_OBJ 3
 #define GEN_2_OBJ     2
 #define GEN_1_OBJ     1
@@ -32,7 +37,6 @@
 #  include <stddef.h>
 #  include <vos/zephyr_types.h>
 #  include <zephyr/types.h>
-typedef u16_t reg_t;
 
 #elif defined ANIMULA_LINUX
 #  define CONFIG_HEAP_MEM_POOL_SIZE 90000
@@ -50,6 +54,36 @@ typedef u16_t reg_t;
 #  endif
 #endif
 
+/* NOTE:
+ * The registers (pc, sp, fp and local) are PC_SIZE bytes. The default 2 keeps
+ * the frames small for the MCUs, it limits the code, the stack and the globals
+ * to 64KB. PC_SIZE 4 is for the big programs, the targets beyond 64KB are
+ * encoded with the wide encoding, see bytecode.h.
+ */
+#ifndef PC_SIZE
+#  define PC_SIZE 2
+#endif
+
+#if (4 == PC_SIZE)
+#  define PUSH_REG    PUSH_U32
+#  define POP_REG     POP_U32
+#  define TOP_REG     TOP_U32
+#  define NORMAL_JUMP 0xFFFFFFFF
+#  define REG_BIT     32
+#  define NO_PREV_FP  0xFFFFFFFF
+typedef u32_t reg_t;
+#elif (2 == PC_SIZE)
+#  define PUSH_REG    PUSH_U16
+#  define POP_REG     POP_U16
+#  define TOP_REG     TOP_U16
+#  define NORMAL_JUMP 0xFFFF
+#  define REG_BIT     16
+#  define NO_PREV_FP  0xFFFF
+typedef u16_t reg_t;
+#else
+#  error "PC_SIZE must be 2 or 4!"
+#endif
+
 enum obj_encoding
 {
   FALSE = 0,
@@ -134,17 +168,46 @@ typedef union ObjectAttribute
   u8_t all;
 } __packed oattr;
 
+/* NOTE:
+ * The header of the inner objects, say, the closure, the list, the pair, the
+ * vector and the bytevectors. Their types fit in 5 bits, so the spare bit is
+ * taken by the mark phase of the GC, and the gc bits are at the same place
+ * as oattr.
+ */
+typedef union GCAttribute
+{
+  struct
+  {
+    unsigned type : 5;
+    unsigned mark : 1; // reached in the mark phase, see gc.c
+    unsigned gc : 2;
+  };
+  u8_t all;
+} __packed gattr;
+
 typedef union Procedure
 {
   struct
   {
     unsigned arity : 8;
     unsigned opt : 8;
+#if (4 == PC_SIZE)
+    unsigned entry : 32;
+  };
+  u64_t all;
+#else
     unsigned entry : 16;
   };
   u32_t all;
+#endif
 } __packed Procedure, *procedure_t;
 
+/* NOTE:
+ * The Object is packed to 9 bytes on 64-bit hosts by default, it saves the
+ * RAM of the MCUs, but every value on the stack is unaligned. USE_ALIGNED_OBJECT
+ * keeps the natural layout, the value is word aligned and the Object is 16
+ * bytes, and the frames are padded to keep the stack slots aligned, see FPS.
+ */
 typedef struct Object
 {
   oattr attr;
@@ -153,11 +216,16 @@ typedef struct Object
     void *value;
     Procedure proc;
   };
-} __packed Object, *object_t;
+}
+#ifdef USE_ALIGNED_OBJECT
+Object, *object_t;
+#else
+__packed Object, *object_t;
+#endif
 
 typedef struct Closure
 {
-  oattr attr;
+  gattr attr;
   u8_t arity;
   u8_t frame_size;
   reg_t entry;
@@ -195,7 +263,7 @@ typedef struct ListNode
 
 typedef struct List
 {
-  oattr attr;
+  gattr attr;
   /* NOTE:
    *   The count of the non-shared elements.
    *   It's used for the index of the shared list, 0 for no.
@@ -206,28 +274,28 @@ typedef struct List
 
 typedef struct Pair
 {
-  oattr attr;
+  gattr attr;
   object_t car;
   object_t cdr;
 } __packed Pair, *pair_t;
 
 typedef struct Vector
 {
-  oattr attr;
+  gattr attr;
   u16_t size;
   object_t *vec;
 } __packed Vector, *vector_t;
 
 typedef struct ByteVector
 {
-  oattr attr;
+  gattr attr;
   u16_t size;
   u8_t *vec;
 } __packed ByteVector, *bytevector_t;
 
 typedef struct MutByteVector
 {
-  oattr attr;
+  gattr attr;
   u16_t size;
   u8_t *vec;
 } __packed MutByteVector, *mut_bytevector_t;
@@ -264,33 +332,45 @@ typedef union ieee754_float
   };
 } real_t;
 
-#ifndef PC_SIZE
-#  define PC_SIZE 2
-#  if (4 == PC_SIZE)
-#    define PUSH_REG    PUSH_U32
-#    define POP_REG     POP_U32
-#    define TOP_REG     TOP_U32
-#    define NORMAL_JUMP 0xFFFFFFFF
-#    define REG_BIT     32
-#    define NO_PREV_FP  0xFFFFFFFF
-typedef u32_t reg_t;
-#  endif
-#  if (2 == PC_SIZE)
-#    define PUSH_REG    PUSH_U16
-#    define POP_REG     POP_U16
-#    define TOP_REG     TOP_U16
-#    define NORMAL_JUMP 0xFFFF
-#    define REG_BIT     16
-#    define NO_PREV_FP  0xFFFF
-typedef u16_t reg_t;
-#  endif
-#endif
-
 /* Frame Pre-store Size =
  * sizeof(pc) + sizeof(fp) + sizeof(local) + sizeof(attr) + sizeof(closure_t)
  */
-#define FPS       (3 * sizeof (reg_t) + 1 + sizeof (closure_t))
-#define NEXT_FP() (*((reg_t *)(stack + fp + sizeof (reg_t))))
+#define FRAME_RAW (3 * sizeof (reg_t) + 1 + sizeof (closure_t))
+
+#ifdef USE_ALIGNED_OBJECT
+/* NOTE:
+ * The pad is pushed after the attr, so the closure is the last word of the
+ * frame as before, and the locals above the frame start at a slot boundary.
+ * The slim frame of the leaf procedures is padded the same way.
+ */
+#  define SLOT_PAD(size) \
+    ((sizeof (Object) - (size) % sizeof (Object)) % sizeof (Object))
+#else
+#  define SLOT_PAD(size) 0
+#endif
+
+#define FRAME_PAD SLOT_PAD (FRAME_RAW)
+#define FPS       (FRAME_RAW + FRAME_PAD)
+
+/* NOTE:
+ * The offsets of the saved registers in the frame, in the order of SAVE_ENV,
+ * which pushes pc, local, last_fp, attr, the pad, then the closure.
+ */
+#define FRAME_PC      0
+#define FRAME_LOCAL   sizeof (reg_t)
+#define FRAME_LAST_FP (2 * sizeof (reg_t))
+#define FRAME_ATTR    (3 * sizeof (reg_t))
+#define FRAME_CLOSURE (FPS - sizeof (closure_t))
+
+#define FRAME_REG(stack, fp, slot) (*((reg_t *)((stack) + (fp) + (slot))))
+#define FRAME_CLOSURE_OF(stack, fp) \
+  (*((closure_t *)((stack) + (fp) + FRAME_CLOSURE)))
+
+#define NEXT_FP() FRAME_REG (stack, fp, FRAME_LAST_FP)
+
+#ifdef USE_DISPLAY
+#  define DISPLAY_SIZE 8 // the deeper frames are walked from the last one
+#endif
 
 #define LIST_OBJECT_HEAD(o) (&(((list_t) (o)->value)->list))
 #define LIST_OBJECT_SIDX(o) (((list_t) (o)->value)->non_shared)
@@ -327,7 +407,8 @@ typedef enum encode_type
   DOUBLE,
   TRIPLE,
   QUADRUPLE,
-  SPECIAL
+  SPECIAL,
+  WIDE
 } encode_t;
 
 // FIXME: tweak bit-fields order by bits endian
@@ -474,6 +555,34 @@ typedef struct LambdaVM
   object_t globals; // global table
   symtab_t symtab;
   closure_t closure; // for closure
+#ifdef USE_PREDECODE
+  struct Insn *insns; // pre-decoded program, indexed by pc
+#endif
+#ifdef USE_JIT
+  struct Jit *jit; // see jit.c
+#endif
+#ifdef USE_AOT
+  void (**aot) (struct LambdaVM *); // the translated code of each pc, see aot.h
+#endif
+#ifdef USE_DISPLAY
+  u8_t depth;                  // the valid entries of display
+  reg_t display[DISPLAY_SIZE]; // the walked frames of vm->fp, see vm.h
+#endif
+#ifdef USE_INLINE_CACHE
+  u16_t *gversion; // the version of each global, bumped when it's assigned
+#endif
+#ifdef USE_STACK_GROW
+  size_t stack_size; // the bytes allocated to stack, see vm_stack_grow
+#endif
+#ifdef USE_LEAF_FRAME
+  reg_t leaf; // the top of the slim frame of the running leaf, or 0
+#endif
+#ifdef USE_BUDGET
+  u32_t budget;  // the reductions left before yielding, see vm.h
+  u32_t quantum; // the budget refilled by vm_resume, 0 for no limit
+  u8_t nested;   // the depth of apply_proc, which never yields
+  volatile sig_atomic_t preempt; // set by vm_preempt, cleared by the yield
+#endif
   union VM_Attr
   {
     struct
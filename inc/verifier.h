@@ -0,0 +1,37 @@
+#ifndef __ANIMULA_VERIFIER_H__
+#define __ANIMULA_VERIFIER_H__
+/*  Copyright (C) 2020-2021
+ *        "Mu Lei" known as "NalaGinrut" <NalaGinrut@gmail.com>
+ *  Animula is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Lesser General Public License as
+ *  published by the Free Software Foundation, either version 3 of the
+ *  License, or  (at your option) any later version.
+
+ *  Animula is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Lesser General Public License for more details.
+
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this program.
+ *  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "predecode.h"
+#include "types.h"
+
+#if defined USE_VERIFIER && !defined USE_PREDECODE
+#  error "USE_VERIFIER works on the pre-decoded program, define USE_PREDECODE!"
+#endif
+
+/* NOTE:
+ * The primitives may push a few things (frames, continuation and arguments)
+ * before they enter a procedure by apply_proc, which is checked again.
+ * The slack is added to every stack check on entry to cover them.
+ */
+#define VM_STACK_SLACK (2 * FPS + 4 * sizeof (Object))
+
+bool verify_program (insn_t *insns, size_t size, reg_t entry,
+                     insn_t *globals, size_t gsize);
+
+#endif // End of __ANIMULA_VERIFIER_H__
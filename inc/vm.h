@@ -20,14 +20,17 @@
 #include "bytecode.h"
 #include "debug.h"
 #include "gc.h"
+#include "jit.h"
 #include "lef.h"
 #include "lib.h"
 #include "memory.h"
 #include "object.h"
 #include "os.h"
+#include "predecode.h"
 #include "primitives.h"
 #include "symbol.h"
 #include "types.h"
+#include "verifier.h"
 
 extern GLOBAL_DEF (size_t, VM_CODESEG_SIZE);
 extern GLOBAL_DEF (size_t, VM_DATASEG_SIZE);
@@ -42,6 +45,14 @@ extern GLOBAL_DEF (size_t, VM_STKSEG_SIZE);
     .attr = {.gc = GEN_1_OBJ } \
   }
 
+/* NOTE:
+ * Threaded dispatch relies on "labels as values", which is only available in
+ * GCC and Clang. Other compilers fall back to the switch-based dispatch.
+ */
+#if defined USE_THREADED_DISPATCH && defined __GNUC__
+#  define VM_THREADED_DISPATCH 1
+#endif
+
 #define FETCH_NEXT_BYTECODE() (vm->fetch_next_bytecode (vm))
 
 #define NEXT_DATA() ((vm->fetch_next_bytecode (vm)).all)
@@ -54,28 +65,101 @@ extern GLOBAL_DEF (size_t, VM_STKSEG_SIZE);
     }                                          \
   while (0)
 
+#ifdef USE_STACK_GROW
+/* NOTE:
+ * The stack starts from VM_STKSEG_INIT bytes, and it's doubled by the checks
+ * when it's short, up to VM_STKSEG_SIZE. RESTORE halves it again when the
+ * recursion unwinds to the quarter of it, see vm_stack_grow in vm.c.
+ * The frames, the locals and the closures only keep the offsets, so the stack
+ * is moved as a whole. Don't keep a pointer into the stack across a push or a
+ * call.
+ */
+#  ifndef VM_STKSEG_INIT
+#    define VM_STKSEG_INIT 512
+#  endif
+
+void vm_stack_grow (vm_t vm, size_t need);
+void vm_stack_shrink (vm_t vm);
+
+#  define VM_STACK_SIZE() (vm->stack_size)
+#  define STACK_SHRINK()                         \
+    do                                           \
+      {                                          \
+        if (vm->stack_size > VM_STKSEG_INIT      \
+            && vm->sp < (vm->stack_size >> 2))   \
+          vm_stack_shrink (vm);                  \
+      }                                          \
+    while (0)
+#else
+#  define VM_STACK_SIZE() GLOBAL_REF (VM_STKSEG_SIZE)
+#  define STACK_SHRINK()
+#endif
+
 static inline void vm_stack_check (vm_t vm)
 {
+#ifdef USE_STACK_GROW
+  // NOTE: the push is checked after the store, so keep the room for the next
+  if (vm->stack_size < vm->sp + sizeof (Object))
+    vm_stack_grow (vm, vm->sp + sizeof (Object));
+#else
   if (GLOBAL_REF (VM_STKSEG_SIZE) <= vm->sp)
     PANIC ("Stack overflow!\n");
+#endif
+}
+
+/* NOTE:
+ * The verified code checks the stack on procedure entry for the max growth
+ * of the procedure, so the pushes don't have to check it.
+ */
+#ifdef USE_VERIFIER
+static inline void vm_entry_check (vm_t vm, reg_t entry)
+{
+  size_t need = vm->sp + vm->insns[entry].need + VM_STACK_SLACK;
+
+  if (VM_STACK_SIZE () < need)
+#  ifdef USE_STACK_GROW
+    vm_stack_grow (vm, need);
+#  else
+    PANIC ("Stack overflow!\n");
+#  endif
 }
+#  define ENTRY_STACK_CHECK(entry) vm_entry_check (vm, (entry))
+#  define PUSH_STACK_CHECK()
+#else
+#  define ENTRY_STACK_CHECK(entry)
+#  define PUSH_STACK_CHECK() vm_stack_check (vm)
+#endif
 
 // NOTE: vm->sp always points to the first blank
 #define PUSH(data)                  \
   do                                \
     {                               \
       vm->stack[vm->sp++] = (data); \
-      vm_stack_check (vm);          \
+      PUSH_STACK_CHECK ();          \
     }                               \
   while (0)
 
+#ifdef USE_ALIGNED_OBJECT
+#  define PUSH_PAD(size)     \
+    do                       \
+      {                      \
+        vm->sp += (size);    \
+        PUSH_STACK_CHECK (); \
+      }                      \
+    while (0)
+#  define POP_PAD(size) (vm->sp -= (size))
+#else
+#  define PUSH_PAD(size)
+#  define POP_PAD(size)
+#endif
+
 #define TOP() (vm->stack[vm->sp - 1])
 
 #define POP() (vm->stack[--vm->sp])
 
 #define TOPx(t, size)             (*((t *)(vm->stack + vm->sp - size)))
 #define TOPxp(t, size)            ((t *)(vm->stack + vm->sp - size))
-#define TOP_FROMxp(from, t, size) ((t *)(vm->stack + vm->sp + (from)-size))
+#define TOP_FROMxp(from, t, size) ((t *)(vm->stack + (from)-size))
 
 #define POPx(t, size)             \
   ({                              \
@@ -94,7 +178,7 @@ static inline void vm_stack_check (vm_t vm)
     {                                              \
       *((t *)(vm->stack + vm->sp)) = ((t) (data)); \
       vm->sp += (size);                            \
-      vm_stack_check (vm);                         \
+      PUSH_STACK_CHECK ();                         \
     }                                              \
   while (0)
 
@@ -103,7 +187,7 @@ static inline void vm_stack_check (vm_t vm)
     {                                                       \
       *((t *)(vm->stack + (from) + vm->sp)) = ((t) (data)); \
       vm->sp += (size);                                     \
-      vm_stack_check (vm);                                  \
+      PUSH_STACK_CHECK ();                                  \
     }                                                       \
   while (0)
 
@@ -161,6 +245,51 @@ static inline void vm_stack_check (vm_t vm)
 // LOCAL_FIX is only for debug since it doesn't print stored REG.
 #define LOCAL_FIX(offset) (&((object_t) (vm->stack + vm->fp + FPS))[offset])
 
+/* NOTE:
+ * Return the frame of (free up n), which is found by walking the saved frames
+ * up+1 times from vm->fp.
+ * With USE_DISPLAY, the walked frames are cached in the display, display[i]
+ * is the frame after i+1 steps. It's filled by the first free var reference
+ * of the frame, and dropped whenever vm->fp is changed, see DISPLAY_FLUSH,
+ * since the saved frames are never changed while their callees are alive.
+ */
+static inline reg_t ancestor_fp (vm_t vm, u8_t up)
+{
+#ifdef USE_DISPLAY
+  if (up < vm->depth)
+    return vm->display[up];
+
+  u8_t i = vm->depth;
+  reg_t fp = i ? vm->display[i - 1] : vm->fp;
+
+  for (; i <= up; i++)
+    {
+      fp = FRAME_REG (vm->stack, fp, FRAME_LAST_FP);
+
+      if (i < DISPLAY_SIZE)
+        {
+          vm->display[i] = fp;
+          vm->depth = i + 1;
+        }
+    }
+#else
+  reg_t fp = vm->fp;
+
+  for (int i = 0; i <= up; i++)
+    {
+      fp = FRAME_REG (vm->stack, fp, FRAME_LAST_FP);
+    }
+#endif
+
+  return fp;
+}
+
+#ifdef USE_DISPLAY
+#  define DISPLAY_FLUSH() (vm->depth = 0)
+#else
+#  define DISPLAY_FLUSH()
+#endif
+
 /* NOTE:
  * Because vm->local is activate iff the actual calling occurs, so (free 0 n)
  * will refer the current frame. And because the offset of free-var doesn't
@@ -178,11 +307,8 @@ static inline void vm_stack_check (vm_t vm)
       }                                                                        \
     else                                                                       \
       {                                                                        \
-        for (int i = 0; i <= up; i++)                                          \
-          {                                                                    \
-            fp = *((reg_t *)(vm->stack + fp + sizeof (reg_t)));                \
-          }                                                                    \
-        closure = *((closure_t *)(vm->stack + fp + FPS - sizeof (closure_t))); \
+        fp = ancestor_fp (vm, up);                                             \
+        closure = FRAME_CLOSURE_OF (vm->stack, fp);                            \
         if (closure && closure->frame_size)                                    \
           {                                                                    \
             if (offset >= closure->frame_size)                                 \
@@ -243,6 +369,43 @@ static inline void vm_stack_check (vm_t vm)
     }                    \
   while (0)
 
+#ifdef USE_BUDGET
+/* NOTE:
+ * The budget is the count of the reductions, say, the calls and the backward
+ * branches, before the VM yields to the host with VM_PAUSE. The pc has been
+ * moved to the next instruction then, so vm_resume continues from vm->pc.
+ * 0 means no limit. vm_preempt may be called from an interrupt or a signal
+ * handler, it only sets the preempt flag, since the decrement of the budget
+ * isn't atomic and a store to it could be lost.
+ */
+void vm_yield (vm_t vm);
+#  define BUDGET_TICK()                                       \
+    do                                                        \
+      {                                                       \
+        if (vm->preempt || (vm->budget && 0 == --vm->budget)) \
+          vm_yield (vm);                                      \
+      }                                                       \
+    while (0)
+#  define BUDGET_PAUSED() (VM_PAUSE == vm->state)
+#else
+#  define BUDGET_TICK() \
+    do                  \
+      {                 \
+      }                 \
+    while (0)
+#  define BUDGET_PAUSED() false
+#endif
+
+// The branch, the backward one takes the budget
+#define BRANCH(offset)       \
+  do                         \
+    {                        \
+      if ((offset) < vm->pc) \
+        BUDGET_TICK ();      \
+      JUMP (offset);         \
+    }                        \
+  while (0)
+
 #define PROC_CALL(offset)       \
   do                            \
     {                           \
@@ -250,12 +413,23 @@ static inline void vm_stack_check (vm_t vm)
         {                       \
           COPY_SHADOW_FRAME (); \
         }                       \
-      vm->closure = NULL;       \
-      vm->local = vm->fp + FPS; \
-      JUMP (offset);            \
+      PROC_ENTER (offset);      \
     }                           \
   while (0)
 
+// Enter the procedure when the args are in place
+#define PROC_ENTER(offset)        \
+  do                              \
+    {                             \
+      vm->closure = NULL;         \
+      vm->local = vm->fp + FPS;   \
+      ENTRY_STACK_CHECK (offset); \
+      JIT_HOT (offset);           \
+      BUDGET_TICK ();             \
+      JUMP (offset);              \
+    }                             \
+  while (0)
+
 /* Convention:
  * 1. Save sp to fp to restore the last frame
  * 2. Save pc to stack[fp] as the return address
@@ -289,11 +463,11 @@ static inline void vm_stack_check (vm_t vm)
 #define NORMAL_CALL   2
 #define PROC_ARITY(b) (((b)&0xFC) >> 2)
 #define PROC_MODE(b)  ((b)&0x3)
-#define SAVE_ENV()                                                   \
+#define SAVE_ENV(desc)                                               \
   do                                                                 \
     {                                                                \
-      u8_t arity = PROC_ARITY (bc.bc2);                              \
-      u8_t mode = PROC_MODE (bc.bc2);                                \
+      u8_t arity = PROC_ARITY (desc);                                \
+      u8_t mode = PROC_MODE (desc);                                  \
       switch (mode)                                                  \
         {                                                            \
         case TAIL_CALL:                                              \
@@ -315,14 +489,16 @@ static inline void vm_stack_check (vm_t vm)
             PUSH_REG (vm->local);                                    \
             PUSH_REG (sp ? (vm->fp ? vm->fp : NO_PREV_FP) : vm->fp); \
             PUSH (vm->attr.all);                                     \
+            PUSH_PAD (FRAME_PAD);                                    \
             PUSH_CLOSURE (vm->closure);                              \
             vm->attr.shadow = 0;                                     \
             vm->fp = vm->sp - FPS;                                   \
+            DISPLAY_FLUSH ();                                        \
             vm->attr.mode = NORMAL_CALL;                             \
             break;                                                   \
           }                                                          \
         }                                                            \
-      vm_stack_check (vm);                                           \
+      PUSH_STACK_CHECK ();                                           \
     }                                                                \
   while (0)
 
@@ -333,8 +509,10 @@ static inline void vm_stack_check (vm_t vm)
       PUSH_REG (vm->local);       \
       PUSH_REG (vm->fp);          \
       PUSH (vm->attr.all);        \
+      PUSH_PAD (FRAME_PAD);       \
       PUSH_CLOSURE (vm->closure); \
       vm->fp = vm->sp - FPS;      \
+      DISPLAY_FLUSH ();           \
       vm->local = vm->sp;         \
     }                             \
   while (0)
@@ -345,20 +523,30 @@ static inline void vm_stack_check (vm_t vm)
       Object ret_obj = POP_OBJ ();  \
       vm->sp = vm->fp + FPS;        \
       vm->closure = POP_CLOSURE (); \
+      POP_PAD (FRAME_PAD);          \
       vm->attr.all = POP ();        \
       vm->fp = POP_REG ();          \
+      DISPLAY_FLUSH ();             \
       vm->local = POP_REG ();       \
       vm->pc = POP_REG ();          \
+      GC_RETURN_BARRIER ();         \
       PUSH_OBJ (ret_obj);           \
     }                               \
   while (0)
 
-#define FIX_PC()                                           \
-  do                                                       \
-    {                                                      \
-      if (NORMAL_JUMP == *((reg_t *)(vm->stack + vm->fp))) \
-        *((reg_t *)(vm->stack + vm->fp)) = (reg_t)vm->pc;  \
-    }                                                      \
+/* NOTE:
+ * The procedure called by map and for-each returns to RESUME_PC, then the
+ * interpreter resumes the primitive, see tramp_resume in vm.c.
+ * It must be neither NORMAL_JUMP nor a pc in the code segment.
+ */
+#define RESUME_PC (NORMAL_JUMP - 1)
+
+#define FIX_PC()                                                  \
+  do                                                              \
+    {                                                             \
+      if (NORMAL_JUMP == FRAME_REG (vm->stack, vm->fp, FRAME_PC)) \
+        FRAME_REG (vm->stack, vm->fp, FRAME_PC) = (reg_t)vm->pc;  \
+    }                                                             \
   while (0)
 
 #define IS_PRIM(obj, prim) \
@@ -412,26 +600,84 @@ static inline void vm_stack_check (vm_t vm)
  * frame.
  */
 //      gc_recycle_current_frame (vm->stack, vm->fp + FPS, vm->sp);
+#ifdef USE_LEAF_FRAME
+/* NOTE:
+ * The slim frame of a leaf procedure, see fuse_leaf_calls in predecode.c.
+ * The return pc, the local and the closure of the caller are pushed above the
+ * args, and vm->leaf is the top of it. A leaf never calls, so there's one slim
+ * frame at most, and RESTORE takes it when vm->leaf is set. The args are
+ * dropped as the normal frame.
+ */
+#  define LEAF_PAD SLOT_PAD (2 * sizeof (reg_t) + sizeof (closure_t))
+#  define LEAF_CALL(arity, entry)                         \
+    do                                                    \
+      {                                                   \
+        reg_t local = vm->sp - (arity) * sizeof (Object); \
+        PUSH_REG (vm->pc);                                \
+        PUSH_REG (vm->local);                             \
+        PUSH_PAD (LEAF_PAD);                              \
+        PUSH_CLOSURE (vm->closure);                       \
+        vm->leaf = vm->sp;                                \
+        vm->local = local;                                \
+        vm->closure = NULL;                               \
+        ENTRY_STACK_CHECK (entry);                        \
+        JIT_HOT (entry);                                  \
+        BUDGET_TICK ();                                   \
+        JUMP (entry);                                     \
+      }                                                   \
+    while (0)
+
+#  define LEAF_RESTORE()                \
+    do                                  \
+      {                                 \
+        Object ret_obj = POP_OBJ ();    \
+        reg_t local = vm->local;        \
+        vm->sp = vm->leaf;              \
+        vm->leaf = 0;                   \
+        vm->closure = POP_CLOSURE ();   \
+        POP_PAD (LEAF_PAD);             \
+        vm->local = POP_REG ();         \
+        vm->pc = POP_REG ();            \
+        vm->sp = local;                 \
+        PUSH_OBJ (ret_obj);             \
+      }                                 \
+    while (0)
+
+#  define IS_LEAF_FRAME() (vm->leaf)
+#else
+#  define LEAF_RESTORE()
+#  define IS_LEAF_FRAME() false
+#endif
+
 #define RESTORE()                                                 \
   do                                                              \
     {                                                             \
+      if (IS_LEAF_FRAME ())                                       \
+        {                                                         \
+          LEAF_RESTORE ();                                        \
+          break;                                                  \
+        }                                                         \
       Object ret_obj = POP_OBJ ();                                \
-      gc_recycle_current_frame (vm->stack, vm->fp + FPS, vm->sp); \
-      vm->sp = vm->fp + FPS;                                      \
-      vm->closure = POP_CLOSURE ();                               \
-      vm->attr.all = POP ();                                      \
-      vm->fp = POP_REG ();                                        \
+      reg_t fp = vm->fp;                                          \
+      gc_recycle_current_frame (vm->stack, fp + FPS, vm->sp);     \
+      vm->closure = FRAME_CLOSURE_OF (vm->stack, fp);             \
+      vm->attr.all = vm->stack[fp + FRAME_ATTR];                  \
+      vm->fp = FRAME_REG (vm->stack, fp, FRAME_LAST_FP);          \
       vm->fp = (NO_PREV_FP == vm->fp ? 0 : vm->fp);               \
-      vm->local = POP_REG ();                                     \
-      vm->pc = POP_REG ();                                        \
+      DISPLAY_FLUSH ();                                           \
+      vm->local = FRAME_REG (vm->stack, fp, FRAME_LOCAL);         \
+      vm->pc = FRAME_REG (vm->stack, fp, FRAME_PC);               \
+      vm->sp = fp;                                                \
+      GC_RETURN_BARRIER ();                                       \
       PUSH_OBJ (ret_obj);                                         \
+      STACK_SHRINK ();                                            \
     }                                                             \
   while (0)
 
 #define CALL_PROCEDURE(obj)           \
   do                                  \
     {                                 \
-      u16_t offset = obj->proc.entry; \
+      reg_t offset = obj->proc.entry; \
       PROC_CALL (offset);             \
     }                                 \
   while (0)
@@ -449,8 +695,8 @@ static inline void vm_stack_check (vm_t vm)
 
 #define COUNT_ARGS() (vm->sp - vm->fp + FPS) / sizeof (Object)
 
-#define IS_PROC_END(bc) \
-  (IS_SPECIAL (bc) && (PRIMITIVE == (bc).type) && (restore == (bc).data))
+// the `restore' primitive, 1100 1110
+#define IS_PROC_END(bc) (((PRIMITIVE << 4) | restore) == (bc).all)
 
 static inline void call_closure_on_stack (vm_t vm, object_t obj)
 {
@@ -499,14 +745,83 @@ static inline void call_closure_on_heap (vm_t vm, object_t obj)
 
   closure->local = vm->local;
   vm->closure = closure;
+  ENTRY_STACK_CHECK (entry);
+  JIT_HOT (entry);
+  BUDGET_TICK ();
   JUMP (entry);
 }
 
+/* NOTE:
+ * The fixnum fast path, which must compute exactly like the imm_int case of
+ * the generic primitives. It returns false for the other types and the
+ * overflow, which the generic primitives turn into real.
+ * It's shared by the quickened ops and the code translated by lef2c.
+ */
+static inline bool prim2_int (pn_t pn, object_t o1, object_t o2, object_t ret)
+{
+  if (imm_int != o1->attr.type || imm_int != o2->attr.type)
+    return false;
+
+  imm_int_t x = (imm_int_t)o1->value;
+  imm_int_t y = (imm_int_t)o2->value;
+  s64_t result = 0;
+  bool b = false;
+
+  switch (pn)
+    {
+    case int_add:
+      result = (s64_t)x + (s64_t)y;
+      break;
+    case int_sub:
+      if (MIN_INT32 == y)
+        return false;
+      result = (s64_t)x - (s64_t)y;
+      break;
+    case int_mul:
+      result = (s64_t)x * (s64_t)y;
+      break;
+    case int_eq:
+      b = (x == y);
+      goto logic;
+    case int_lt:
+      b = (x < y);
+      goto logic;
+    case int_gt:
+      b = (x > y);
+      goto logic;
+    case int_le:
+      b = (x <= y);
+      goto logic;
+    case int_ge:
+      b = (x >= y);
+      goto logic;
+    default:
+      return false;
+    }
+
+  if ((s32_t)result != result)
+    return false;
+
+  ret->attr.type = imm_int;
+  ret->attr.gc = FREE_OBJ;
+  ret->value = (void *)(imm_int_t)(s32_t)result;
+  return true;
+
+logic:
+  *ret = b ? GLOBAL_REF (true_const) : GLOBAL_REF (false_const);
+  return true;
+}
+
 void vm_init (vm_t vm);
 void vm_init_environment (vm_t vm);
 void vm_clean (vm_t vm);
 void vm_restart (vm_t vm);
 void vm_run (vm_t vm);
+#ifdef USE_BUDGET
+void vm_set_budget (vm_t vm, u32_t quantum);
+void vm_preempt (vm_t vm);
+bool vm_resume (vm_t vm);
+#endif
 void vm_load_lef (vm_t vm, lef_t lef);
 void apply_proc (vm_t vm, object_t proc, object_t ret);
 void call_prim (vm_t vm, pn_t pn);
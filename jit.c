@@ -0,0 +1,485 @@
+/*  Copyright (C) 2020-2021
+ *        "Mu Lei" known as "NalaGinrut" <NalaGinrut@gmail.com>
+ *  Animula is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Lesser General Public License as
+ *  published by the Free Software Foundation, either version 3 of the
+ *  License, or  (at your option) any later version.
+
+ *  Animula is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Lesser General Public License for more details.
+
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this program.
+ *  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "jit.h"
+#include "vm.h"
+
+#ifdef USE_JIT
+#  include <stddef.h>
+#  include <sys/mman.h>
+
+/* NOTE:
+ * This is a baseline template JIT for x86-64. Each pre-decoded instruction of
+ * a hot procedure is emitted as:
+ *
+ *     mov   [rbx + pc], next   ; like `vm->pc += insn->len'
+ *     mov   rdi, rbx
+ *     mov   rsi, insn
+ *     call  helper             ; see jit_helpers in vm.c
+ *     cmp   [rbx + state], VM_RUN
+ *     jne   exit
+ *     cmp   [rbx + pc], next
+ *     jne   dispatch           ; or the branch target
+ *
+ * rbx keeps the vm. The helpers run the same code as the interpreter, so the
+ * frames are built by SAVE_ENV and RESTORE as usual, and the GC walks them as
+ * usual. `halt' and INSN_RAW are never compiled, we return to the interpreter
+ * for them, which enters the native code again at the next compiled pc.
+ * So does `restore' when the native code runs for apply_proc, which stops
+ * there.
+ * The region is never writable and executable at the same time.
+ */
+
+#  define PC_OFFSET    offsetof (struct LambdaVM, pc)
+#  define STATE_OFFSET offsetof (struct LambdaVM, state)
+
+typedef struct Fixup
+{
+  size_t pos; // the rel32 to patch
+  reg_t pc;   // the target pc
+} Fixup;
+
+typedef struct Emitter
+{
+  jit_t jit;
+  Fixup *fixups;
+  size_t cnt;
+  bool full;
+} Emitter;
+
+static void emit (Emitter *e, const void *bytes, size_t n)
+{
+  jit_t jit = e->jit;
+
+  if (e->full || jit->used + n > JIT_CODE_SIZE)
+    {
+      e->full = true;
+      return;
+    }
+
+  os_memcpy (jit->code + jit->used, bytes, n);
+  jit->used += n;
+}
+
+static void emit_u8 (Emitter *e, u8_t v)
+{
+  emit (e, &v, 1);
+}
+
+static void emit_u32 (Emitter *e, u32_t v)
+{
+  emit (e, &v, 4);
+}
+
+static void emit_u64 (Emitter *e, u64_t v)
+{
+  emit (e, &v, 8);
+}
+
+static void emit_disp (Emitter *e, size_t offset)
+{
+  emit_u32 (e, (u32_t)offset);
+}
+
+static void emit_reg_imm (Emitter *e, reg_t v)
+{
+  emit (e, &v, sizeof (reg_t));
+}
+
+// jmp/jcc rel32 to the absolute address
+static void emit_jump (Emitter *e, u8_t cc, u8_t *to)
+{
+  if (cc)
+    {
+      emit_u8 (e, 0x0F);
+      emit_u8 (e, cc);
+    }
+  else
+    emit_u8 (e, 0xE9);
+
+  u8_t *end = e->jit->code + e->jit->used + 4;
+  emit_u32 (e, (u32_t)(to - end));
+}
+
+// jmp/jcc rel32 to the native code of pc, patched by resolve_fixups
+static void emit_jump_to_pc (Emitter *e, u8_t cc, reg_t pc)
+{
+  emit_jump (e, cc, e->jit->code + e->jit->used);
+
+  if (!e->full)
+    {
+      e->fixups[e->cnt].pos = e->jit->used - 4;
+      e->fixups[e->cnt].pc = pc;
+      e->cnt++;
+    }
+}
+
+#  define JNE 0x85
+#  define JE  0x84
+#  define JAE 0x83
+
+// mov [rbx + pc], imm
+static void emit_set_pc (Emitter *e, reg_t pc)
+{
+  if (2 == sizeof (reg_t))
+    emit_u8 (e, 0x66);
+
+  emit_u8 (e, 0xC7);
+  emit_u8 (e, 0x83);
+  emit_disp (e, PC_OFFSET);
+  emit_reg_imm (e, pc);
+}
+
+// cmp [rbx + pc], imm
+static void emit_cmp_pc (Emitter *e, reg_t pc)
+{
+  if (2 == sizeof (reg_t))
+    emit_u8 (e, 0x66);
+
+  emit_u8 (e, 0x81);
+  emit_u8 (e, 0xBB);
+  emit_disp (e, PC_OFFSET);
+  emit_reg_imm (e, pc);
+}
+
+// cmp [rbx + state], VM_RUN; jne exit
+static void emit_check_state (Emitter *e)
+{
+  STATIC_ASSERT (4 == sizeof (vm_state_t));
+  emit_u8 (e, 0x83);
+  emit_u8 (e, 0xBB);
+  emit_disp (e, STATE_OFFSET);
+  emit_u8 (e, VM_RUN);
+  emit_jump (e, JNE, e->jit->exit);
+}
+
+// helper (rbx, insn)
+static void emit_call (Emitter *e, jit_helper_t helper, insn_t *insn)
+{
+  const u8_t mov_rdi_rbx[] = {0x48, 0x89, 0xDF};
+  const u8_t call_rax[] = {0xFF, 0xD0};
+
+  emit (e, mov_rdi_rbx, sizeof (mov_rdi_rbx));
+  emit_u8 (e, 0x48); // mov rsi, imm64
+  emit_u8 (e, 0xBE);
+  emit_u64 (e, (u64_t)insn);
+  emit_u8 (e, 0x48); // mov rax, imm64
+  emit_u8 (e, 0xB8);
+  emit_u64 (e, (u64_t)helper);
+  emit (e, call_rax, sizeof (call_rax));
+}
+
+static void emit_stubs (jit_t jit)
+{
+  Emitter e = {.jit = jit, .fixups = NULL, .cnt = 0, .full = false};
+  const u8_t enter[] = {
+    0x53,             // push rbx
+    0x48, 0x89, 0xFB, // mov rbx, rdi
+    0xFF, 0xE6        // jmp rsi
+  };
+  const u8_t exit[] = {
+    0x5B, // pop rbx
+    0xC3  // ret
+  };
+
+  jit->enter = (void (*) (vm_t, void *))jit->code;
+  emit (&e, enter, sizeof (enter));
+
+  jit->exit = jit->code + jit->used;
+  emit (&e, exit, sizeof (exit));
+
+  jit->dispatch = jit->code + jit->used;
+  emit_check_state (&e);
+
+  if (2 == sizeof (reg_t))
+    {
+      const u8_t movzx_eax_pc[] = {0x0F, 0xB7, 0x83}; // movzx eax, [rbx + pc]
+      emit (&e, movzx_eax_pc, sizeof (movzx_eax_pc));
+    }
+  else
+    {
+      const u8_t mov_eax_pc[] = {0x8B, 0x83}; // mov eax, [rbx + pc]
+      emit (&e, mov_eax_pc, sizeof (mov_eax_pc));
+    }
+
+  emit_disp (&e, PC_OFFSET);
+  emit_u8 (&e, 0x3D); // cmp eax, size
+  emit_u32 (&e, (u32_t)jit->size);
+  emit_jump (&e, JAE, jit->exit);
+  emit_u8 (&e, 0x48); // mov rcx, map
+  emit_u8 (&e, 0xB9);
+  emit_u64 (&e, (u64_t)jit->map);
+
+  const u8_t jump_map[] = {
+    0x48, 0x8B, 0x04, 0xC1, // mov rax, [rcx + rax * 8]
+    0x48, 0x85, 0xC0        // test rax, rax
+  };
+  emit (&e, jump_map, sizeof (jump_map));
+  emit_jump (&e, JE, jit->exit);
+
+  const u8_t jmp_rax[] = {0xFF, 0xE0};
+  emit (&e, jmp_rax, sizeof (jmp_rax));
+}
+
+static bool is_exit (const insn_t *insn)
+{
+  return (INSN_RAW == insn->op || INSN_HALT == insn->op
+          || !jit_helpers[insn->op]);
+}
+
+static void resolve_fixups (Emitter *e)
+{
+  jit_t jit = e->jit;
+
+  for (size_t i = 0; i < e->cnt; i++)
+    {
+      Fixup *f = &e->fixups[i];
+      u8_t *to = jit->map[f->pc];
+      u8_t *end = jit->code + f->pos + 4;
+      u32_t rel = 0;
+
+      /* NOTE:
+       * The pc has been set for the target which is not compiled, so we let
+       * the interpreter run it.
+       */
+      if (!to)
+        to = jit->exit;
+
+      rel = (u32_t)(to - end);
+      os_memcpy (jit->code + f->pos, &rel, 4);
+    }
+}
+
+/* NOTE:
+ * Collect the instructions of the procedure from entry, following the
+ * fallthrough and the branches, but not the calls. Return the count, and
+ * the pcs are marked in region.
+ */
+static size_t collect (jit_t jit, const insn_t *insns, reg_t entry,
+                       bool *region, reg_t *todo)
+{
+  size_t cnt = 0;
+  size_t total = 0;
+
+  todo[cnt++] = entry;
+
+  while (cnt)
+    {
+      reg_t pc = todo[--cnt];
+
+      if (pc >= jit->size || region[pc] || jit->map[pc] || is_exit (&insns[pc]))
+        continue;
+
+      const insn_t *insn = &insns[pc];
+
+      region[pc] = true;
+      total++;
+
+      if (INSN_IS_BRANCH (insn->op))
+        todo[cnt++] = insn_branch_target (insns, pc);
+
+      if (INSN_JUMP != insn->op && INSN_RESTORE != insn->op)
+        todo[cnt++] = pc + insn->len;
+    }
+
+  return total;
+}
+
+static void emit_insn (Emitter *e, insn_t *insns, reg_t pc)
+{
+  insn_t *insn = &insns[pc];
+  reg_t next = pc + insn->len;
+
+  switch (insn->op)
+    {
+    case INSN_NOP:
+      {
+        emit_set_pc (e, next);
+        break;
+      }
+    case INSN_JUMP:
+      {
+#  ifdef USE_BUDGET
+        // the backward jump takes the budget in the helper, see BRANCH
+        if (insn->target <= pc)
+          {
+            emit_set_pc (e, next);
+            emit_call (e, jit_helpers[insn->op], insn);
+            emit_check_state (e);
+            emit_jump_to_pc (e, 0, insn->target);
+            break;
+          }
+#  endif
+        emit_set_pc (e, insn->target);
+        emit_jump_to_pc (e, 0, insn->target);
+        break;
+      }
+    case INSN_RESTORE:
+      {
+        // exit with pc at `restore' if it's for apply_proc
+        emit_u8 (e, 0x48); // mov rax, &jit->proc
+        emit_u8 (e, 0xB8);
+        emit_u64 (e, (u64_t)&e->jit->proc);
+        const u8_t cmp_proc[] = {0x80, 0x38, 0x00}; // cmp byte [rax], 0
+        emit (e, cmp_proc, sizeof (cmp_proc));
+        emit_jump (e, JNE, e->jit->exit);
+        emit_set_pc (e, next);
+        emit_call (e, jit_helpers[insn->op], insn);
+        emit_check_state (e);
+        emit_jump (e, 0, e->jit->dispatch);
+        break;
+      }
+    default:
+      {
+        emit_set_pc (e, next);
+        emit_call (e, jit_helpers[insn->op], insn);
+        emit_check_state (e);
+        emit_cmp_pc (e, next);
+
+        if (INSN_IS_BRANCH (insn->op))
+          emit_jump_to_pc (e, JNE, insn_branch_target (insns, pc));
+        else
+          emit_jump (e, JNE, e->jit->dispatch);
+      }
+    }
+}
+
+void jit_compile (vm_t vm, reg_t entry)
+{
+  jit_t jit = vm->jit;
+  insn_t *insns = vm->insns;
+  bool *region = (bool *)os_calloc (jit->size, sizeof (bool));
+  reg_t *todo = (reg_t *)os_calloc (2 * jit->size + 1, sizeof (reg_t));
+  Emitter e = {.jit = jit, .fixups = NULL, .cnt = 0, .full = false};
+  size_t used = jit->used;
+
+  if (!region || !todo)
+    goto end;
+
+  size_t total = collect (jit, insns, entry, region, todo);
+
+  if (!total)
+    goto end;
+
+  // a jump for each instruction at most
+  e.fixups = (Fixup *)os_calloc (2 * total, sizeof (Fixup));
+
+  if (!e.fixups)
+    goto end;
+
+  if (mprotect (jit->code, JIT_CODE_SIZE, PROT_READ | PROT_WRITE))
+    goto end;
+
+  for (size_t pc = 0; pc < jit->size; pc++)
+    {
+      if (!region[pc])
+        continue;
+
+      jit->map[pc] = jit->code + jit->used;
+      emit_insn (&e, insns, pc);
+
+      /* NOTE:
+       * The code is emitted in the order of pc, and the components of a
+       * superinstruction may be in the region for the jumps into it, so we
+       * fall through only if the next one is emitted right after.
+       */
+      reg_t next = pc + insns[pc].len;
+      size_t follow = pc + 1;
+
+      while (follow < jit->size && !region[follow])
+        follow++;
+
+      if (INSN_JUMP != insns[pc].op && INSN_RESTORE != insns[pc].op
+          && follow != next)
+        emit_jump_to_pc (&e, 0, next);
+    }
+
+  if (e.full)
+    {
+      VM_DEBUG ("jit: no more space for 0x%x!\n", entry);
+      for (size_t pc = 0; pc < jit->size; pc++)
+        if (region[pc])
+          jit->map[pc] = NULL;
+      jit->used = used;
+    }
+  else
+    {
+      VM_DEBUG ("jit: compiled 0x%x, %zu instructions\n", entry, total);
+      resolve_fixups (&e);
+    }
+
+  mprotect (jit->code, JIT_CODE_SIZE, PROT_READ | PROT_EXEC);
+
+end:
+  if (region)
+    os_free (region);
+
+  if (todo)
+    os_free (todo);
+
+  if (e.fixups)
+    os_free (e.fixups);
+}
+
+jit_t jit_init (size_t size)
+{
+  jit_t jit = (jit_t)os_calloc (1, sizeof (struct Jit));
+
+  if (!jit)
+    return NULL;
+
+  jit->size = size;
+  jit->map = (void **)os_calloc (size + 1, sizeof (void *));
+  jit->hits = (u8_t *)os_calloc (size + 1, sizeof (u8_t));
+  jit->code = mmap (NULL, JIT_CODE_SIZE, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+  if (MAP_FAILED == jit->code)
+    jit->code = NULL;
+
+  if (!jit->map || !jit->hits || !jit->code)
+    {
+      VM_DEBUG ("jit: no memory, run the interpreter only!\n");
+      jit_clean (jit);
+      return NULL;
+    }
+
+  emit_stubs (jit);
+
+  if (mprotect (jit->code, JIT_CODE_SIZE, PROT_READ | PROT_EXEC))
+    {
+      jit_clean (jit);
+      return NULL;
+    }
+
+  return jit;
+}
+
+void jit_clean (jit_t jit)
+{
+  if (jit->code)
+    munmap (jit->code, JIT_CODE_SIZE);
+
+  if (jit->map)
+    os_free (jit->map);
+
+  if (jit->hits)
+    os_free (jit->hits);
+
+  os_free (jit);
+}
+#endif
@@ -190,3 +190,82 @@ lef_t load_lef_from_file (const char *filename)
 
   return lef;
 }
+
+static u32_t read_u32 (const u8_t *p)
+{
+  u8_t buf[4] = {0};
+
+#if defined ANIMULA_BIG_ENDIAN
+  buf[0] = p[0];
+  buf[1] = p[1];
+  buf[2] = p[2];
+  buf[3] = p[3];
+#else
+  buf[3] = p[0];
+  buf[2] = p[1];
+  buf[1] = p[2];
+  buf[0] = p[3];
+#endif
+  return *((u32_t *)buf);
+}
+
+/* NOTE:
+ * Load the LEF from the image in memory, which is the same as the file, say,
+ * the one embedded by lef2c. The body is copied, so free_lef works as usual.
+ */
+lef_t load_lef_from_memory (const u8_t *image, size_t size)
+{
+  // sig, ver, msize, gsize, psize, csize
+  const size_t head_size = 3 + 3 + 4 * sizeof (u32_t);
+
+  if (size < head_size)
+    {
+      os_printk ("Wrong LEF image, it's truncated!\n");
+      return NULL;
+    }
+
+  lef_t lef = (lef_t)os_malloc (sizeof (struct LEF));
+  os_memcpy (lef->sig, image, 3);
+
+  if (!LEF_VERIFY (lef))
+    {
+      os_printk ("Wrong LEF image, please check it!\n");
+      os_free (lef);
+      return NULL;
+    }
+
+  os_memcpy (lef->ver, image + 3, 3);
+  lef->msize = read_u32 (image + 6);
+  lef->gsize = read_u32 (image + 10);
+  lef->psize = read_u32 (image + 14);
+  lef->csize = read_u32 (image + 18);
+
+  u32_t body_size = LEF_BODY_SIZE (lef);
+
+  if (size - head_size < body_size)
+    {
+      os_printk ("Wrong LEF image, it's truncated!\n");
+      os_free (lef);
+      return NULL;
+    }
+
+  lef->body = (u8_t *)os_malloc (body_size);
+  os_memcpy (lef->body, image + head_size, body_size);
+
+  u16_t sym_cnt = lef_get_u16 (0, lef);
+  u16_t symtab_size = lef_get_u16 (2, lef);
+  lef->symtab.cnt = sym_cnt;
+  lef->symtab.entry = lef->body + 4;
+  /* offset = sizeof(sym_cnt) + sizeof(symtab_size) + symtab_size */
+  u16_t symtab_offset = 4 + symtab_size;
+  lef->entry = lef_entry (symtab_offset, lef);
+
+  VM_DEBUG ("msize: %d\n", lef->msize);
+  VM_DEBUG ("gsize: %d\n", lef->gsize);
+  VM_DEBUG ("psize: %d\n", lef->psize);
+  VM_DEBUG ("csize: %d\n", lef->csize);
+  VM_DEBUG ("entry = %d\n", lef->entry);
+  VM_DEBUG ("Done\n");
+
+  return lef;
+}
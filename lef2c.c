@@ -0,0 +1,737 @@
+/*  Copyright (C) 2020-2021
+ *        "Mu Lei" known as "NalaGinrut" <NalaGinrut@gmail.com>
+ *  Animula is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Lesser General Public License as
+ *  published by the Free Software Foundation, either version 3 of the
+ *  License, or  (at your option) any later version.
+
+ *  Animula is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Lesser General Public License for more details.
+
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this program.
+ *  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "aot.h"
+#include "vm.h"
+
+#if defined ANIMULA_LINUX && defined USE_PREDECODE
+
+/* NOTE:
+ * lef2c translates a LEF into a C file, which is built with the runtime.
+ * Each procedure becomes a C function, and each instruction becomes the
+ * macros of vm.h, say, PUSH_OBJ, LOCAL, FREE_VAR and SAVE_ENV, or call_prim.
+ * The calls, the global assignments and the closures are run by
+ * vm_exec_insn, so the inline caches work as usual.
+ *
+ * The frames are still built by SAVE_ENV and RESTORE, so the GC walks them
+ * as usual. A function jumps to the calls and the returns in itself, and
+ * returns to run_predecoded when it leaves its code, then run_predecoded
+ * enters the function of the new pc, see vm_load_aot. `halt' and INSN_RAW
+ * are left to the interpreter. The procedures for apply_proc are always
+ * interpreted, since they stop at `restore'.
+ *
+ * The runtime must be initialized before, see animula_init, since the
+ * constants are decoded with the primitives table.
+ */
+
+#  define LEF2C_ENTRY 0x1 // the function can be entered here
+#  define LEF2C_LABEL 0x2 // jumped to from the same function
+
+typedef struct Translator
+{
+  FILE *out;
+  const u8_t *code;
+  insn_t *insns;
+  size_t size;
+  u32_t *owner; // the root + 1 of the function, 0 if it's not reachable
+  u8_t *marks;
+  reg_t *todo;
+  size_t cnt;
+} Translator;
+
+static bool can_enter (const insn_t *insn)
+{
+  return !(INSN_RAW == insn->op || INSN_HALT == insn->op);
+}
+
+static bool is_root (Translator *t, reg_t pc)
+{
+  return (pc < t->size && t->insns[pc].len && can_enter (&t->insns[pc])
+          && !(t->marks[pc] & LEF2C_ENTRY));
+}
+
+static bool falls_through (const insn_t *insn)
+{
+  return (can_enter (insn) && INSN_JUMP != insn->op
+          && INSN_RESTORE != insn->op);
+}
+
+static void mark_entry (Translator *t, reg_t pc)
+{
+  if (pc < t->size && can_enter (&t->insns[pc]))
+    t->marks[pc] |= LEF2C_ENTRY;
+}
+
+static void add_root (Translator *t, reg_t pc)
+{
+  if (is_root (t, pc))
+    {
+      mark_entry (t, pc);
+      t->todo[t->cnt++] = pc;
+    }
+}
+
+static void add_proc_roots (Translator *t, const insn_t *insns, size_t size)
+{
+  for (size_t pc = 0; pc < size; pc++)
+    {
+      const insn_t *insn = &insns[pc];
+
+      if (INSN_PUSH_CONST == insn->op && procedure == insn->obj.attr.type)
+        add_root (t, insn->obj.proc.entry);
+    }
+}
+
+/* NOTE:
+ * The function of a root owns the instructions reachable from it, which are
+ * not owned by the others.
+ */
+static void collect (Translator *t, reg_t root, reg_t *stack)
+{
+  size_t cnt = 0;
+
+  stack[cnt++] = root;
+
+  while (cnt)
+    {
+      reg_t pc = stack[--cnt];
+
+      if (pc >= t->size || t->owner[pc] || !t->insns[pc].len)
+        continue;
+
+      const insn_t *insn = &t->insns[pc];
+      t->owner[pc] = root + 1;
+
+      if (INSN_IS_BRANCH (insn->op))
+        stack[cnt++] = insn->target;
+
+      if (falls_through (insn))
+        stack[cnt++] = pc + insn->len;
+    }
+}
+
+static bool in_function (Translator *t, reg_t root, reg_t pc)
+{
+  return (pc < t->size && (u32_t)root + 1 == t->owner[pc]);
+}
+
+/* NOTE:
+ * Mark the pcs where the functions are entered: the roots, the returns of
+ * the calls, and the pcs which are jumped to from the other functions.
+ */
+static void mark_labels (Translator *t)
+{
+  for (size_t pc = 0; pc < t->size; pc++)
+    {
+      if (!t->owner[pc])
+        continue;
+
+      const insn_t *insn = &t->insns[pc];
+      reg_t root = t->owner[pc] - 1;
+      reg_t next = pc + insn->len;
+
+      // NOTE: the calls to the same function are jumps too
+      if (INSN_IS_BRANCH (insn->op) || INSN_CALL_PROC == insn->op
+          || INSN_LEAF_CALL == insn->op)
+        {
+          if (in_function (t, root, insn->target))
+            t->marks[insn->target] |= LEF2C_LABEL;
+          else
+            mark_entry (t, insn->target);
+        }
+
+      if (falls_through (insn) && !in_function (t, root, next))
+        mark_entry (t, next);
+
+      switch (insn->op)
+        {
+        case INSN_NOP:
+        case INSN_LOCAL_REF:
+        case INSN_LOCAL_ASSIGN:
+        case INSN_FREE_REF:
+        case INSN_FREE_ASSIGN:
+        case INSN_PRELUDE:
+        case INSN_GLOBAL_REF:
+        case INSN_PUSH_CONST:
+        case INSN_FJUMP:
+        case INSN_JUMP:
+          break;
+        case INSN_PRIMITIVE:
+          // NOTE: the fixnum primitives never jump, see emit_prim_int
+          if (!PRIM_IS_QUICK (insn->a))
+            mark_entry (t, next);
+          break;
+        default:
+          // the others may return to run_predecoded
+          mark_entry (t, next);
+        }
+    }
+
+  for (size_t pc = 0; pc < t->size; pc++)
+    if (t->marks[pc] & LEF2C_ENTRY)
+      t->marks[pc] |= LEF2C_LABEL;
+}
+
+static void emit_leave (Translator *t, reg_t pc)
+{
+  fprintf (t->out, "  vm->pc = 0x%04x;\n  return;\n", pc);
+}
+
+/* NOTE:
+ * The jump from `from' to pc, the backward one takes the budget, and we leave
+ * with vm->pc on the target when the VM yields, see BUDGET_TICK.
+ */
+static void emit_goto (Translator *t, reg_t root, reg_t from, reg_t pc,
+                       int indent)
+{
+  if (pc <= from)
+    {
+      fprintf (t->out, "%*s{\n%*s  vm->pc = 0x%04x;\n%*s  BUDGET_TICK ();\n",
+               indent, "", indent, "", pc, indent, "");
+
+      if (in_function (t, root, pc))
+        fprintf (t->out,
+                 "%*s  if (BUDGET_PAUSED ())\n%*s    return;\n"
+                 "%*s  goto L_%04x;\n%*s}\n",
+                 indent, "", indent, "", indent, "", pc, indent, "");
+      else
+        fprintf (t->out, "%*s  return;\n%*s}\n", indent, "", indent, "");
+    }
+  else if (in_function (t, root, pc))
+    fprintf (t->out, "%*sgoto L_%04x;\n", indent, "", pc);
+  else
+    fprintf (t->out, "%*s{\n%*s  vm->pc = 0x%04x;\n%*s  return;\n%*s}\n",
+             indent, "", indent, "", pc, indent, "", indent, "");
+}
+
+/* NOTE:
+ * vm->pc was set to next before, so we just return when we leave.
+ */
+static void emit_return_check (Translator *t, reg_t root, reg_t next)
+{
+  if (in_function (t, root, next))
+    {
+      fprintf (t->out, "  if (VM_RUN != vm->state || 0x%04x != vm->pc)\n",
+               next);
+      fprintf (t->out, "    return;\n");
+    }
+  else
+    fprintf (t->out, "  return;\n");
+}
+
+static const char *insn_name (u8_t op)
+{
+  switch (op)
+    {
+    case INSN_CALL_LOCAL:
+      return "INSN_CALL_LOCAL";
+    case INSN_CALL_FREE:
+      return "INSN_CALL_FREE";
+    case INSN_GLOBAL_ASSIGN:
+      return "INSN_GLOBAL_ASSIGN";
+    case INSN_CALL_GLOBAL:
+      return "INSN_CALL_GLOBAL";
+    case INSN_CLOSURE_ON_HEAP:
+      return "INSN_CLOSURE_ON_HEAP";
+    default:
+      return NULL;
+    }
+}
+
+/* NOTE:
+ * The instructions run by vm_exec_insn are kept in the generated file, the
+ * inline caches are filled in them.
+ */
+static void emit_insn_objects (Translator *t)
+{
+  bool emitted = false;
+
+  for (size_t pc = 0; pc < t->size; pc++)
+    {
+      const insn_t *insn = &t->insns[pc];
+      const char *name = insn_name (insn->op);
+
+      if (!t->owner[pc] || !name)
+        continue;
+
+      fprintf (t->out,
+               "static insn_t insn_%04zx = {.op = %s, .len = %d, .a = %d, "
+               ".b = %d, .target = 0x%04x};\n",
+               pc, name, insn->len, insn->a, insn->b,
+               INSN_CLOSURE_ON_HEAP == insn->op ? insn->target : 0);
+      emitted = true;
+    }
+
+  if (emitted)
+    fprintf (t->out, "\n");
+}
+
+static bool is_operand (const insn_t *insn)
+{
+  return (INSN_LOCAL_REF == insn->op || INSN_GLOBAL_REF == insn->op
+          || INSN_PUSH_CONST == insn->op);
+}
+
+// Declare the object which is pushed by the operand instruction
+static void emit_operand (Translator *t, const char *name,
+                          const insn_t *insn)
+{
+  switch (insn->op)
+    {
+    case INSN_LOCAL_REF:
+      fprintf (t->out, "    Object %s = *(object_t)LOCAL (%d);\n", name,
+               insn->a);
+      return;
+    case INSN_GLOBAL_REF:
+      fprintf (t->out, "    Object %s = GLOBAL (%d);\n", name, insn->a);
+      return;
+    default:
+      break;
+    }
+
+  const Object *obj = &insn->obj;
+
+  fprintf (t->out, "    Object %s = {.attr = {.all = 0x%02x}, ", name,
+           obj->attr.all);
+
+  switch (obj->attr.type)
+    {
+    case string:
+    case keyword:
+    case complex_inexact:
+      {
+        // NOTE: they refer to the code segment
+        size_t offset = (const u8_t *)obj->value - t->code;
+        fprintf (t->out, ".value = (void *)(vm->code + 0x%04zx)};\n",
+                 offset);
+        break;
+      }
+    default:
+      fprintf (t->out, ".value = (void *)0x%llx};\n",
+               (unsigned long long)(uintptr_t)obj->value);
+    }
+}
+
+static bool is_fusible (Translator *t, reg_t root, reg_t pc)
+{
+  return (in_function (t, root, pc) && !(t->marks[pc] & LEF2C_LABEL));
+}
+
+/* NOTE:
+ * The fixnum fast path of the quickened ops is inlined, and the operands
+ * pushed right before, and the fjump right after, are kept in C variables.
+ * The other types fall back to the generic primitive.
+ * Return the pc after the sequence, or 0 if it's not matched.
+ */
+static reg_t emit_prim_int (Translator *t, reg_t root, reg_t pc)
+{
+  const insn_t *operands[2] = {NULL, NULL};
+  size_t cnt = 0;
+  reg_t p = pc;
+
+  while (cnt < 2 && is_operand (&t->insns[p]))
+    {
+      operands[cnt++] = &t->insns[p];
+      p += t->insns[p].len;
+
+      if (!is_fusible (t, root, p))
+        return 0;
+    }
+
+  const insn_t *prim = &t->insns[p];
+
+  if (INSN_PRIMITIVE != prim->op || !PRIM_IS_QUICK (prim->a))
+    return 0;
+
+  reg_t next = p + prim->len;
+  reg_t end = next;
+  bool fjump = (PRIM_IS_LOGIC2 (prim->a) && is_fusible (t, root, next)
+                && INSN_FJUMP == t->insns[next].op);
+
+  if (fjump)
+    end += t->insns[next].len;
+
+  fprintf (t->out, "  {\n");
+
+  if (2 == cnt)
+    {
+      emit_operand (t, "o1", operands[0]);
+      emit_operand (t, "o2", operands[1]);
+    }
+  else if (1 == cnt)
+    {
+      emit_operand (t, "o2", operands[0]);
+      fprintf (t->out, "    Object o1 = POP_OBJ ();\n");
+    }
+  else
+    fprintf (t->out, "    Object o2 = POP_OBJ ();\n"
+                     "    Object o1 = POP_OBJ ();\n");
+
+  fprintf (t->out, "    Object ret;\n\n    if (prim2_int (%d, &o1, &o2, &ret))\n",
+           prim->a);
+
+  if (fjump)
+    {
+      fprintf (t->out, "      {\n        if (is_false (&ret))\n");
+      emit_goto (t, root, next, t->insns[next].target, 10);
+      fprintf (t->out, "      }\n");
+    }
+  else
+    fprintf (t->out, "      PUSH_OBJ (ret);\n");
+
+  fprintf (t->out,
+           "    else\n      {\n        PUSH_OBJ (o1);\n        PUSH_OBJ (o2);\n"
+           "        vm->pc = 0x%04x;\n        call_prim (vm, %d);\n"
+           "        if (VM_RUN != vm->state)\n          return;\n",
+           next, prim->a);
+
+  if (fjump)
+    {
+      fprintf (t->out, "        Object obj = POP_OBJ ();\n"
+                       "        if (is_false (&obj))\n");
+      emit_goto (t, root, next, t->insns[next].target, 10);
+    }
+
+  fprintf (t->out, "      }\n  }\n");
+
+  if (!in_function (t, root, end))
+    emit_leave (t, end);
+
+  return end;
+}
+
+/* NOTE:
+ * Emit the instruction at pc, return the pc after it.
+ */
+static reg_t emit_insn (Translator *t, reg_t root, reg_t pc)
+{
+  const insn_t *insn = &t->insns[pc];
+  reg_t next = pc + insn->len;
+  reg_t end = emit_prim_int (t, root, pc);
+
+  if (end)
+    return end;
+
+  switch (insn->op)
+    {
+    case INSN_NOP:
+      fprintf (t->out, "  ;\n");
+      break;
+    case INSN_LOCAL_REF:
+      fprintf (t->out, "  PUSH_OBJ (*(object_t)LOCAL (%d));\n", insn->a);
+      break;
+    case INSN_LOCAL_ASSIGN:
+      fprintf (t->out,
+               "  {\n    object_t obj = (object_t)LOCAL (%d);\n"
+               "    *obj = POP_OBJ ();\n  }\n",
+               insn->a);
+      break;
+    case INSN_FREE_REF:
+      fprintf (t->out, "  PUSH_OBJ (*(object_t)FREE_VAR (%d, %d));\n",
+               insn->a, insn->b);
+      break;
+    case INSN_FREE_ASSIGN:
+      fprintf (t->out,
+               "  {\n    object_t obj = (object_t)FREE_VAR (%d, %d);\n"
+               "    *obj = POP_OBJ ();\n  }\n",
+               insn->a, insn->b);
+      break;
+    case INSN_PRELUDE:
+      fprintf (t->out, "  SAVE_ENV (0x%02x);\n", insn->b);
+      break;
+    case INSN_GLOBAL_REF:
+      fprintf (t->out, "  PUSH_OBJ (GLOBAL (%d));\n", insn->a);
+      break;
+    case INSN_PUSH_CONST:
+      fprintf (t->out, "  {\n");
+      emit_operand (t, "obj", insn);
+      fprintf (t->out, "    PUSH_OBJ (obj);\n  }\n");
+      break;
+    case INSN_CALL_PROC:
+      fprintf (t->out, "  vm->pc = 0x%04x;\n  FIX_PC ();\n", next);
+      // NOTE: PROC_CALL has set vm->pc
+      fprintf (t->out, "  PROC_CALL (0x%04x);\n", insn->target);
+
+      if (in_function (t, root, insn->target))
+        fprintf (t->out, "  if (BUDGET_PAUSED ())\n    return;\n"
+                         "  goto L_%04x;\n",
+                 insn->target);
+      else
+        fprintf (t->out, "  return;\n");
+
+      return next;
+#  ifdef USE_LEAF_FRAME
+    case INSN_LEAF_CALL:
+      fprintf (t->out, "  vm->pc = 0x%04x;\n", next);
+      fprintf (t->out, "  LEAF_CALL (%d, 0x%04x);\n", insn->a, insn->target);
+
+      if (in_function (t, root, insn->target))
+        fprintf (t->out, "  if (BUDGET_PAUSED ())\n    return;\n"
+                         "  goto L_%04x;\n",
+                 insn->target);
+      else
+        fprintf (t->out, "  return;\n");
+
+      return next;
+#  endif
+    case INSN_FJUMP:
+      fprintf (t->out, "  {\n    Object obj = POP_OBJ ();\n"
+                       "    if (is_false (&obj))\n");
+      emit_goto (t, root, pc, insn->target, 6);
+      fprintf (t->out, "  }\n");
+      break;
+    case INSN_JUMP:
+      emit_goto (t, root, pc, insn->target, 2);
+      return next;
+    case INSN_PRIMITIVE:
+      fprintf (t->out, "  vm->pc = 0x%04x;\n  call_prim (vm, %d);\n", next,
+               insn->a);
+      emit_return_check (t, root, next);
+      return next;
+    case INSN_CALL_LOCAL:
+    case INSN_CALL_FREE:
+    case INSN_GLOBAL_ASSIGN:
+    case INSN_CALL_GLOBAL:
+    case INSN_CLOSURE_ON_HEAP:
+      fprintf (t->out, "  vm->pc = 0x%04x;\n  vm_exec_insn (vm, &insn_%04x);\n",
+               next, pc);
+      emit_return_check (t, root, next);
+      return next;
+    case INSN_RESTORE:
+      // NOTE: the return may be in the same function
+      fprintf (t->out, "  RESTORE ();\n  goto dispatch;\n");
+      return next;
+    default:
+      // INSN_RAW and `halt'
+      emit_leave (t, pc);
+      return next;
+    }
+
+  if (!in_function (t, root, next))
+    emit_leave (t, next);
+
+  return next;
+}
+
+static void emit_function (Translator *t, reg_t root)
+{
+  bool returns = false;
+
+  for (size_t pc = 0; pc < t->size; pc++)
+    if (in_function (t, root, pc) && INSN_RESTORE == t->insns[pc].op)
+      returns = true;
+
+  fprintf (t->out, "static void aot_%04x (vm_t vm)\n{\n", root);
+
+  if (returns)
+    fprintf (t->out, "dispatch:\n");
+
+  fprintf (t->out, "  switch (vm->pc)\n    {\n");
+
+  for (size_t pc = 0; pc < t->size; pc++)
+    if (in_function (t, root, pc) && (t->marks[pc] & LEF2C_ENTRY))
+      fprintf (t->out, "    case 0x%04zx:\n      goto L_%04zx;\n", pc, pc);
+
+  fprintf (t->out, "    default:\n      return;\n    }\n");
+
+  for (size_t pc = 0; pc < t->size;)
+    {
+      if (!in_function (t, root, pc))
+        {
+          pc++;
+          continue;
+        }
+
+      if (t->marks[pc] & LEF2C_LABEL)
+        fprintf (t->out, "\nL_%04zx:\n", pc);
+
+      pc = emit_insn (t, root, pc);
+    }
+
+  fprintf (t->out, "}\n\n");
+}
+
+static void emit_image (Translator *t, const u8_t *image, size_t size)
+{
+  fprintf (t->out, "static const u8_t lef_image[] = {");
+
+  for (size_t i = 0; i < size; i++)
+    fprintf (t->out, "%s0x%02x,", (i % 12) ? " " : "\n  ", image[i]);
+
+  fprintf (t->out, "\n};\n\nstatic const aot_entry_t entries[] = {\n");
+
+  size_t cnt = 0;
+
+  for (size_t pc = 0; pc < t->size; pc++)
+    {
+      if (t->owner[pc] && (t->marks[pc] & LEF2C_ENTRY))
+        {
+          fprintf (t->out, "  {0x%04zx, aot_%04x},\n", pc, t->owner[pc] - 1);
+          cnt++;
+        }
+    }
+
+  fprintf (t->out, "};\n\n");
+  fprintf (t->out,
+           "const struct AotImage aot_image = {lef_image, sizeof (lef_image),"
+           " entries, %zu};\n",
+           cnt);
+}
+
+static u8_t *read_image (const char *filename, size_t *size)
+{
+  FILE *fp = fopen (filename, "rb");
+  u8_t *image = NULL;
+
+  if (!fp)
+    return NULL;
+
+  if (0 == fseek (fp, 0, SEEK_END))
+    {
+      long len = ftell (fp);
+
+      if (len > 0 && 0 == fseek (fp, 0, SEEK_SET))
+        {
+          image = (u8_t *)os_malloc (len);
+
+          if (image && (size_t)len != fread (image, 1, len, fp))
+            {
+              os_free (image);
+              image = NULL;
+            }
+
+          *size = len;
+        }
+    }
+
+  fclose (fp);
+  return image;
+}
+
+bool lef2c (const char *lef_file, const char *c_file)
+{
+  bool ret = false;
+  size_t image_size = 0;
+  u8_t *image = read_image (lef_file, &image_size);
+  lef_t lef = load_lef_from_memory (image, image_size);
+  insn_t *globals = NULL;
+  reg_t *stack = NULL;
+  Translator t = {0};
+
+  if (!image || !lef || !lef->psize)
+    {
+      os_printk ("lef2c: invalid LEF \"%s\"!\n", lef_file);
+      goto end;
+    }
+
+  t.size = lef->psize;
+  t.code = LEF_PROG (lef);
+  t.insns = decode_program (LEF_PROG (lef), lef->psize);
+  globals = decode_program (LEF_GLOBAL (lef), lef->gsize);
+
+#  ifdef USE_LEAF_FRAME
+  // NOTE: the interpreter calls the leaves in the same way
+  if (t.insns)
+    fuse_leaf_calls (t.insns, t.size);
+#  endif
+  t.owner = (u32_t *)os_calloc (t.size + 1, sizeof (u32_t));
+  t.marks = (u8_t *)os_calloc (t.size + 1, sizeof (u8_t));
+  t.todo = (reg_t *)os_calloc (t.size + 1, sizeof (reg_t));
+  stack = (reg_t *)os_calloc (2 * t.size + 2, sizeof (reg_t));
+
+  if (!t.insns || (lef->gsize && !globals) || !t.owner || !t.marks || !t.todo
+      || !stack)
+    {
+      os_printk ("lef2c: no memory!\n");
+      goto end;
+    }
+
+  add_root (&t, lef->entry);
+  add_proc_roots (&t, t.insns, t.size);
+
+  if (globals)
+    add_proc_roots (&t, globals, lef->gsize);
+
+  for (size_t pc = 0; pc < t.size; pc++)
+    if (INSN_CALL_PROC == t.insns[pc].op || INSN_LEAF_CALL == t.insns[pc].op
+        || INSN_CLOSURE_ON_HEAP == t.insns[pc].op)
+      add_root (&t, t.insns[pc].target);
+
+  for (size_t i = 0; i < t.cnt; i++)
+    collect (&t, t.todo[i], stack);
+
+  mark_labels (&t);
+
+  t.out = fopen (c_file, "w");
+
+  if (!t.out)
+    {
+      os_printk ("lef2c: can't open \"%s\"!\n", c_file);
+      goto end;
+    }
+
+  fprintf (t.out, "/* Generated by lef2c from %s, don't edit it!\n", lef_file);
+  fprintf (t.out, " * Build it with the same flags as the runtime, and run\n");
+  fprintf (t.out, " * it with animula_start_aot (&aot_image).\n */\n\n");
+  fprintf (t.out, "#include \"aot.h\"\n#include \"vm.h\"\n\n");
+  emit_insn_objects (&t);
+
+  // NOTE: the roots in the others' code have no function
+  for (size_t i = 0; i < t.cnt; i++)
+    if (in_function (&t, t.todo[i], t.todo[i]))
+      fprintf (t.out, "static void aot_%04x (vm_t vm);\n", t.todo[i]);
+
+  fprintf (t.out, "\n");
+
+  for (size_t i = 0; i < t.cnt; i++)
+    if (in_function (&t, t.todo[i], t.todo[i]))
+      emit_function (&t, t.todo[i]);
+
+  emit_image (&t, image, image_size);
+  ret = (0 == ferror (t.out));
+
+  if (0 != fclose (t.out))
+    ret = false;
+
+end:
+  if (globals)
+    os_free (globals);
+
+  if (t.insns)
+    os_free (t.insns);
+
+  if (t.owner)
+    os_free (t.owner);
+
+  if (t.marks)
+    os_free (t.marks);
+
+  if (t.todo)
+    os_free (t.todo);
+
+  if (stack)
+    os_free (stack);
+
+  if (lef)
+    free_lef (lef);
+
+  if (image)
+    os_free (image);
+
+  return ret;
+}
+#endif
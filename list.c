@@ -103,14 +103,11 @@ object_t _cons (vm_t vm, object_t ret, object_t a, object_t b)
     default:
       {
         pair_t p = NEW_INNER_OBJ (pair);
-        object_t new_a = OBJ_IS_ON_STACK (a) ? NEW_OBJ (0) : a;
-        object_t new_b = OBJ_IS_ON_STACK (b) ? NEW_OBJ (0) : b;
-        if (new_a != a)
-          *new_a = *a;
-        if (new_b != b)
-          *new_b = *b;
+        object_t new_a = OBJ_IS_ON_STACK (a) ? BOX_OBJ (0, a, GEN_1_OBJ) : a;
+        object_t new_b = OBJ_IS_ON_STACK (b) ? BOX_OBJ (0, b, GEN_1_OBJ) : b;
         p->car = new_a;
         p->cdr = new_b;
+        GC_WRITE_BARRIER (p);
         ret->attr.type = pair;
         ret->value = (void *)p;
       }
@@ -162,39 +159,49 @@ object_t _list_ref (vm_t vm, object_t ret, object_t lst, object_t idx)
   return ret;
 }
 
+/* NOTE:
+ * The val is boxed by the caller, see invoke_prim in vm.c. The lists are
+ * created as list, mut_list is never made, and the GC doesn't walk it.
+ */
 object_t _list_set (vm_t vm, object_t ret, object_t lst, object_t idx,
                     object_t val)
 {
-  VALIDATE (lst, mut_list);
+  VALIDATE (lst, list);
   VALIDATE (idx, imm_int);
 
   list_node_t node = NULL;
   ListHead *head = LIST_OBJECT_HEAD (lst);
   imm_int_t cnt = (imm_int_t)idx->value;
+  imm_int_t lst_idx = cnt;
 
   if (SLIST_EMPTY (head))
     {
       PANIC ("list-set! encounter an empty List!\n");
     }
 
+  if (cnt < 0)
+    {
+      PANIC ("list-set!: Invalid index %d!\n", lst_idx);
+    }
+
   SLIST_FOREACH (node, head, next)
   {
     if (!cnt)
-      {
-        node->obj = (void *)val;
-        break;
-      }
-
+      break;
     cnt--;
   }
 
-  if (node->obj != val)
+  if (!node)
     {
-      PANIC ("list-set!: Invalid index %d!\n", cnt);
+      PANIC ("list-set!: Invalid index %d!\n", lst_idx);
       // FIXME: implement throw
       // throw ();
     }
 
+  GC_SATB_BARRIER (node->obj);
+  node->obj = val;
+  GC_WRITE_BARRIER (lst->value);
+
   *ret = GLOBAL_REF (none_const);
   return ret;
 }
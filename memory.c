@@ -62,6 +62,119 @@ void raw_free (void *ptr)
 #endif
 }
 
+#ifdef USE_SLAB
+/* NOTE:
+ * The slab allocator serves the small runtime objects, say, Object, Pair, List,
+ * ListNode and the small Closures, by the size classes in 8 bytes steps. The
+ * arena is allocated once, and its pages are handed out to the size classes on
+ * demand. Each class allocates by bumping in its current page, and reuses the
+ * freed slots by its free stack, so there's no malloc header for each object.
+ * The class of a slot is known by its page, so os_free can tell the slabs from
+ * the other allocations by the address range.
+ * NOTE: The pages are never returned to the arena, the freed slots are only
+ *       reused by the same class. When the arena is used up, we fall back to
+ *       os_malloc.
+ */
+#  define SLAB_ALIGN      8
+#  define SLAB_CLASSES    8
+#  define SLAB_MAX_SIZE   (SLAB_ALIGN * SLAB_CLASSES)
+#  define SLAB_CLASS(n)   (((n) - 1) / SLAB_ALIGN)
+#  define SLAB_SIZE(c)    (((c) + 1) * SLAB_ALIGN)
+#  define SLAB_PAGE(p)    (((u8_t *)(p) - slab_arena) / SLAB_PAGE_SIZE)
+#  define SLAB_OWNS(p)                                \
+    (slab_arena && ((u8_t *)(p) >= slab_arena)       \
+     && ((u8_t *)(p) < slab_arena + SLAB_PAGES * SLAB_PAGE_SIZE))
+
+STATIC_ASSERT (SLAB_PAGE_SIZE % SLAB_MAX_SIZE == 0);
+
+typedef struct SlabSlot
+{
+  struct SlabSlot *next;
+} SlabSlot;
+
+typedef struct SlabClass
+{
+  u8_t *bump;
+  u8_t *end;
+  SlabSlot *free;
+} SlabClass;
+
+static u8_t *slab_arena = NULL;
+static bool slab_failed = false;
+static u16_t slab_next_page = 0;
+static u8_t slab_page_class[SLAB_PAGES] = {0};
+static SlabClass slab_classes[SLAB_CLASSES] = {0};
+
+static void *slab_alloc (size_t size)
+{
+  if (!slab_arena)
+    {
+      if (slab_failed)
+        return NULL;
+
+      slab_arena = (u8_t *)os_malloc (SLAB_PAGES * SLAB_PAGE_SIZE);
+
+      if (!slab_arena)
+        {
+          slab_failed = true;
+          return NULL;
+        }
+    }
+
+  u8_t c = SLAB_CLASS (size);
+  SlabClass *sc = &slab_classes[c];
+  SlabSlot *slot = sc->free;
+
+  if (slot)
+    {
+      sc->free = slot->next;
+      return (void *)slot;
+    }
+
+  if (sc->bump + SLAB_SIZE (c) > sc->end)
+    {
+      if (SLAB_PAGES == slab_next_page)
+        return NULL;
+
+      slab_page_class[slab_next_page] = c;
+      sc->bump = slab_arena + slab_next_page * SLAB_PAGE_SIZE;
+      sc->end = sc->bump + SLAB_PAGE_SIZE;
+      slab_next_page++;
+    }
+
+  void *ret = (void *)sc->bump;
+  sc->bump += SLAB_SIZE (c);
+  return ret;
+}
+
+static void slab_free (void *ptr)
+{
+  SlabClass *sc = &slab_classes[slab_page_class[SLAB_PAGE (ptr)]];
+  SlabSlot *slot = (SlabSlot *)ptr;
+
+  slot->next = sc->free;
+  sc->free = slot;
+}
+#endif
+
+/* NOTE:
+ * The runtime objects are allocated by slab_malloc, it's os_malloc without
+ * USE_SLAB. Either way, they're freed by os_free.
+ */
+void *slab_malloc (size_t size)
+{
+#ifdef USE_SLAB
+  if (size && size <= SLAB_MAX_SIZE)
+    {
+      void *ptr = slab_alloc (size);
+      if (ptr)
+        return ptr;
+    }
+#endif
+
+  return os_malloc (size);
+}
+
 #ifdef FORCE_MEMORY_SIZE_TEST
 struct memory_block
 {
@@ -169,11 +282,19 @@ void os_free (void *ptr)
   // NULL ptr checking shall not be in this level
   // Make it more strict to prevent future bug.
   // FIXME: do not panic when free null pointer
-  if (NULL != ptr)
-    __free (ptr);
-  else
+  if (NULL == ptr)
     PANIC ("Free a NULL ptr\n");
 
+#ifdef USE_SLAB
+  if (SLAB_OWNS (ptr))
+    {
+      slab_free (ptr);
+      return;
+    }
+#endif
+
+  __free (ptr);
+
 #ifdef FORCE_MEMORY_SIZE_TEST
   size_t i = 0;
   for (; i < MEMORY_TRACKER_ARRAY_LENGTH; i++)
@@ -37,6 +37,65 @@ GLOBAL_DEF (const Object, null_const)
 GLOBAL_DEF (const Object, none_const)
   = {.attr = {.type = none, .gc = 0}, .value = NULL};
 
+#ifdef USE_IMM_BOX
+/* NOTE:
+ * The shared boxes of the immediates, see BOX_OBJ in object.h.
+ * A box is filled on the first use, and it's permanent then, so the GC never
+ * frees it. Nobody writes an object in a container, the setters replace it.
+ */
+static Object int_box[IMM_BOX_INT_MAX - IMM_BOX_INT_MIN + 1];
+static Object char_box[IMM_BOX_CHAR_MAX + 1];
+static Object const_box[4]; // #f, #t, () and none
+
+static inline object_t fill_box (object_t box, object_t obj)
+{
+  if (PERMANENT_OBJ != box->attr.gc)
+    {
+      *box = *obj;
+      box->attr.gc = PERMANENT_OBJ;
+    }
+
+  return box;
+}
+
+object_t imm_box (object_t obj)
+{
+  imm_int_t v = (imm_int_t)obj->value;
+
+  switch (obj->attr.type)
+    {
+    case imm_int:
+      {
+        if (IMM_BOX_INT_MIN <= v && v <= IMM_BOX_INT_MAX)
+          return fill_box (&int_box[v - IMM_BOX_INT_MIN], obj);
+        break;
+      }
+    case character:
+      {
+        if (0 <= v && v <= IMM_BOX_CHAR_MAX)
+          return fill_box (&char_box[v], obj);
+        break;
+      }
+    case boolean:
+      {
+        return fill_box (&const_box[v ? 1 : 0], obj);
+      }
+    case null_obj:
+      {
+        return fill_box (&const_box[2], obj);
+      }
+    case none:
+      {
+        return fill_box (&const_box[3], obj);
+      }
+    default:
+      break;
+    }
+
+  return NULL;
+}
+#endif
+
 // ----------- Closure
 closure_t make_closure (u8_t arity, u8_t frame_size, reg_t entry)
 {
@@ -98,7 +157,6 @@ mut_bytevector_t animula_new_mut_bytevector (void)
 object_t animula_new_object (otype_t type)
 {
   bool has_inner_obj = true;
-  bool new_alloc = false;
   bool new_inner = false;
   object_t object = NULL;
   void *value = NULL;
@@ -112,7 +170,6 @@ object_t animula_new_object (otype_t type)
   if (!object)
     {
       object = (object_t)GC_MALLOC (sizeof (Object));
-      new_alloc = true;
 
       // Alloc failed, return NULL to trigger GC
       if (!object)
@@ -172,17 +229,12 @@ object_t animula_new_object (otype_t type)
 
   if (has_inner_obj && (NULL == value))
     {
-      // The inner object wasn't successfully allocated, return NULL for GC
-      if (new_alloc)
-        {
+      /* The inner object wasn't successfully allocated, return NULL for GC.
+       * NOTE: the slot from the pool isn't booked yet, so it's freed as well.
+       */
 #ifdef USE_OBG_GC
-          os_free (object);
+      os_free (object);
 #endif
-        }
-      else
-        {
-          object->attr.gc = FREE_OBJ;
-        }
       return NULL;
     }
 
@@ -190,8 +242,7 @@ object_t animula_new_object (otype_t type)
   object->attr.gc = GEN_1_OBJ;
 
 #ifdef OBG_GC
-  if (new_alloc)
-    gc_obj_book (object);
+  gc_obj_book (object);
 #endif
 
   if (has_inner_obj) // value is checked before
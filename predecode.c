@@ -0,0 +1,1013 @@
+/*  Copyright (C) 2020-2021
+ *        "Mu Lei" known as "NalaGinrut" <NalaGinrut@gmail.com>
+ *  Animula is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Lesser General Public License as
+ *  published by the Free Software Foundation, either version 3 of the
+ *  License, or  (at your option) any later version.
+
+ *  Animula is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Lesser General Public License for more details.
+
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this program.
+ *  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "predecode.h"
+#include "vm.h"
+
+#ifdef USE_PREDECODE
+
+/* NOTE:
+ * The operands must be decoded exactly like vm_get_u16 and vm_get_uintptr
+ * do in the interpreter.
+ */
+static u16_t read_u16 (const u8_t *p)
+{
+  u8_t buf[sizeof (u16_t)] = {0};
+
+#  if defined ANIMULA_BIG_ENDIAN
+  buf[0] = p[0];
+  buf[1] = p[1];
+#  else
+  buf[1] = p[0];
+  buf[0] = p[1];
+#  endif
+  return *((u16_t *)buf);
+}
+
+static uintptr_t read_uintptr (const u8_t *p)
+{
+  u8_t buf[sizeof (uintptr_t)] = {0};
+
+#  if defined ANIMULA_BIG_ENDIAN
+  buf[0] = p[0];
+  buf[1] = p[1];
+  buf[2] = p[2];
+  buf[3] = p[3];
+#  else
+  buf[3] = p[0];
+  buf[2] = p[1];
+  buf[1] = p[2];
+  buf[0] = p[3];
+#  endif
+  return *((uintptr_t *)buf);
+}
+
+#  define NEED(n)          \
+    do                     \
+      {                    \
+        if ((n) > avail)   \
+          return 0;        \
+      }                    \
+    while (0)
+
+#  define PUSH_CONST(t, v)                                       \
+    do                                                           \
+      {                                                          \
+        insn->op = INSN_PUSH_CONST;                              \
+        insn->obj.attr.type = (t);                               \
+        insn->obj.attr.gc = FREE_OBJ;                            \
+        insn->obj.value = (void *)(uintptr_t)(v);                \
+      }                                                          \
+    while (0)
+
+/* NOTE:
+ * Decode the general object, p points to the object type byte.
+ * Only the immediate objects are turned into constants, the others would
+ * allocate on the heap, so they're left to the interpreter.
+ * Return the size of the encoding, or 0 if it's truncated or unknown.
+ */
+static size_t decode_general_object (insn_t *insn, const u8_t *p,
+                                     size_t avail)
+{
+  NEED (1);
+
+  const u8_t *data = p + 1;
+  avail--;
+
+  switch (p[0])
+    {
+    case imm_int:
+      {
+        NEED (4);
+        PUSH_CONST (imm_int, (imm_int_t)read_uintptr (data));
+        return 5;
+      }
+    case string:
+    case keyword:
+      {
+        size_t max = avail < MAX_STR_LEN ? avail : MAX_STR_LEN;
+        size_t len = os_strnlen ((const char *)data, max) + 1;
+        NEED (len);
+        PUSH_CONST (p[0], data);
+        return 1 + len;
+      }
+    case procedure:
+      {
+        NEED (4);
+        insn->op = INSN_PUSH_CONST;
+        insn->obj.attr.type = procedure;
+        insn->obj.attr.gc = FREE_OBJ;
+        insn->obj.proc.entry = read_u16 (data);
+        insn->obj.proc.arity = data[2];
+        insn->obj.proc.opt = data[3];
+        return 5;
+      }
+    case primitive:
+    case real:
+      {
+        NEED (4);
+        PUSH_CONST (p[0], read_uintptr (data));
+        return 5;
+      }
+    case rational_pos:
+    case rational_neg:
+      {
+        NEED (4);
+        numerator_t n = (u16_t)read_u16 (data);
+        denominator_t d = (u16_t)read_u16 (data + 2);
+        hov_t value = ((n << 16) | d);
+        PUSH_CONST (p[0], value);
+        return 5;
+      }
+    case complex_exact:
+      {
+        NEED (4);
+        real_part_t r = (real_part_t)read_u16 (data);
+        imag_part_t i = (imag_part_t)read_u16 (data + 2);
+        hov_t value = ((r << 0xf) | i);
+        PUSH_CONST (complex_exact, value);
+        return 5;
+      }
+    case complex_inexact:
+      {
+        NEED (8);
+        PUSH_CONST (complex_inexact, data);
+        return 9;
+      }
+    case pair:
+      {
+        insn->a = 2; // car and cdr
+        return 1;
+      }
+    case list:
+    case vector:
+      {
+        NEED (2);
+        insn->a = (data[0] << 8) | data[1]; // the elements
+        return 3;
+      }
+    case mut_bytevector:
+    case bytevector:
+      {
+        NEED (2);
+        size_t size = (data[0] << 8) | data[1];
+        NEED (2 + size);
+        return 3 + size;
+      }
+    default:
+      return 0;
+    }
+}
+
+/* NOTE:
+ * Decode one instruction at code[pc], return the size of the encoding.
+ * The unsupported instructions are left INSN_RAW.
+ */
+static size_t decode_insn (insn_t *insn, const u8_t *code, size_t pc,
+                           size_t size)
+{
+  const u8_t *p = code + pc;
+  size_t avail = size - pc;
+  const decode_t *bc = DECODE (p[0]);
+
+  if (SINGLE == bc->encode)
+    {
+      switch (bc->type)
+        {
+        case LOCAL_REF:
+        case LOCAL_REF_EXTEND:
+          {
+            insn->op = INSN_LOCAL_REF;
+            insn->a = bc->data + (LOCAL_REF_EXTEND == bc->type ? 16 : 0);
+            return 1;
+          }
+        case CALL_LOCAL:
+        case CALL_LOCAL_EXTEND:
+          {
+            insn->op = INSN_CALL_LOCAL;
+            insn->a = bc->data + (CALL_LOCAL_EXTEND == bc->type ? 16 : 0);
+            return 1;
+          }
+        case FREE_REF:
+        case CALL_FREE:
+        case FREE_ASSIGN:
+          {
+            NEED (2);
+            u8_t frame = p[1];
+            insn->op = (FREE_REF == bc->type)   ? INSN_FREE_REF
+                       : (CALL_FREE == bc->type) ? INSN_CALL_FREE
+                                                : INSN_FREE_ASSIGN;
+            insn->a = (frame & 0b00111111);
+            insn->b = ((bc->data << 2) | ((frame & 0b11000000) >> 6));
+            return 2;
+          }
+        case LOCAL_ASSIGN:
+          {
+            NEED (2);
+            insn->op = INSN_LOCAL_ASSIGN;
+            insn->a = (u8_t)((bc->data << 8) | p[1]);
+            return 2;
+          }
+        }
+    }
+  else if (DOUBLE == bc->encode)
+    {
+      NEED (2);
+      switch (bc->data)
+        {
+        case PRELUDE:
+          {
+            insn->op = INSN_PRELUDE;
+            insn->b = p[1];
+            return 2;
+          }
+        case LOCAL_REF_HIGH:
+          {
+            insn->op = INSN_LOCAL_REF;
+            insn->a = (u8_t)(p[1] + 32);
+            return 2;
+          }
+        case CALL_LOCAL_HIGH:
+          {
+            insn->op = INSN_CALL_LOCAL;
+            insn->a = (u8_t)(p[1] + 32);
+            return 2;
+          }
+        case GLOBAL_VAR_ASSIGN:
+        case GLOBAL_VAR_REF:
+        case CALL_GLOBAL_VAR:
+          {
+            insn->op = (GLOBAL_VAR_ASSIGN == bc->data) ? INSN_GLOBAL_ASSIGN
+                       : (GLOBAL_VAR_REF == bc->data)  ? INSN_GLOBAL_REF
+                                                      : INSN_CALL_GLOBAL;
+            insn->a = p[1];
+            return 2;
+          }
+        default:
+          return 2;
+        }
+    }
+  else if (TRIPLE == bc->encode)
+    {
+      NEED (3);
+      switch (bc->data)
+        {
+        case CALL_PROC:
+        case F_JMP:
+        case JMP:
+          {
+            insn->op = (CALL_PROC == bc->data) ? INSN_CALL_PROC
+                       : (F_JMP == bc->data)   ? INSN_FJUMP
+                                              : INSN_JUMP;
+            insn->target = (p[1] << 8) | p[2];
+            return 3;
+          }
+        case GLOBAL_VAR_ASSIGN_EXTEND:
+        case GLOBAL_VAR_REF_EXTEND:
+        case CALL_GLOBAL_VAR_EXTEND:
+          {
+            /* NOTE: The extended index is in the byte after the encoding. */
+            static const u8_t ops[]
+              = {INSN_GLOBAL_ASSIGN, INSN_GLOBAL_REF, INSN_CALL_GLOBAL};
+            NEED (4);
+            insn->op = ops[bc->data - GLOBAL_VAR_ASSIGN_EXTEND];
+            insn->a = p[3] + 256;
+            return 4;
+          }
+        default:
+          return 3;
+        }
+    }
+  else if (QUADRUPLE == bc->encode)
+    {
+      NEED (4);
+      if (CLOSURE_ON_HEAP == bc->data)
+        {
+          insn->op = INSN_CLOSURE_ON_HEAP;
+          insn->a = ((p[1] & 0xF0) >> 4); // arity
+          insn->b = (p[1] & 0xF);         // frame size
+          insn->target = ((p[2] << 8) | p[3]);
+        }
+      return 4;
+    }
+#  if (4 == PC_SIZE)
+  else if (WIDE == bc->encode)
+    {
+      switch (bc->data)
+        {
+        case WIDE_CALL_PROC:
+        case WIDE_F_JMP:
+        case WIDE_JMP:
+          {
+            NEED (5);
+            insn->op = (WIDE_CALL_PROC == bc->data) ? INSN_CALL_PROC
+                       : (WIDE_F_JMP == bc->data)   ? INSN_FJUMP
+                                                   : INSN_JUMP;
+            insn->target = (reg_t)read_uintptr (p + 1);
+            /* NOTE:
+             * The fused sequences find the target in the last 3 bytes, see
+             * insn_branch_target, so it's kept in that entry too.
+             */
+            insn[2].target = insn->target;
+            return 5;
+          }
+        case WIDE_CLOSURE_ON_HEAP:
+          {
+            NEED (6);
+            insn->op = INSN_CLOSURE_ON_HEAP;
+            insn->a = ((p[1] & 0xF0) >> 4); // arity
+            insn->b = (p[1] & 0xF);         // frame size
+            insn->target = (reg_t)read_uintptr (p + 2);
+            return 6;
+          }
+        case WIDE_PROCEDURE:
+          {
+            NEED (7);
+            insn->op = INSN_PUSH_CONST;
+            insn->obj.attr.type = procedure;
+            insn->obj.attr.gc = FREE_OBJ;
+            insn->obj.proc.entry = (reg_t)read_uintptr (p + 1);
+            insn->obj.proc.arity = p[5];
+            insn->obj.proc.opt = p[6];
+            return 7;
+          }
+        default:
+          return 1;
+        }
+    }
+#  endif
+  else if (PRIMITIVE == bc->type)
+    {
+      insn->op = (restore == bc->data) ? INSN_RESTORE : INSN_PRIMITIVE;
+      insn->a = bc->data;
+      insn->prim = get_prim (bc->data);
+      return 1;
+    }
+  else if (PRIMITIVE_EXT == bc->type)
+    {
+      NEED (2);
+      u16_t pn = ((bc->data & 0xF) << 8 | p[1]) + 16;
+      if (pn < PRIM_MAX)
+        {
+          insn->op = INSN_PRIMITIVE;
+          insn->a = pn;
+          insn->prim = get_prim (pn);
+        }
+      return 2;
+    }
+  else if (OBJECT == bc->type)
+    {
+      switch (bc->data)
+        {
+        case FALSE:
+          {
+            insn->op = INSN_PUSH_CONST;
+            insn->obj = GLOBAL_REF (false_const);
+            return 1;
+          }
+        case TRUE:
+          {
+            insn->op = INSN_PUSH_CONST;
+            insn->obj = GLOBAL_REF (true_const);
+            return 1;
+          }
+        case CHAR:
+          {
+            NEED (2);
+            PUSH_CONST (character, p[1]);
+            return 2;
+          }
+        case SYMBOL:
+          {
+            NEED (3);
+            return 3;
+          }
+        case GENERAL_OBJECT:
+          {
+            size_t len = decode_general_object (insn, p + 1, avail - 1);
+            return len ? 1 + len : 0;
+          }
+        default:
+          return 1;
+        }
+    }
+  else if (CONTROL == bc->type)
+    {
+      insn->op = (HALT == bc->data) ? INSN_HALT : INSN_NOP;
+      return 1;
+    }
+
+  return 1;
+}
+
+#  if defined PREDECODE_STATS || defined USE_SUPERINSN \
+    || defined USE_REGISTER_IR || defined USE_TAIL_MOVE || defined USE_LEAF_FRAME
+/* NOTE:
+ * Return the next instruction after pc in the sweep order, INSN_RAW has no
+ * len, so we find the next start.
+ */
+static size_t sweep_next (const insn_t *insns, size_t size, size_t pc)
+{
+  if (pc >= size)
+    return size;
+
+  if (insns[pc].len)
+    return pc + insns[pc].len;
+
+  size_t next = pc + 1;
+
+  while (next < size && !(insns[next].flags & INSN_START))
+    next++;
+
+  return next;
+}
+#  endif
+
+#  ifdef PREDECODE_STATS
+static const char *insn_names[]
+  = {"raw",         "nop",         "local-ref",     "local-assign",
+     "free-ref",    "free-assign", "call-local",    "call-free",
+     "prelude",     "global-ref",  "global-assign", "call-global",
+     "call-proc",   "fjump",       "jump",          "closure-on-heap",
+     "primitive",   "restore",     "const",         "halt"};
+
+/* NOTE:
+ * Print the counts of the instruction pairs and triples in the sweep order,
+ * one per line, to pick the superinstructions. To profile a corpus, load each
+ * LEF and sum the lines up, say, with sort and awk.
+ */
+static void predecode_stats (const insn_t *insns, size_t size)
+{
+  size_t n = INSN_HALT + 1;
+  u16_t *pairs = (u16_t *)os_calloc (n * n, sizeof (u16_t));
+  u16_t *triples = (u16_t *)os_calloc (n * n * n, sizeof (u16_t));
+
+  if (!pairs || !triples)
+    goto end;
+
+  u8_t prev[2] = {INSN_OP_MAX, INSN_OP_MAX};
+
+  for (size_t pc = 0; pc < size; pc = sweep_next (insns, size, pc))
+    {
+      u8_t op = insns[pc].op;
+
+      if (INSN_OP_MAX != prev[1])
+        pairs[prev[1] * n + op]++;
+
+      if (INSN_OP_MAX != prev[0])
+        triples[(prev[0] * n + prev[1]) * n + op]++;
+
+      prev[0] = prev[1];
+      prev[1] = op;
+    }
+
+  for (size_t i = 0; i < n * n; i++)
+    if (pairs[i])
+      os_printk ("insn-pair %s %s %d\n", insn_names[i / n],
+                 insn_names[i % n], pairs[i]);
+
+  for (size_t i = 0; i < n * n * n; i++)
+    if (triples[i])
+      os_printk ("insn-triple %s %s %s %d\n", insn_names[i / (n * n)],
+                 insn_names[(i / n) % n], insn_names[i % n], triples[i]);
+
+end:
+  if (pairs)
+    os_free (pairs);
+
+  if (triples)
+    os_free (triples);
+}
+#  endif
+
+#  if defined USE_SUPERINSN || defined USE_REGISTER_IR || defined USE_TAIL_MOVE
+static bool is_fusible_const (const insn_t *insn)
+{
+  /* NOTE:
+   * The procedure constants are left alone, the verifier walks them to
+   * find the procedure entries.
+   */
+  return (INSN_PUSH_CONST == insn->op && procedure != insn->obj.attr.type);
+}
+#  endif
+
+#  if defined USE_SUPERINSN || defined USE_REGISTER_IR
+static bool is_prim2 (const insn_t *insn)
+{
+  return (INSN_PRIMITIVE == insn->op
+          && (PRIM_IS_ARITH2 (insn->a) || PRIM_IS_LOGIC2 (insn->a)));
+}
+
+static bool is_logic2 (const insn_t *insn)
+{
+  return (INSN_PRIMITIVE == insn->op && PRIM_IS_LOGIC2 (insn->a));
+}
+#  endif
+
+#  ifdef USE_SUPERINSN
+/* NOTE:
+ * Rewrite the common sequences into the superinstructions, which are picked
+ * with PREDECODE_STATS. The sequences never cross an INSN_RAW entry, and the
+ * longest one wins.
+ * The rewriting is in the sweep order, so the components are always read
+ * before they're rewritten themselves.
+ */
+static void fuse_program (insn_t *insns, size_t size)
+{
+  for (size_t pc = 0; pc < size;)
+    {
+      insn_t *i0 = &insns[pc];
+      size_t p1 = sweep_next (insns, size, pc);
+      size_t p2 = sweep_next (insns, size, p1);
+      size_t p3 = sweep_next (insns, size, p2);
+      // the sentinel entry is INSN_RAW, so it never matches
+      const insn_t *i1 = &insns[p1];
+      const insn_t *i2 = &insns[p2];
+      const insn_t *i3 = &insns[p3];
+
+      switch (i0->op)
+        {
+        case INSN_LOCAL_REF:
+          {
+            if (is_fusible_const (i1) && is_logic2 (i2)
+                && INSN_FJUMP == i3->op)
+              {
+                i0->op = INSN_LOCAL_CONST_FJUMP;
+                i0->b = i2->a;
+                i0->obj = i1->obj;
+                i0->len = (p3 - pc) + i3->len;
+              }
+            else if (is_fusible_const (i1) && is_prim2 (i2))
+              {
+                i0->op = INSN_LOCAL_CONST_PRIM;
+                i0->b = i2->a;
+                i0->obj = i1->obj;
+                i0->len = (p2 - pc) + i2->len;
+              }
+            else if (is_prim2 (i1))
+              {
+                i0->op = INSN_LOCAL_PRIM;
+                i0->b = i1->a;
+                i0->len = (p1 - pc) + i1->len;
+              }
+            break;
+          }
+        case INSN_PUSH_CONST:
+          {
+            if (is_fusible_const (i0) && is_prim2 (i1))
+              {
+                i0->op = INSN_CONST_PRIM;
+                i0->b = i1->a;
+                i0->len = (p1 - pc) + i1->len;
+              }
+            break;
+          }
+        case INSN_PRIMITIVE:
+          {
+            if (is_logic2 (i0) && INSN_FJUMP == i1->op)
+              {
+                i0->op = INSN_PRIM_FJUMP;
+                i0->b = i0->a;
+                i0->len = (p1 - pc) + i1->len;
+              }
+            break;
+          }
+        case INSN_GLOBAL_REF:
+          {
+            if (INSN_CALL_GLOBAL == i1->op)
+              {
+                i0->op = INSN_GLOBAL_CALL_GLOBAL;
+                i0->b = i1->a;
+                i0->len = (p1 - pc) + i1->len;
+              }
+            break;
+          }
+        default:
+          break;
+        }
+
+      pc = p1;
+    }
+}
+#  endif
+
+#  ifdef USE_REGISTER_IR
+/* NOTE:
+ * Return the register of the operand pushed by insn, or REG_STACK if it's not
+ * an operand, the constant is taken only when has_const is false.
+ */
+static u16_t reg_operand (const insn_t *insn, bool has_const)
+{
+  switch (insn->op)
+    {
+    case INSN_LOCAL_REF:
+      return insn->a <= REG_INDEX_MAX ? REG (REG_LOCAL, insn->a) : REG_STACK;
+    case INSN_GLOBAL_REF:
+      return insn->a <= REG_INDEX_MAX ? REG (REG_GLOBAL, insn->a) : REG_STACK;
+    case INSN_PUSH_CONST:
+      return (!has_const && is_fusible_const (insn)) ? REG (REG_CONST, 0)
+                                                     : REG_STACK;
+    default:
+      return REG_STACK;
+    }
+}
+
+/* NOTE:
+ * Translate the pushes of the operands and the 2-args primitive which pops
+ * them into the register form, so the locals, the globals and the constants
+ * are read in place rather than copied onto the stack and popped again:
+ *
+ *   local 0; const 1; primitive -    =>  push (- local:0 const:1)
+ *   local 1; primitive <; fjump L    =>  fjump L if (< stack local:1) is false
+ *
+ * As the superinstructions, the entries of the components are left intact for
+ * the jumps into the middle, and it runs before fuse_program, so the register
+ * form wins over the shorter superinstructions.
+ */
+static void to_register_form (insn_t *insns, size_t size)
+{
+  size_t before = 0;
+  size_t after = 0;
+
+  for (size_t pc = 0; pc < size; pc = sweep_next (insns, size, pc))
+    {
+      insn_t *i0 = &insns[pc];
+      size_t p1 = sweep_next (insns, size, pc);
+      size_t p2 = sweep_next (insns, size, p1);
+      // the sentinel entry is INSN_RAW, so it never matches
+      const insn_t *i1 = &insns[p1];
+      const insn_t *i2 = &insns[p2];
+      u16_t r0 = reg_operand (i0, false);
+      u16_t r1 = reg_operand (i1, REG_CONST == REG_KIND (r0));
+      u16_t a = REG_STACK;
+      u16_t c = REG_STACK;
+      size_t prim = 0;
+
+      before++;
+      after++;
+
+      if (REG_STACK != r0 && REG_STACK != r1 && is_prim2 (i2))
+        {
+          a = r0;
+          c = r1;
+          prim = p2;
+        }
+      else if (REG_STACK != r0 && is_prim2 (i1))
+        {
+          c = r0;
+          prim = p1;
+        }
+      else if (is_logic2 (i0))
+        prim = pc;
+      else
+        continue;
+
+      const insn_t *p = &insns[prim];
+      size_t end = sweep_next (insns, size, prim);
+      u8_t op = INSN_PRIM_REG;
+
+      if (is_logic2 (p) && INSN_FJUMP == insns[end].op)
+        {
+          op = INSN_PRIM_REG_FJUMP;
+          end = sweep_next (insns, size, end);
+        }
+      else if (i0 == p)
+        continue;
+
+      for (size_t i = p1; i < end; i = sweep_next (insns, size, i))
+        before++;
+
+      // the constant of i0 is in place already
+      if (REG_CONST == REG_KIND (r1))
+        i0->obj = i1->obj;
+
+      i0->b = p->a;
+      i0->a = a;
+      i0->c = c;
+      i0->op = op;
+      i0->len = end - pc;
+    }
+
+  VM_DEBUG ("register form: %zu -> %zu instructions\n", before, after);
+}
+#  endif
+
+#  ifdef USE_TAIL_MOVE
+/* NOTE:
+ * The args which push one object, and never touch the stack below or
+ * allocate, so they can be computed into the temporaries, see op_tail_move in
+ * vm.c.
+ */
+static bool is_tail_arg (const insn_t *insn)
+{
+  switch (insn->op)
+    {
+    case INSN_LOCAL_REF:
+    case INSN_FREE_REF:
+    case INSN_GLOBAL_REF:
+      return true;
+    case INSN_PUSH_CONST:
+      return is_fusible_const (insn);
+    case INSN_PRIM_REG:
+      return (REG_STACK != REG_KIND (insn->a)
+              && REG_STACK != REG_KIND (insn->c));
+    default:
+      return false;
+    }
+}
+
+/* NOTE:
+ * Rewrite the tail-recursive calls whose args are all simple:
+ *
+ *   prelude tail-rec n; arg 0; ... arg n-1; call-proc L
+ *
+ * into INSN_TAIL_MOVE, which moves the args into the locals directly, rather
+ * than pushing them above the frame to be copied down by COPY_SHADOW_FRAME.
+ * It runs after to_register_form, so the arithmetic args are one instruction.
+ */
+static void fuse_tail_calls (insn_t *insns, size_t size)
+{
+  for (size_t pc = 0; pc < size; pc = sweep_next (insns, size, pc))
+    {
+      insn_t *i0 = &insns[pc];
+
+      if (INSN_PRELUDE != i0->op || TAIL_REC != PROC_MODE (i0->b)
+          || PROC_ARITY (i0->b) > TAIL_MOVE_MAX)
+        continue;
+
+      u8_t arity = PROC_ARITY (i0->b);
+      size_t p = sweep_next (insns, size, pc);
+      u8_t i = 0;
+
+      for (; i < arity && is_tail_arg (&insns[p]); i++)
+        p = sweep_next (insns, size, p);
+
+      if (i < arity || INSN_CALL_PROC != insns[p].op)
+        continue;
+
+      i0->op = INSN_TAIL_MOVE;
+      i0->a = arity;
+      i0->c = i0->len;
+      i0->len = (p - pc) + insns[p].len;
+    }
+}
+#  endif
+
+#  ifdef USE_LEAF_FRAME
+#    define LEAF_UNKNOWN 0
+#    define LEAF_YES     1
+#    define LEAF_NO      2
+
+// The primitives which never allocate, call or touch the frames
+static bool is_leaf_prim (u16_t pn)
+{
+  return (PRIM_IS_ARITH2 (pn) || PRIM_IS_LOGIC2 (pn) || not == pn);
+}
+
+static bool is_leaf_insn (const insn_t *insn)
+{
+  switch (insn->op)
+    {
+    case INSN_NOP:
+    case INSN_LOCAL_REF:
+    case INSN_GLOBAL_REF:
+    case INSN_PUSH_CONST:
+    case INSN_FJUMP:
+    case INSN_JUMP:
+    case INSN_RESTORE:
+      return true;
+    case INSN_PRIMITIVE:
+      return is_leaf_prim (insn->a);
+    default:
+      return false;
+    }
+}
+
+/* NOTE:
+ * Walk the instructions reachable from entry, the stamps mark the walked ones
+ * of this walk, and todo has room for all of them.
+ */
+static bool is_leaf (const insn_t *insns, size_t size, reg_t entry,
+                     u32_t *stamps, u32_t stamp, reg_t *todo)
+{
+  size_t cnt = 0;
+
+  if (entry >= size)
+    return false;
+
+  stamps[entry] = stamp;
+  todo[cnt++] = entry;
+
+  while (cnt)
+    {
+      reg_t pc = todo[--cnt];
+      const insn_t *insn = &insns[pc];
+      size_t to[2];
+      int n = 0;
+
+      if (!is_leaf_insn (insn))
+        return false;
+
+      if (INSN_FJUMP == insn->op || INSN_JUMP == insn->op)
+        to[n++] = insn->target;
+
+      if (INSN_JUMP != insn->op && INSN_RESTORE != insn->op)
+        to[n++] = pc + insn->len;
+
+      for (int i = 0; i < n; i++)
+        {
+          // the leaf never runs off the code
+          if (to[i] >= size)
+            return false;
+
+          if (stamp != stamps[to[i]])
+            {
+              stamps[to[i]] = stamp;
+              todo[cnt++] = to[i];
+            }
+        }
+    }
+
+  return true;
+}
+
+/* NOTE:
+ * A leaf procedure makes no calls, never allocates and never walks the
+ * frames, so the GC never sees its frame. The direct calls to the leaf whose
+ * args are computed in place:
+ *
+ *   prelude normal n; arg ...; call-proc L
+ *
+ * are rewritten into INSN_NOP and INSN_LEAF_CALL, which saves only the return
+ * pc, the local and the closure of the caller, see LEAF_CALL in vm.h. The
+ * closure is saved since the locals of the caller may be in it.
+ * It runs before the other rewritings on the plain instructions, and lef2c
+ * runs it too, so the translated code agrees with the interpreter.
+ */
+void fuse_leaf_calls (insn_t *insns, size_t size)
+{
+  u8_t *leaf = (u8_t *)os_calloc (size + 1, sizeof (u8_t));
+  u32_t *stamps = (u32_t *)os_calloc (size + 1, sizeof (u32_t));
+  reg_t *todo = (reg_t *)os_calloc (size + 1, sizeof (reg_t));
+  u32_t stamp = 0;
+  size_t cnt = 0;
+
+  if (!leaf || !stamps || !todo)
+    goto end;
+
+  for (size_t pc = 0; pc < size; pc = sweep_next (insns, size, pc))
+    {
+      insn_t *i0 = &insns[pc];
+
+      if (INSN_PRELUDE != i0->op || NORMAL_CALL != PROC_MODE (i0->b))
+        continue;
+
+      int depth = 0;
+      size_t p = sweep_next (insns, size, pc);
+
+      // the args are only the pushes and the primitives of the leaf
+      for (; p < size; p = sweep_next (insns, size, p))
+        {
+          const insn_t *arg = &insns[p];
+
+          if (INSN_LOCAL_REF == arg->op || INSN_FREE_REF == arg->op
+              || INSN_GLOBAL_REF == arg->op || INSN_PUSH_CONST == arg->op)
+            depth++;
+          else if (INSN_PRIMITIVE == arg->op && is_leaf_prim (arg->a))
+            depth -= (not == arg->a) ? 0 : 1;
+          else
+            break;
+        }
+
+      insn_t *call = &insns[p];
+
+      if (INSN_CALL_PROC != call->op || PROC_ARITY (i0->b) != depth
+          || call->target >= size)
+        continue;
+
+      if (LEAF_UNKNOWN == leaf[call->target])
+        leaf[call->target]
+          = is_leaf (insns, size, call->target, stamps, ++stamp, todo)
+              ? LEAF_YES
+              : LEAF_NO;
+
+      if (LEAF_YES != leaf[call->target])
+        continue;
+
+      i0->op = INSN_NOP;
+      call->op = INSN_LEAF_CALL;
+      call->a = depth;
+      cnt++;
+    }
+
+  VM_DEBUG ("leaf frame: %zu calls\n", cnt);
+
+end:
+  if (leaf)
+    os_free (leaf);
+
+  if (stamps)
+    os_free (stamps);
+
+  if (todo)
+    os_free (todo);
+}
+#  endif
+
+/* NOTE:
+ * Decode the program without the superinstructions, for the tools which
+ * work on the plain instructions, say, lef2c.
+ */
+insn_t *decode_program (const u8_t *code, size_t size)
+{
+  if (0 == size)
+    return NULL;
+
+  /* NOTE:
+   * The extra INSN_RAW entry at the end catches the pc which runs off the
+   * code, the interpreter would panic for it.
+   */
+  insn_t *insns = (insn_t *)os_calloc (size + 1, sizeof (insn_t));
+
+  if (!insns)
+    {
+      VM_DEBUG ("predecode: no memory, run the bytecode directly!\n");
+      return NULL;
+    }
+
+  for (size_t pc = 0; pc < size;)
+    {
+      size_t len = decode_insn (&insns[pc], code, pc, size);
+
+      if (0 == len)
+        {
+          /* NOTE:
+           * We can't know where the next instruction is, so the rest of the
+           * code is left to the interpreter.
+           */
+          os_memset (&insns[pc], 0, sizeof (insn_t));
+          break;
+        }
+
+      if (INSN_RAW == insns[pc].op)
+        {
+          // only the objects popped by the raw one are kept, see verifier.c
+          u16_t pops = insns[pc].a;
+          os_memset (&insns[pc], 0, sizeof (insn_t));
+          insns[pc].a = pops;
+        }
+      else
+        insns[pc].len = len;
+
+      insns[pc].flags = INSN_START;
+
+      pc += len;
+    }
+
+  return insns;
+}
+
+insn_t *predecode_program (const u8_t *code, size_t size)
+{
+  insn_t *insns = decode_program (code, size);
+
+  if (!insns)
+    return NULL;
+
+#  ifdef PREDECODE_STATS
+  predecode_stats (insns, size);
+#  endif
+
+#  ifdef USE_LEAF_FRAME
+  fuse_leaf_calls (insns, size);
+#  endif
+
+#  ifdef USE_REGISTER_IR
+  to_register_form (insns, size);
+#  endif
+
+#  ifdef USE_TAIL_MOVE
+  fuse_tail_calls (insns, size);
+#  endif
+
+#  ifdef USE_SUPERINSN
+  fuse_program (insns, size);
+#  endif
+
+  return insns;
+}
+#endif
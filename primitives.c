@@ -1453,11 +1453,9 @@ static object_t _os_i2c_read_list (vm_t vm, object_t ret, object_t dev,
       // avoid crash in case GC was triggered here
       bl->obj = (void *)0xDEADBEEF;
 
-      object_t new_obj = NEW_OBJ (imm_int);
-      new_obj->attr.gc = GEN_1_OBJ;
-      new_obj->value = (void *)rx_buf[i];
-
-      bl->obj = new_obj;
+      Object v = {.attr = {.type = imm_int, .gc = GEN_1_OBJ},
+                  .value = (void *)rx_buf[i]};
+      bl->obj = BOX_OBJ (imm_int, &v, GEN_1_OBJ);
 
       if (0 == i)
         {
@@ -1826,11 +1824,9 @@ static object_t _os_i2c_read_list (vm_t vm, object_t ret, object_t dev,
       list_node_t bl = NEW_LIST_NODE ();
       // avoid crash in case GC was triggered here
       bl->obj = (void *)0xDEADBEEF;
-      object_t new_obj = NEW_OBJ (imm_int);
-      new_obj->attr.gc = GEN_1_OBJ;
-      bl->obj = new_obj;
-
-      new_obj->value = (void *)rx_buf[i];
+      Object v = {.attr = {.type = imm_int, .gc = GEN_1_OBJ},
+                  .value = (void *)rx_buf[i]};
+      bl->obj = BOX_OBJ (imm_int, &v, GEN_1_OBJ);
       if (0 == i)
         {
           SLIST_INSERT_HEAD (&l->list, bl, next);
@@ -2102,7 +2098,7 @@ void primitives_init (void)
   def_prim (27, "device-configure!", 2, (void *)_os_device_configure);
   def_prim (28, "gpio-set!", 2, (void *)_os_gpio_set);
   def_prim (29, "gpio-toggle!", 1, (void *)_os_gpio_toggle);
-  def_prim (30, "get-board-id", 2, (void *)_os_get_board_id);
+  def_prim (30, "get-board-id", 0, (void *)_os_get_board_id);
   def_prim (31, "cons", 2, (void *)_cons);
   def_prim (32, "car", 1, (void *)_car);
   def_prim (33, "cdr", 1, (void *)_cdr);
@@ -0,0 +1,144 @@
+#  Copyright (C) 2020-2021
+#        "Mu Lei" known as "NalaGinrut" <NalaGinrut@gmail.com>
+#  Animula is free software: you can redistribute it and/or modify
+#  it under the terms of the GNU Lesser General Public License as
+#  published by the Free Software Foundation, either version 3 of the
+#  License, or  (at your option) any later version.
+
+#  Animula is distributed in the hope that it will be useful,
+#  but WITHOUT ANY WARRANTY; without even the implied warranty of
+#  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+#  GNU Lesser General Public License for more details.
+
+#  You should have received a copy of the GNU Lesser General Public
+#  License along with this program.
+#  If not, see <http://www.gnu.org/licenses/>.
+
+# NOTE:
+# A tiny assembler of the bytecode in inc/bytecode.h, it writes the LEF
+# files for the regression tests in regress.py.
+
+import struct
+
+# the prim numbers, see primitives_init in primitives.c
+POP, ADD, SUB, MUL, PRINT, APPLY = 1, 2, 3, 4, 6, 7
+EQ, LT, RESTORE, MAP, LIST_REF, LIST_SET, CONS = 9, 10, 14, 19, 20, 21, 31
+
+# the prelude modes, see SAVE_ENV in inc/vm.h
+TAIL_CALL, TAIL_REC, NORMAL_CALL = 0, 1, 2
+
+
+class Asm:
+    def __init__(self):
+        self.code = bytearray()
+        self.labels = {}
+        self.fix = []   # the 16 bits targets
+        self.wfix = []  # the 32 bits targets of the wide encoding
+
+    def here(self):
+        return len(self.code)
+
+    def label(self, name):
+        self.labels[name] = len(self.code)
+
+    def b(self, *xs):
+        self.code += bytes(xs)
+
+    def _target(self, name):
+        self.fix.append((self.here(), name))
+        self.b(0, 0)
+
+    def _wide_target(self, name):
+        self.wfix.append((self.here(), name))
+        self.b(0, 0, 0, 0)
+
+    def local(self, i):
+        if i < 16:
+            self.b(0x00 | i)
+        elif i < 32:
+            self.b(0x10 | (i - 16))
+        else:
+            self.b(0xA1, i - 32)
+
+    def local_assign(self, i):
+        self.b(0x70 | (i >> 8), i & 0xFF)
+
+    def free(self, up, off):
+        self.b(0x20 | (off >> 2), ((off & 3) << 6) | up)
+
+    def prelude(self, arity, mode=NORMAL_CALL):
+        self.b(0xA0, (arity << 2) | mode)
+
+    def gref(self, i):
+        self.b(0xA4, i)
+
+    def gassign(self, i):
+        self.b(0xA3, i)
+
+    def call_global(self, i):
+        self.b(0xA5, i)
+
+    def call_proc(self, name):
+        self.b(0xB0)
+        self._target(name)
+
+    def fjmp(self, name):
+        self.b(0xB1)
+        self._target(name)
+
+    def jmp(self, name):
+        self.b(0xB2)
+        self._target(name)
+
+    def closure(self, arity, size, name):
+        self.b(0x81, (arity << 4) | size)
+        self._target(name)
+
+    def wcall_proc(self, name):
+        self.b(0x90)
+        self._wide_target(name)
+
+    def wjmp(self, name):
+        self.b(0x92)
+        self._wide_target(name)
+
+    def wclosure(self, arity, size, name):
+        self.b(0x93, (arity << 4) | size)
+        self._wide_target(name)
+
+    def int(self, v):
+        self.b(0xE2, 0)
+        self.code += struct.pack('>I', v & 0xFFFFFFFF)
+
+    def proc(self, name, arity, opt):
+        self.b(0xE2, 9)
+        self._target(name)
+        self.b(arity, opt)
+
+    def list(self, n):
+        self.b(0xE2, 7, n >> 8, n & 0xFF)
+
+    def prim(self, pn):
+        if pn < 16:
+            self.b(0xC0 | pn)
+        else:
+            self.b(0xD0 | ((pn - 16) >> 8), (pn - 16) & 0xFF)
+
+    def halt(self):
+        self.b(0xFF)
+
+    def link(self):
+        for off, name in self.fix:
+            self.code[off:off + 2] = struct.pack('>H', self.labels[name])
+        for off, name in self.wfix:
+            self.code[off:off + 4] = struct.pack('>I', self.labels[name])
+        return bytes(self.code)
+
+
+def write_lef(path, globals_code, program, entry=0):
+    mem = struct.pack('>HHI', 0, 0, entry)
+    hdr = b'LEF' + bytes([0, 0, 1])
+    hdr += struct.pack('>IIII', len(mem), len(globals_code), len(program), 0)
+
+    with open(path, 'wb') as f:
+        f.write(hdr + mem + globals_code + program)
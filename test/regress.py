@@ -0,0 +1,311 @@
+#!/usr/bin/env python3
+#  Copyright (C) 2020-2021
+#        "Mu Lei" known as "NalaGinrut" <NalaGinrut@gmail.com>
+#  Animula is free software: you can redistribute it and/or modify
+#  it under the terms of the GNU Lesser General Public License as
+#  published by the Free Software Foundation, either version 3 of the
+#  License, or  (at your option) any later version.
+
+#  Animula is distributed in the hope that it will be useful,
+#  but WITHOUT ANY WARRANTY; without even the implied warranty of
+#  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+#  GNU Lesser General Public License for more details.
+
+#  You should have received a copy of the GNU Lesser General Public
+#  License along with this program.
+#  If not, see <http://www.gnu.org/licenses/>.
+
+# NOTE:
+# The regression tests of the VM. Each test writes a LEF program, runs it
+# with the host build of Animula, which loads the LEF file in argv[1], and
+# compares what it prints.
+#
+# usage: regress.py [--pc-size 2|4] <animula> [test ...]
+#
+# The tests of the wide encoding run only with --pc-size 4, which must match
+# PC_SIZE of the build.
+
+import os
+import subprocess
+import sys
+import tempfile
+
+from lefasm import *
+
+TESTS = []
+
+
+def test(expect, pc_size=None):
+    def register(fn):
+        TESTS.append((fn.__name__, fn, expect, pc_size))
+        return fn
+    return register
+
+
+# The backward jump loop which calls the primitives, the verifier must see
+# it's balanced, see compute_depth in verifier.c.
+@test('55')
+def prim_loop():
+    g = Asm()
+    g.int(10)  # global 0: i
+    g.int(0)   # global 1: acc
+    g.halt()
+
+    p = Asm()
+    p.label('top')
+    p.gref(0); p.int(0); p.prim(EQ); p.fjmp('body')
+    p.gref(1); p.prim(PRINT); p.prim(POP); p.halt()
+    p.label('body')
+    p.gref(1); p.gref(0); p.prim(ADD); p.gassign(1); p.prim(POP)
+    p.int(1); p.int(2); p.int(3); p.list(3); p.prim(POP)
+    p.int(1); p.int(2); p.prim(CONS); p.prim(POP)
+    p.gref(0); p.int(1); p.prim(SUB); p.gassign(0); p.prim(POP)
+    p.jmp('top')
+    return g.link(), p.link()
+
+
+# The free vars of the nested calls in a closure, (free 1 0) of inner3 walks
+# to the frame saved in the closure body, so it's found in the closure env.
+# The local 0 of the body is the captured 10, see LOCAL in inc/vm.h.
+def free_closure(wide):
+    g = Asm()
+    g.int(0)  # global 0: the closure
+    g.halt()
+
+    p = Asm()
+    call = p.wcall_proc if wide else p.call_proc
+
+    p.int(0)
+    p.prelude(1); p.int(10); call('mk'); p.gassign(0); p.prim(POP)
+    p.prelude(1); p.int(5); p.call_global(0); p.prim(PRINT); p.prim(POP)
+    p.halt()
+    p.label('mk')
+    p.local(0)
+    (p.wclosure if wide else p.closure)(1, 1, 'body')
+    p.prim(RESTORE)
+    p.label('body')
+    p.prelude(1); p.int(1); call('inner'); p.local(0); p.prim(ADD)
+    p.prim(RESTORE)
+    p.label('inner')
+    p.prelude(1); p.int(2); call('inner2'); p.local(0); p.prim(ADD)
+    p.prim(RESTORE)
+    p.label('inner2')
+    p.free(1, 0); p.prelude(1); p.int(3); call('inner3'); p.prim(ADD)
+    p.local(0); p.prim(ADD); p.prim(RESTORE)
+    p.label('inner3')
+    p.free(1, 0); p.free(2, 0); p.prim(ADD); p.free(1, 0); p.prim(ADD)
+    p.local(0); p.prim(ADD); p.free(2, 0); p.prim(ADD); p.prim(RESTORE)
+    return g.link(), p.link()
+
+
+@test('51')
+def free_closure_narrow():
+    return free_closure(False)
+
+
+@test('51', pc_size=4)
+def free_closure_wide():
+    return free_closure(True)
+
+
+# The free vars of up 1 to 9 in a chain of 12 calls, P(i) gets 2^i. The
+# display caches the frames of the first lookup and is flushed by the call
+# to Q, and up 9 is beyond it, so it must print the same with and without
+# USE_DISPLAY.
+@test('1922')
+def free_display():
+    g = Asm()
+    g.halt()
+
+    p = Asm()
+    p.int(0)
+    p.prelude(1); p.int(1); p.call_proc('P0'); p.prim(PRINT); p.prim(POP)
+    p.halt()
+
+    for i in range(11):
+        p.label('P%d' % i)
+        p.prelude(1); p.int(1 << (i + 1)); p.call_proc('P%d' % (i + 1))
+        p.prim(RESTORE)
+
+    p.label('P11')
+    p.free(1, 0); p.free(2, 0); p.prim(ADD); p.free(2, 0); p.prim(ADD)
+    p.free(9, 0); p.prim(ADD); p.free(3, 0); p.prim(ADD)
+    p.prelude(1); p.int(0); p.call_proc('Q'); p.prim(ADD)
+    p.free(2, 0); p.prim(ADD); p.prim(RESTORE)
+    p.label('Q')
+    p.free(2, 0); p.prim(RESTORE)
+    return g.link(), p.link()
+
+
+# The lists kept in the frames of a recursion, the GC cycles begin deep in it
+# and the frames are shaded on the way back, see root_step in gc.c. Build it
+# with USE_INCREMENTAL_GC and a small GC_GRAY_SIZE to test the rescan.
+@test('420')
+def gc_frames():
+    g = Asm()
+    g.halt()
+
+    p = Asm()
+    p.int(0)
+    p.prelude(1); p.int(20); p.call_proc('build'); p.prim(PRINT); p.prim(POP)
+    p.halt()
+
+    # build(n) keeps (n (n n)) in local 1, and drops some garbage lists
+    p.label('build')
+    p.local(0); p.int(0); p.prim(EQ); p.fjmp('rec')
+    p.int(0); p.prim(RESTORE)
+    p.label('rec')
+    for i in range(3):
+        p.local(0); p.local(0); p.list(2); p.prim(POP)
+    p.local(0); p.local(0); p.local(0); p.list(2); p.list(2)
+    p.prelude(1); p.local(0); p.int(1); p.prim(SUB); p.call_proc('build')
+    for i in range(3):
+        p.local(0); p.local(0); p.list(2); p.prim(POP)
+    p.local(1); p.int(0); p.prim(LIST_REF)
+    p.local(1); p.int(1); p.prim(LIST_REF); p.int(1); p.prim(LIST_REF)
+    p.prim(ADD); p.prim(ADD); p.prim(RESTORE)
+    return g.link(), p.link()
+
+
+# map in a loop, inc drops some lists in each call, so the GC runs in the
+# middle of the maps and must keep the result list of the trampoline, see
+# tramp_enter in vm.c. Each result is checked, a freed one is reused by the
+# lists of inc.
+@test('12000')
+def map_gc():
+    g = Asm()
+    g.halt()
+
+    p = Asm()
+    p.int(0)
+    p.prelude(1); p.int(2000); p.call_proc('loop'); p.prim(PRINT); p.prim(POP)
+    p.halt()
+
+    # loop(n) adds the last element of each result to local 1
+    p.label('loop')
+    p.int(0)
+    p.label('top')
+    p.local(0); p.int(0); p.prim(EQ); p.fjmp('body')
+    p.local(1); p.prim(RESTORE)
+    p.label('body')
+    p.proc('inc', 2, 2); p.int(1); p.int(2); p.int(3); p.int(4); p.int(5)
+    p.list(5); p.prim(MAP); p.int(4); p.prim(LIST_REF)
+    p.local(1); p.prim(ADD); p.local_assign(1)
+    p.local(0); p.int(1); p.prim(SUB); p.local_assign(0)
+    p.jmp('top')
+
+    # map passes the continuation in local 0, see tramp_run in vm.c
+    p.label('inc')
+    for i in range(3):
+        p.local(1); p.local(1); p.list(2); p.prim(POP)
+    p.local(1); p.int(1); p.prim(ADD); p.prim(RESTORE)
+    return g.link(), p.link()
+
+
+# churn(n) drops n lists, so the GC runs in it
+def churn(p):
+    p.label('churn')
+    p.local(0); p.int(0); p.prim(EQ); p.fjmp('churn_body')
+    p.int(0); p.prim(RESTORE)
+    p.label('churn_body')
+    p.local(0); p.local(0); p.list(2); p.prim(POP)
+    p.local(0); p.int(1); p.prim(SUB); p.local_assign(0)
+    p.jmp('churn')
+
+
+# list-set! stores a young list into a list aged by the GCs, then the minor
+# GCs must find it through the remembered list, see GC_WRITE_BARRIER.
+@test('(1 (7 8) 3)')
+def list_set_aged():
+    g = Asm()
+    g.halt()
+
+    p = Asm()
+    p.int(0)
+    p.prelude(1); p.int(0); p.call_proc('aged'); p.prim(PRINT); p.prim(POP)
+    p.halt()
+
+    p.label('aged')
+    p.int(1); p.int(2); p.int(3); p.list(3)
+    p.prelude(1); p.int(1000); p.call_proc('churn'); p.prim(POP)
+    p.local(1); p.int(1); p.int(7); p.int(8); p.list(2); p.prim(LIST_SET)
+    p.prim(POP)
+    p.prelude(1); p.int(1000); p.call_proc('churn'); p.prim(POP)
+    p.local(1); p.prim(RESTORE)
+    churn(p)
+    return g.link(), p.link()
+
+
+# list-set! overwrites the tail of a long list in each turn, and the old tail
+# is kept in local 3 only, which is not shaded again in the GC cycle. So it's
+# kept by the snapshot of the cycle, see GC_SATB_BARRIER, till it's read after
+# the churn. Build it with USE_INCREMENTAL_GC and a small GC_STEP_WORK and
+# GC_PAUSE_US, so the list is marked in many steps. It adds up the old tails.
+@test('45150')
+def list_set_mark():
+    g = Asm()
+    g.halt()
+
+    p = Asm()
+    p.int(0)
+    p.prelude(1); p.int(300); p.call_proc('turns'); p.prim(PRINT); p.prim(POP)
+    p.halt()
+
+    # turns(n) keeps the list in local 1, the sum in local 2
+    p.label('turns')
+    for i in range(30):
+        p.int(i)
+    p.int(1); p.int(1); p.list(2)
+    p.list(31)
+    p.int(0); p.int(0)
+    p.label('turn')
+    p.local(0); p.int(0); p.prim(EQ); p.fjmp('turn_body')
+    p.local(2); p.prim(RESTORE)
+    p.label('turn_body')
+    p.local(1); p.int(30); p.prim(LIST_REF); p.local_assign(3)
+    p.local(1); p.int(30); p.local(0); p.local(0); p.list(2); p.prim(LIST_SET)
+    p.prim(POP)
+    p.prelude(1); p.int(100); p.call_proc('churn'); p.prim(POP)
+    p.local(3); p.int(1); p.prim(LIST_REF); p.local(2); p.prim(ADD)
+    p.local_assign(2)
+    p.local(0); p.int(1); p.prim(SUB); p.local_assign(0)
+    p.jmp('turn')
+    churn(p)
+    return g.link(), p.link()
+
+def main(argv):
+    pc_size = 2
+
+    if len(argv) > 2 and '--pc-size' == argv[1]:
+        pc_size = int(argv[2])
+        argv = argv[2:]
+
+    if len(argv) < 2:
+        print('usage: regress.py [--pc-size 2|4] <animula> [test ...]')
+        return 2
+
+    vm, names = argv[1], argv[2:]
+    failed = 0
+
+    with tempfile.TemporaryDirectory() as tmp:
+        for name, fn, expect, size in TESTS:
+            if (names and name not in names) or size not in (None, pc_size):
+                continue
+
+            path = os.path.join(tmp, name + '.lef')
+            write_lef(path, *fn())
+            run = subprocess.run([vm, path], stdout=subprocess.PIPE,
+                                 stderr=subprocess.STDOUT, timeout=60)
+            out = run.stdout.decode(errors='replace').strip()
+
+            if 0 == run.returncode and expect == out:
+                print('ok   ' + name)
+            else:
+                print('FAIL %s: got [%s] want [%s]' % (name, out, expect))
+                failed += 1
+
+    return 1 if failed else 0
+
+
+if __name__ == '__main__':
+    sys.exit(main(sys.argv))
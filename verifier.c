@@ -0,0 +1,550 @@
+/*  Copyright (C) 2020-2021
+ *        "Mu Lei" known as "NalaGinrut" <NalaGinrut@gmail.com>
+ *  Animula is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Lesser General Public License as
+ *  published by the Free Software Foundation, either version 3 of the
+ *  License, or  (at your option) any later version.
+
+ *  Animula is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Lesser General Public License for more details.
+
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this program.
+ *  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "vm.h"
+
+#ifdef USE_VERIFIER
+
+/* NOTE:
+ * The verifier works on the pre-decoded program in two steps:
+ * 1. Walk all the reachable instructions from the program entry, the call
+ *    targets, the closure entries and the procedure objects (include the ones
+ *    in the globals segment). Every jump target, call target and fallthrough
+ *    must be the start of an instruction in the segment.
+ * 2. Compute the stack depth before each reachable instruction, which must
+ *    be the same on all the paths to it, say, the head of a loop. Then
+ *    compute `need' for it, which is the max stack growth in bytes from this
+ *    instruction to the end of its procedure. A call is counted by its effect
+ *    after it returns, since the callee checks its own need on entry.
+ * So the VM checks the stack once on procedure entry, rather than for every
+ * push, and doesn't have to check pc for every instruction.
+ */
+
+#  define IS_START(insns, size, pc) \
+    ((pc) < (size) && ((insns)[(pc)].flags & INSN_START))
+
+/* NOTE:
+ * The stack depth before the instruction in bytes, relative to the first
+ * instruction of its procedure, and the prelude of the innermost call in
+ * progress, FRAME_NONE if there's no one.
+ */
+typedef struct Flow
+{
+  s16_t depth;
+  reg_t frame;
+} Flow;
+
+#  define FLOW_NONE  ((reg_t)-1) // not reached yet
+#  define FRAME_NONE ((reg_t)-2)
+#  define OBJ_SIZE   ((int)sizeof (Object))
+
+typedef struct Walker
+{
+  insn_t *insns;
+  size_t size;
+  reg_t *todo;
+  size_t cnt;
+  Flow *flow;
+} Walker;
+
+static bool is_terminal (const insn_t *insn)
+{
+  return (INSN_RESTORE == insn->op || INSN_HALT == insn->op
+          || INSN_JUMP == insn->op);
+}
+
+static size_t next_insn (const insn_t *insns, size_t size, size_t pc)
+{
+  if (insns[pc].len)
+    return pc + insns[pc].len;
+
+  // INSN_RAW, find the next instruction
+  size_t next = pc + 1;
+
+  while (next < size && !(insns[next].flags & INSN_START))
+    next++;
+
+  return next;
+}
+
+static bool reach (Walker *w, size_t pc, size_t from, const char *what)
+{
+  if (!IS_START (w->insns, w->size, pc))
+    {
+      os_printk ("verifier: invalid %s 0x%x at 0x%x\n", what, (u32_t)pc,
+                 (u32_t)from);
+      return false;
+    }
+
+  if (!(w->insns[pc].flags & INSN_REACHED))
+    {
+      w->insns[pc].flags |= INSN_REACHED;
+      w->todo[w->cnt++] = pc;
+    }
+
+  return true;
+}
+
+static bool reach_next (Walker *w, size_t pc)
+{
+  size_t next = next_insn (w->insns, w->size, pc);
+
+  /* NOTE:
+   * The tail call at the end of the code never returns, and the pc which
+   * runs off the code is caught by the last entry, see predecode_program.
+   */
+  return (w->size == next) || reach (w, next, pc, "next");
+}
+
+static bool is_proc_const (const insn_t *insn)
+{
+  return (INSN_PUSH_CONST == insn->op && procedure == insn->obj.attr.type);
+}
+
+/* NOTE:
+ * Walk the segment of w from the instructions in its todo list.
+ * The procedure objects always refer to the program segment p.
+ */
+static bool walk (Walker *w, Walker *p)
+{
+  while (w->cnt)
+    {
+      size_t pc = w->todo[--w->cnt];
+      const insn_t *insn = &w->insns[pc];
+
+      switch (insn->op)
+        {
+        case INSN_CALL_PROC:
+        case INSN_LEAF_CALL:
+        case INSN_CLOSURE_ON_HEAP:
+          {
+            if (!reach (w, insn->target, pc, "entry"))
+              return false;
+            break;
+          }
+        case INSN_TAIL_MOVE:
+          {
+            // the call-proc is the last 3 bytes, as the fused branches
+            reg_t entry = w->insns[pc + insn->len - 3].target;
+
+            if (!reach (w, entry, pc, "entry"))
+              return false;
+            break;
+          }
+        case INSN_FJUMP:
+        case INSN_JUMP:
+        case INSN_PRIM_FJUMP:
+        case INSN_LOCAL_CONST_FJUMP:
+        case INSN_PRIM_REG_FJUMP:
+          {
+            if (!reach (w, insn_branch_target (w->insns, pc), pc, "jump"))
+              return false;
+            break;
+          }
+        default:
+          {
+            if (is_proc_const (insn)
+                && !reach (p, insn->obj.proc.entry, pc, "procedure"))
+              return false;
+          }
+        }
+
+      if (!is_terminal (insn) && !reach_next (w, pc))
+        return false;
+    }
+
+  return true;
+}
+
+/* NOTE:
+ * Return the stack effect of the primitive in bytes, it pops its args, then
+ * pushes the result, see invoke_prim in vm.c.
+ */
+static int prim_effect (u16_t pn)
+{
+  prim_t prim = (pn < PRIM_MAX) ? get_prim (pn) : NULL;
+
+  switch (pn)
+    {
+    case ret:
+    case scm_raise:
+    case scm_raise_continuable:
+      return 0;
+    case pop:
+      return -OBJ_SIZE;
+    default:
+      return (1 - (prim ? prim->arity : 0)) * OBJ_SIZE;
+    }
+}
+
+/* NOTE:
+ * The call returns to the depth before its prelude, plus the returned value.
+ * It's the same for a tail call, in case the callee is a primitive.
+ * Without the prelude, the args are not counted, so it's the upper bound.
+ */
+static bool call_return (const Flow *flow, const insn_t *insns, size_t pc,
+                         Flow *out)
+{
+  reg_t frame = flow[pc].frame;
+
+  if (FRAME_NONE == frame)
+    {
+      out->depth = flow[pc].depth + OBJ_SIZE;
+      return true;
+    }
+
+  // the tail-recursive call never returns
+  if (TAIL_REC == PROC_MODE (insns[frame].b))
+    return false;
+
+  out->depth = flow[frame].depth + OBJ_SIZE;
+  out->frame = flow[frame].frame;
+  return true;
+}
+
+/* NOTE:
+ * Compute the flow after the instruction at pc to out, and the peak of the
+ * stack above the depth before it while it's running, in bytes.
+ * Return false if it never continues in the procedure.
+ */
+static bool transfer (const insn_t *insns, const Flow *flow, size_t pc,
+                      Flow *out, int *peak)
+{
+  const insn_t *insn = &insns[pc];
+  int effect = 0;
+
+  *out = flow[pc];
+  *peak = 0;
+
+  switch (insn->op)
+    {
+    case INSN_RESTORE:
+    case INSN_HALT:
+      return false;
+    case INSN_NOP:
+    case INSN_JUMP:
+    case INSN_GLOBAL_ASSIGN:
+      break;
+    case INSN_LOCAL_ASSIGN:
+    case INSN_FREE_ASSIGN:
+    case INSN_FJUMP:
+      effect = -OBJ_SIZE;
+      break;
+    case INSN_RAW:
+      // the object is pushed before the ones of the pair, list or vector
+      *peak = OBJ_SIZE;
+      effect = (1 - insn->a) * OBJ_SIZE;
+      break;
+    case INSN_CLOSURE_ON_HEAP:
+      // the frame is captured, then the closure is pushed
+      effect = (1 - insn->b) * OBJ_SIZE;
+      break;
+    case INSN_PRIMITIVE:
+      {
+        /* NOTE:
+         * apply enters the procedure in the frame of its caller, and the
+         * pushed args are checked by itself.
+         */
+        if (apply == insn->a && FRAME_NONE != flow[pc].frame)
+          {
+            *peak = OBJ_SIZE;
+            return call_return (flow, insns, pc, out);
+          }
+
+        effect = prim_effect (insn->a);
+        break;
+      }
+    case INSN_LOCAL_PRIM:
+    case INSN_CONST_PRIM:
+      *peak = OBJ_SIZE;
+      effect = OBJ_SIZE + prim_effect (insn->b);
+      break;
+    case INSN_LOCAL_CONST_PRIM:
+      *peak = 2 * OBJ_SIZE;
+      effect = 2 * OBJ_SIZE + prim_effect (insn->b);
+      break;
+    case INSN_PRIM_FJUMP:
+      effect = prim_effect (insn->b) - OBJ_SIZE;
+      break;
+    case INSN_LOCAL_CONST_FJUMP:
+      *peak = 2 * OBJ_SIZE;
+      effect = OBJ_SIZE + prim_effect (insn->b);
+      break;
+    case INSN_PRIM_REG:
+    case INSN_PRIM_REG_FJUMP:
+      {
+        // pop the operands on the stack, then push the result
+        int n = (REG_STACK == REG_KIND (insn->a))
+                + (REG_STACK == REG_KIND (insn->c));
+        effect = (INSN_PRIM_REG == insn->op) - n;
+        effect *= OBJ_SIZE;
+        break;
+      }
+    case INSN_PRELUDE:
+      {
+        out->frame = pc;
+
+        switch (PROC_MODE (insn->b))
+          {
+          case TAIL_CALL:
+            break;
+          case TAIL_REC:
+            // sp = local + arity, and local is not above sp
+            effect = PROC_ARITY (insn->b) * OBJ_SIZE;
+            break;
+          default:
+            effect = FPS;
+          }
+        break;
+      }
+    case INSN_TAIL_MOVE:
+      // as the tail-rec prelude, the generic primitive of an arg pushes one
+      *peak = insn->a * OBJ_SIZE;
+      return false;
+    case INSN_LEAF_CALL:
+      // the prelude is gone, the args are dropped as the normal frame
+      *peak = OBJ_SIZE;
+      effect = (1 - insn->a) * OBJ_SIZE;
+      break;
+    case INSN_GLOBAL_CALL_GLOBAL:
+      // the arg, the optional args list, then the returned value
+      *peak = 3 * OBJ_SIZE;
+      return call_return (flow, insns, pc, out);
+    case INSN_CALL_LOCAL:
+    case INSN_CALL_FREE:
+    case INSN_CALL_GLOBAL:
+    case INSN_CALL_PROC:
+      // the optional args list, then the returned value
+      *peak = 2 * OBJ_SIZE;
+      return call_return (flow, insns, pc, out);
+    default:
+      // the other instructions push one object
+      effect = OBJ_SIZE;
+    }
+
+  *peak = effect > *peak ? effect : *peak;
+  out->depth = flow[pc].depth + effect;
+  return true;
+}
+
+/* NOTE:
+ * Return the successors of the instruction, which continue with the flow
+ * computed by transfer.
+ */
+static int successors (const Walker *w, size_t pc, bool cont, size_t succ[2])
+{
+  const insn_t *insn = &w->insns[pc];
+  int n = 0;
+
+  if (!cont)
+    return 0;
+
+  if (!is_terminal (insn))
+    {
+      size_t next = next_insn (w->insns, w->size, pc);
+
+      // the tail call at the end of the code, see reach_next
+      if (next < w->size)
+        succ[n++] = next;
+    }
+
+  if (INSN_IS_BRANCH (insn->op))
+    succ[n++] = insn_branch_target (w->insns, pc);
+
+  return n;
+}
+
+static bool flow_to (Walker *w, size_t pc, const Flow *out, size_t from)
+{
+  Flow *flow = &w->flow[pc];
+
+  if (FLOW_NONE == flow->frame)
+    {
+      *flow = *out;
+      w->todo[w->cnt++] = pc;
+      return true;
+    }
+
+  if (flow->depth != out->depth || flow->frame != out->frame)
+    {
+      os_printk ("verifier: inconsistent stack at 0x%x from 0x%x\n",
+                 (u32_t)pc, (u32_t)from);
+      return false;
+    }
+
+  return true;
+}
+
+/* NOTE:
+ * Compute the depth of every reachable instruction from the first one of its
+ * procedure. The effect of the instructions is exact, so a loop which grows
+ * or shrinks the stack is rejected at its head.
+ */
+static bool compute_depth (Walker *w)
+{
+  for (size_t pc = 0; pc < w->size; pc++)
+    w->flow[pc].frame = FLOW_NONE;
+
+  for (size_t root = 0; root < w->size; root++)
+    {
+      if (!(w->insns[root].flags & INSN_REACHED)
+          || FLOW_NONE != w->flow[root].frame)
+        continue;
+
+      Flow entry = {.depth = 0, .frame = FRAME_NONE};
+
+      flow_to (w, root, &entry, root);
+
+      while (w->cnt)
+        {
+          size_t pc = w->todo[--w->cnt];
+          size_t succ[2];
+          Flow out;
+          int peak = 0;
+          bool cont = transfer (w->insns, w->flow, pc, &out, &peak);
+          int n = successors (w, pc, cont, succ);
+
+          if (out.depth != (s16_t)out.depth)
+            {
+              os_printk ("verifier: stack overflow at 0x%x\n", (u32_t)pc);
+              return false;
+            }
+
+          for (int i = 0; i < n; i++)
+            if (!flow_to (w, succ[i], &out, pc))
+              return false;
+        }
+    }
+
+  return true;
+}
+
+static bool compute_need (Walker *w)
+{
+  bool changed = true;
+
+  if (!compute_depth (w))
+    return false;
+
+  /* NOTE:
+   * The code is mostly forward, so the reversed order converges in one pass,
+   * the loops take more, and they're balanced by compute_depth.
+   */
+  while (changed)
+    {
+      changed = false;
+
+      for (size_t pc = w->size; pc-- > 0;)
+        {
+          insn_t *insn = &w->insns[pc];
+
+          if (!(insn->flags & INSN_REACHED))
+            continue;
+
+          size_t succ[2];
+          Flow out;
+          int need = 0;
+          bool cont = transfer (w->insns, w->flow, pc, &out, &need);
+          int n = successors (w, pc, cont, succ);
+
+          for (int i = 0; i < n; i++)
+            {
+              int grow = out.depth - w->flow[pc].depth;
+              grow += w->insns[succ[i]].need;
+              need = grow > need ? grow : need;
+            }
+
+          if (need > insn->need)
+            {
+              if (need > 0xFFFF
+                  || (size_t)need > GLOBAL_REF (VM_STKSEG_SIZE))
+                {
+                  os_printk ("verifier: stack overflow at 0x%x\n", (u32_t)pc);
+                  return false;
+                }
+
+              insn->need = need;
+              changed = true;
+            }
+        }
+    }
+
+  return true;
+}
+
+bool verify_program (insn_t *insns, size_t size, reg_t entry,
+                     insn_t *globals, size_t gsize)
+{
+  bool ret = false;
+  Walker p = {.insns = insns, .size = size, .todo = NULL, .flow = NULL};
+  Walker g = {.insns = globals, .size = gsize, .todo = NULL, .flow = NULL};
+
+  if ((size && !insns) || (gsize && !globals))
+    {
+      os_printk ("verifier: the program wasn't decoded!\n");
+      return false;
+    }
+
+  p.todo = (reg_t *)os_malloc ((size + 1) * sizeof (reg_t));
+  g.todo = (reg_t *)os_malloc ((gsize + 1) * sizeof (reg_t));
+  p.flow = (Flow *)os_malloc ((size + 1) * sizeof (Flow));
+  g.flow = (Flow *)os_malloc ((gsize + 1) * sizeof (Flow));
+
+  if (!p.todo || !g.todo || !p.flow || !g.flow)
+    {
+      os_printk ("verifier: no memory!\n");
+      goto end;
+    }
+
+  if (gsize && !(reach (&g, 0, 0, "globals entry") && walk (&g, &p)))
+    goto end;
+
+  if (!(reach (&p, entry, entry, "program entry") && walk (&p, &p)))
+    goto end;
+
+  if (!compute_need (&g) || !compute_need (&p))
+    goto end;
+
+  /* NOTE:
+   * The globals segment runs only once in the bytecode interpreter, so we
+   * check it here.
+   */
+  if (gsize
+      && GLOBAL_REF (VM_STKSEG_SIZE) < globals[0].need + VM_STACK_SLACK)
+    {
+      os_printk ("verifier: no enough stack for globals!\n");
+      goto end;
+    }
+
+  ret = true;
+
+end:
+  if (p.todo)
+    os_free (p.todo);
+
+  if (g.todo)
+    os_free (g.todo);
+
+  if (p.flow)
+    os_free (p.flow);
+
+  if (g.flow)
+    os_free (g.flow);
+
+  return ret;
+}
+#endif
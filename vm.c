@@ -15,6 +15,7 @@
  *  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include "aot.h"
 #include "vm.h"
 
 GLOBAL_DEF (size_t, VM_CODESEG_SIZE) = 0;
@@ -30,14 +31,14 @@ static void handle_optional_args (vm_t vm, object_t proc)
 
   for (int i = 0; i < cnt; i++)
     {
-      object_t new_obj = NEW_OBJ (0);
-      *new_obj = POP_OBJ ();
-      new_obj->attr.gc = GEN_1_OBJ; // don't forget to reset gc to GEN_1_OBJ
+      object_t new_obj = BOX_OBJ (0, TOP_OBJ_PTR (), GEN_1_OBJ);
+      vm->sp -= sizeof (Object);
       list_node_t bl = (list_node_t)GC_MALLOC (sizeof (ListNode));
       bl->obj = new_obj;
       SLIST_INSERT_HEAD (head, bl, next);
     }
 
+  GC_WRITE_BARRIER (varg.value);
   PUSH_OBJ (varg);
 }
 
@@ -57,10 +58,199 @@ static closure_t create_closure (vm_t vm, u8_t arity, u8_t frame_size,
   return closure;
 }
 
-void call_prim (vm_t vm, pn_t pn)
+static inline Object prim_arith2 (vm_t vm, prim_t prim, object_t o1,
+                                  object_t o2)
+{
+  func_2_args_with_ret_t fn = (func_2_args_with_ret_t)prim->fn;
+  Object ret = {.attr = {.type = none, .gc = FREE_OBJ}, .value = NULL};
+  return *(fn (vm, &ret, o1, o2));
+}
+
+static inline bool prim_logic2 (prim_t prim, object_t comparand,
+                                object_t comparee)
+{
+  logic_check_t fn = (logic_check_t)prim->fn;
+  return fn (comparand, comparee);
+}
+
+/* NOTE:
+ * map and for-each don't run their procedure in a nested interpreter loop.
+ * The state of the iteration is kept in a Trampoline on the stack, and each
+ * call is made in a frame which returns to RESUME_PC, where the interpreter
+ * calls tramp_resume to collect the result and make the next call. So the
+ * procedure runs in the main loop, with the JIT and the GC as usual.
+ * The fields are Objects to be scanned by the GC like the other locals, and
+ * the cursors are kept in none objects, which the GC skips.
+ */
+typedef enum tramp_kind
+{
+  TRAMP_MAP = 0,
+  TRAMP_FOREACH = 1
+} tramp_kind_t;
+
+typedef struct Trampoline
+{
+  Object kind; // imm_int, tramp_kind_t
+  Object pc;   // imm_int, the return address of the primitive
+  Object proc; // the procedure to apply
+  Object lst;  // the list, kept for the GC
+  Object rest; // none, the next node of lst
+  Object acc;  // the result list of map
+  Object tail; // none, the last node of acc
+} __packed *tramp_t;
+
+static inline Object tramp_value (otype_t type, uintptr_t value)
+{
+  Object obj = {.attr = {.type = type, .gc = FREE_OBJ}, .value = (void *)value};
+  return obj;
+}
+
+// Take the result on the top, and drop everything above the trampoline
+static void tramp_collect (vm_t vm, tramp_t t)
+{
+  if (TRAMP_MAP == (uintptr_t)t->kind.value)
+    {
+      list_node_t node = NEW_LIST_NODE ();
+      list_node_t tail = (list_node_t)t->tail.value;
+      // avoid crash in case GC was triggered here
+      node->obj = (void *)0xDEADBEEF;
+
+      if (!tail)
+        {
+          // when the new list is still empty
+          SLIST_INSERT_HEAD (LIST_OBJECT_HEAD (&t->acc), node, next);
+        }
+      else
+        {
+          SLIST_INSERT_AFTER (tail, node, next);
+        }
+
+      t->tail.value = (void *)node;
+      // NOTE: the result is still on the stack in case GC was triggered here
+      object_t new_obj = BOX_OBJ (0, TOP_OBJ_PTR (), GEN_1_OBJ);
+      node->obj = new_obj;
+      // the result list may have been aged by GC in the iterations
+      GC_WRITE_BARRIER (t->acc.value);
+    }
+
+  vm->sp = (u8_t *)(t + 1) - vm->stack;
+}
+
+static void tramp_leave (vm_t vm, tramp_t t)
+{
+  Object ret = GLOBAL_REF (none_const); // for-each returns NONE object
+  reg_t pc = (reg_t) (uintptr_t)t->pc.value;
+
+  if (TRAMP_MAP == (uintptr_t)t->kind.value)
+    {
+      ret = t->acc;
+      ((list_t)ret.value)->attr.gc
+        = (VM_INIT_GLOBALS == vm->state) ? PERMANENT_OBJ : GEN_1_OBJ;
+    }
+
+  vm->sp = (u8_t *)t - vm->stack;
+  vm->pc = pc;
+  PUSH_OBJ (ret);
+}
+
+// Make the calls until one of them has to run in the interpreter
+static void tramp_run (vm_t vm, tramp_t t)
+{
+  /* We always set k as return */
+  Object k = GEN_PRIM (ret);
+  list_node_t node = NULL;
+  // NOTE: the pushes may move the stack, so t is found again by its offset
+  reg_t at = (u8_t *)t - vm->stack;
+
+  while ((node = (list_node_t)t->rest.value))
+    {
+      t->rest.value = (void *)SLIST_NEXT (node, next);
+
+      switch (t->proc.attr.type)
+        {
+        case procedure:
+          {
+            reg_t entry = t->proc.proc.entry;
+            vm->pc = RESUME_PC;
+            SAVE_ENV_SIMPLE ();
+            PUSH_OBJ (k);
+            PUSH_OBJ (*node->obj);
+            PROC_ENTER (entry);
+            return;
+          }
+        case primitive:
+          {
+            PUSH_OBJ (k);
+            PUSH_OBJ (*node->obj);
+            call_prim (vm, (pn_t)t->proc.value);
+            t = (tramp_t) (vm->stack + at);
+            tramp_collect (vm, t);
+            break;
+          }
+        default:
+          {
+            os_printk ("map: not an applicable object, type: %d\n",
+                       t->proc.attr.type);
+            PANIC ("map panic!\n");
+          }
+        }
+    }
+
+  tramp_leave (vm, t);
+}
+
+static void tramp_enter (vm_t vm, tramp_kind_t kind, object_t proc,
+                         object_t lst)
+{
+  size_t need = vm->sp + sizeof (struct Trampoline);
+
+  if (VM_STACK_SIZE () < need)
+#ifdef USE_STACK_GROW
+    vm_stack_grow (vm, need);
+#else
+    PANIC ("Stack overflow!\n");
+#endif
+
+  tramp_t t = (tramp_t) (vm->stack + vm->sp);
+  vm->sp += sizeof (struct Trampoline);
+  t->kind = tramp_value (imm_int, kind);
+  t->pc = tramp_value (imm_int, vm->pc);
+  t->proc = *proc;
+  t->lst = *lst;
+  t->rest = tramp_value (none, (uintptr_t)SLIST_FIRST (LIST_OBJECT_HEAD (lst)));
+  t->acc = tramp_value (none, 0);
+  t->tail = tramp_value (none, 0);
+
+  if (TRAMP_MAP == kind)
+    {
+      /* NOTE:
+       * To safely created a List, we have to consider that GC may happend
+       * unexpectedly.
+       */
+      list_t new_list = NEW_INNER_OBJ (list);
+      SLIST_INIT (&new_list->list);
+      new_list->attr.gc = GEN_1_OBJ;
+      new_list->non_shared = 0;
+      t->acc.attr.type = list;
+      t->acc.attr.gc = PERMANENT_OBJ;
+      t->acc.value = (void *)new_list;
+    }
+
+  tramp_run (vm, t);
+}
+
+// The procedure returned to RESUME_PC with its result on the top
+static void tramp_resume (vm_t vm)
 {
-  prim_t prim = get_prim (pn);
+  tramp_t t = (tramp_t) (vm->stack + vm->sp - sizeof (Object)
+                         - sizeof (struct Trampoline));
+
+  tramp_collect (vm, t);
+  tramp_run (vm, t);
+}
 
+static void invoke_prim (vm_t vm, pn_t pn, prim_t prim)
+{
   switch (pn)
     {
     case ret:
@@ -77,13 +267,9 @@ void call_prim (vm_t vm, pn_t pn)
     case int_mul:
     case fract_div:
       {
-        func_2_args_with_ret_t fn = (func_2_args_with_ret_t)prim->fn;
-        size_t size = sizeof (struct Object);
         Object o2 = POP_OBJ ();
         Object o1 = POP_OBJ ();
-        Object ret = {.attr = {.type = none, .gc = FREE_OBJ}, .value = NULL};
-        ret = *(fn (vm, &ret, &o1, &o2));
-        PUSH_OBJ (ret);
+        PUSH_OBJ (prim_arith2 (vm, prim, &o1, &o2));
         break;
       }
     case int_modulo:
@@ -117,10 +303,9 @@ void call_prim (vm_t vm, pn_t pn)
     case eqv:
     case equal:
       {
-        logic_check_t fn = (logic_check_t)prim->fn;
         Object comparee = POP_OBJ ();
         Object comparand = POP_OBJ ();
-        if (fn (&comparand, &comparee))
+        if (prim_logic2 (prim, &comparand, &comparee))
           PUSH_OBJ (GLOBAL_REF (true_const));
         else
           PUSH_OBJ (GLOBAL_REF (false_const));
@@ -146,119 +331,18 @@ void call_prim (vm_t vm, pn_t pn)
       }
     case map:
       {
-        // FIXME: Fix the stack order for GC
-
+        // TODO: support map in multiple lists
         Object lst = POP_OBJ ();
         Object proc = POP_OBJ ();
-        ListHead *head = LIST_OBJECT_HEAD (&lst);
-        list_node_t node = NULL;
-        list_node_t prev = NULL;
-        /* We always set k as return */
-        Object k = GEN_PRIM (ret);
-        list_t new_list = NEW_INNER_OBJ (list);
-        /* NOTE:
-         * To safely created a List, we have to consider that GC may happend
-         * unexpectedly.
-         */
-        Object new_list_obj = {.attr = {.type = list, .gc = PERMANENT_OBJ},
-                               .value = (void *)new_list};
-        ListHead *new_head = LIST_OBJECT_HEAD (&new_list_obj);
-        new_list->non_shared = 0;
-
-        SAVE_ENV_SIMPLE ();
-
-        SLIST_FOREACH (node, head, next)
-        {
-          list_node_t new_node = NEW_LIST_NODE ();
-          new_node->obj = (void *)0xDEADBEEF;
-          if (!prev)
-            {
-              // when the new list is still empty
-              SLIST_INSERT_HEAD (new_head, new_node, next);
-            }
-          else
-            {
-              SLIST_INSERT_AFTER (prev, new_node, next);
-            }
-
-          object_t new_obj = NEW_OBJ (0);
-          new_obj->attr.gc = GEN_1_OBJ;
-          new_node->obj = new_obj;
-          vm->sp = vm->local;
-
-          PUSH_OBJ (k);
-          PUSH_OBJ (*node->obj);
-
-          switch (proc.attr.type)
-            {
-            case procedure:
-              {
-                apply_proc (vm, &proc, new_obj);
-                break;
-              }
-            case primitive:
-              {
-                call_prim (vm, (pn_t)proc.value);
-                *new_obj = POP_OBJ ();
-                break;
-              }
-            }
-
-          prev = new_node;
-          /* NOTE:
-           * We're not going to create frame for each proc call in order
-           * to make it faster. So we have to drop the dirty frame by resetting
-           * sp to local each round.
-           * So does for-each
-           */
-          vm->sp = vm->local;
-        }
-
-        new_list->attr.gc
-          = (VM_INIT_GLOBALS == vm->state) ? PERMANENT_OBJ : GEN_1_OBJ;
-        PUSH_OBJ (new_list_obj);
-        RESTORE_SIMPLE ();
+        tramp_enter (vm, TRAMP_MAP, &proc, &lst);
         break;
       }
     case foreach:
       {
-        /* We always set k as return */
-        Object k = GEN_PRIM (ret);
+        // TODO: support for-each in multiple lists
         Object lst = POP_OBJ ();
         Object proc = POP_OBJ ();
-        ListHead *head = LIST_OBJECT_HEAD (&lst);
-        list_node_t node = NULL;
-
-        PUSH_REG (vm->pc);
-        PUSH_REG (vm->fp);
-        PUSH (vm->attr.all);
-        PUSH_CLOSURE (vm->closure);
-        vm->fp = vm->sp - FPS;
-        vm->local = vm->fp + FPS;
-        SLIST_FOREACH (node, head, next)
-        {
-          // TODO: support for-each in multiple lists
-          vm->sp = vm->local;
-          PUSH_OBJ (k);
-          PUSH_OBJ (*(node->obj));
-          switch (proc.attr.type)
-            {
-            case procedure:
-              {
-                apply_proc (vm, &proc, ret);
-                break;
-              }
-            case primitive:
-              {
-                call_prim (vm, (pn_t)proc.value);
-                break;
-              }
-            }
-          vm->sp = vm->local;
-        }
-
-        RESTORE ();
-        PUSH_OBJ (GLOBAL_REF (none_const)); // return NONE object
+        tramp_enter (vm, TRAMP_FOREACH, &proc, &lst);
         break;
       }
     case apply:
@@ -266,13 +350,17 @@ void call_prim (vm_t vm, pn_t pn)
         VM_DEBUG ("(call apply)\n");
         Object args = POP_OBJ ();
         Object proc = POP_OBJ ();
-        Object ret = CREATE_RET_OBJ ();
         ListHead *head = LIST_OBJECT_HEAD (&args);
         list_node_t node = NULL;
+        reg_t local = vm->sp;
 
         SLIST_FOREACH (node, head, next)
         {
           PUSH_OBJ (*node->obj);
+#ifdef USE_VERIFIER
+          // NOTE: The verifier can't know the length of the list
+          vm_stack_check (vm);
+#endif
         }
 
         FIX_PC ();
@@ -281,10 +369,17 @@ void call_prim (vm_t vm, pn_t pn)
           {
           case procedure:
             {
+              /* NOTE:
+               * Like the closure, the procedure is entered in the frame of
+               * the caller of apply, and its `restore' returns from it.
+               */
               VM_DEBUG ("apply proc\n");
-              // vm->local = vm->fp + FPS;
-              apply_proc (vm, &proc, &ret);
-              PUSH_OBJ (ret);
+              vm->closure = NULL;
+              vm->local = local;
+              ENTRY_STACK_CHECK (proc.proc.entry);
+              JIT_HOT (proc.proc.entry);
+              BUDGET_TICK ();
+              JUMP (proc.proc.entry);
               break;
             }
           case primitive:
@@ -356,6 +451,22 @@ void call_prim (vm_t vm, pn_t pn)
         PUSH_OBJ (ret);
         break;
       }
+    case list_set: // 3 parameters
+      {
+        /* NOTE:
+         * The value is stored in the list, so it's boxed while the args are
+         * still on the stack, since NEW_OBJ may trigger GC, see BOX_OBJ.
+         */
+        func_3_args_with_ret_t fn = (func_3_args_with_ret_t)prim->fn;
+        object_t o3 = BOX_OBJ (0, TOP_OBJ_PTR (), GEN_1_OBJ);
+        vm->sp -= sizeof (Object);
+        Object o2 = POP_OBJ ();
+        Object o1 = POP_OBJ ();
+        Object ret = CREATE_RET_OBJ ();
+        ret = *(fn (vm, &ret, &o1, &o2, o3));
+        PUSH_OBJ (ret);
+        break;
+      }
     case list_append: // 2 parameters
     case list_ref:
     case cons:
@@ -523,6 +634,11 @@ void call_prim (vm_t vm, pn_t pn)
     }
 }
 
+void call_prim (vm_t vm, pn_t pn)
+{
+  invoke_prim (vm, pn, get_prim (pn));
+}
+
 static uintptr_t vm_get_uintptr (vm_t vm)
 {
   u8_t buf[sizeof (uintptr_t)] = {0};
@@ -611,21 +727,22 @@ static object_t generate_object (vm_t vm, object_t obj)
         VM_DEBUG ("(push-pair-object)\n");
         pair_t p = NEW_INNER_OBJ (pair);
         p->attr.gc = (VM_INIT_GLOBALS == vm->state) ? PERMANENT_OBJ : GEN_1_OBJ;
+        // avoid crash in case GC was triggered here
+        p->car = p->cdr = (void *)0xDEADBEEF;
         obj->attr.type = pair;
         obj->value = (void *)p;
         PUSH_OBJ (*obj);
         u32_t sp = vm->sp - sizeof (Object);
 
-        object_t cdr = NEW_OBJ (TOP_OBJ_PTR_FROM (sp)->attr.type);
-        *cdr = POP_OBJ_FROM (sp);
-        cdr->attr.gc = GEN_1_OBJ; // don't forget to reset gc to 1
-        p->cdr = cdr;
+        object_t top = TOP_OBJ_PTR_FROM (sp);
+        p->cdr = BOX_OBJ (top->attr.type, top, GEN_1_OBJ);
+        sp -= sizeof (Object);
 
-        object_t car = NEW_OBJ (TOP_OBJ_PTR_FROM (sp)->attr.type);
-        *car = POP_OBJ_FROM (sp);
-        car->attr.gc = GEN_1_OBJ; // don't forget to reset gc to 1
-        p->car = car;
+        top = TOP_OBJ_PTR_FROM (sp);
+        p->car = BOX_OBJ (top->attr.type, top, GEN_1_OBJ);
+        sp -= sizeof (Object);
 
+        GC_WRITE_BARRIER (p);
         vm->sp = sp; // refix the pop offset
         break;
       }
@@ -658,13 +775,18 @@ static object_t generate_object (vm_t vm, object_t obj)
             // avoid crash in case GC was triggered here
             bl->obj = (void *)0xDEADBEEF;
             SLIST_INSERT_HEAD (&l->list, bl, next);
-            object_t new_obj = NEW_OBJ (TOP_OBJ_PTR_FROM (sp)->attr.type);
-            *new_obj = POP_OBJ_FROM (sp);
+            object_t top = TOP_OBJ_PTR_FROM (sp);
             // FIXME: What if it's global const?
-            new_obj->attr.gc
-              = (VM_INIT_GLOBALS == vm->state) ? PERMANENT_OBJ : GEN_1_OBJ;
-            bl->obj = new_obj;
+            bl->obj = BOX_OBJ (top->attr.type, top,
+                               (VM_INIT_GLOBALS == vm->state) ? PERMANENT_OBJ
+                                                              : GEN_1_OBJ);
+            sp -= sizeof (Object);
           }
+        /* NOTE:
+         * The elements are kept on the stack till here, but the list may
+         * have been aged by GC in the loop.
+         */
+        GC_WRITE_BARRIER (l);
         vm->sp = sp; // refix the pop offset
         break;
       }
@@ -684,11 +806,11 @@ static object_t generate_object (vm_t vm, object_t obj)
 
         for (u16_t i = 0; i < size; i++)
           {
-            object_t new_obj = NEW_OBJ (TOP_OBJ_PTR_FROM (sp)->attr.type);
-            *new_obj = POP_OBJ_FROM (sp);
-            new_obj->attr.gc = GEN_1_OBJ; // don't forget to reset gc to 1
-            v->vec[i] = new_obj;
+            object_t top = TOP_OBJ_PTR_FROM (sp);
+            v->vec[i] = BOX_OBJ (top->attr.type, top, GEN_1_OBJ);
+            sp -= sizeof (Object);
           }
+        GC_WRITE_BARRIER (v);
         vm->sp = sp; // refix the pop offset
         break;
       }
@@ -778,215 +900,384 @@ static object_t generate_object (vm_t vm, object_t obj)
   return obj;
 }
 
-static void interp_single_encode (vm_t vm, bytecode8_t bc)
+/* NOTE:
+ * The instruction bodies are shared by all the interpreter loops, the decoders
+ * only have to extract the operands and call them.
+ */
+static inline void op_local_ref (vm_t vm, u8_t offset)
+{
+  VM_DEBUG ("(local %d)\n", offset);
+  object_t obj = (object_t)LOCAL (offset);
+  PUSH_OBJ (*obj);
+}
+
+static inline void op_local_assign (vm_t vm, u8_t offset)
+{
+  VM_DEBUG ("(assign-local %x)\n", offset);
+  object_t obj = (object_t)LOCAL (offset);
+  *obj = POP_OBJ ();
+}
+
+static inline void op_free_ref (vm_t vm, u8_t up, u8_t offset)
+{
+  VM_DEBUG ("(free %x %d)\n", up, offset);
+  object_t obj = (object_t)FREE_VAR (up, offset);
+  PUSH_OBJ (*obj);
+}
+
+static inline void op_free_assign (vm_t vm, u8_t up, u8_t offset)
+{
+  VM_DEBUG ("(assign-free %x %d)\n", up, offset);
+  object_t obj = (object_t)FREE_VAR (up, offset);
+  // the frame may be not shaded yet, see GC_RETURN_BARRIER
+  GC_SATB_BARRIER (obj);
+  *obj = POP_OBJ ();
+}
+
+static inline void op_call (vm_t vm, object_t obj)
+{
+  if (NEED_VARGS (obj))
+    handle_optional_args (vm, obj);
+  CALL (obj);
+}
+
+static inline void op_call_local (vm_t vm, u8_t offset)
+{
+  VM_DEBUG ("(call-local %d)\n", offset);
+  op_call (vm, (object_t)LOCAL (offset));
+}
+
+static inline void op_call_free (vm_t vm, u8_t up, u8_t offset)
+{
+  /* TODO:
+   *   1. For proc, what's stored in free?
+   *   2. What's call convention?
+   *   3. Do we need to create proc-object when store?
+   */
+  VM_DEBUG ("(call-free %x %d)\n", up, offset);
+  op_call (vm, (object_t)FREE_VAR (up, offset));
+}
+
+static inline void op_global_ref (vm_t vm, u16_t index)
+{
+  VM_DEBUG ("(global %d)\n", index);
+  object_t obj = &GLOBAL (index);
+  PUSH_OBJ (*obj);
+}
+
+#ifdef USE_INLINE_CACHE
+/* NOTE:
+ * Each global has a version, bumped when it's assigned, so that only the call
+ * sites of that global are invalidated. When a version wraps around, all the
+ * caches are flushed, so that an old cache never hits again.
+ */
+static void flush_call_caches (vm_t vm)
 {
-  switch (bc.type)
+  if (!vm->insns)
+    return;
+
+  for (size_t pc = 0; pc < GLOBAL_REF (VM_CODESEG_SIZE); pc++)
     {
-    case LOCAL_REF:
-      {
-        VM_DEBUG ("(local %d)\n", bc.data);
-        object_t obj = (object_t)LOCAL (bc.data);
-        /* os_printk ("\nobj: "); */
-        /* object_printer (obj); */
-        /* os_printk ("\n"); */
-        /* if (vm->closure) */
-        /*   { */
-        /*     for (int i = 0; i < vm->closure->frame_size; i++) */
-        /*       { */
-        /*         os_printk ("env[%d] type: %d, value: %d\n", i, */
-        /*                 vm->closure->env[i].attr.type, */
-        /*                 (imm_int_t) (vm->closure->env[i].value)); */
-        /*       } */
-        /*   } */
-        PUSH_OBJ (*obj);
-        break;
-      }
-    case LOCAL_REF_EXTEND:
-      {
-        VM_DEBUG ("(local %d)\n", bc.data);
-        object_t obj = (object_t)LOCAL (bc.data + 16);
-        PUSH_OBJ (*obj);
-        break;
-      }
-    case FREE_REF:
-      {
-        u8_t frame = NEXT_DATA ();
-        u8_t up = (frame & 0b00111111);
-        u8_t offset = ((bc.data << 2) | ((frame & 0b11000000) >> 6));
-        VM_DEBUG ("(free %x %d)\n", up, offset);
-        object_t obj = (object_t)FREE_VAR (up, offset);
-        /* os_printk ("obj: type = %d, value = %d\n", obj->attr.type, */
-        /*         (imm_int_t)obj->value); */
-        PUSH_OBJ (*obj);
-        break;
-      }
-    case CALL_FREE:
-      {
-        /* TODO:
-         *   1. For proc, what's stored in free?
-         *   2. What's call convention?
-         *   3. Do we need to create proc-object when store?
-         */
-        u8_t frame = NEXT_DATA ();
-        u8_t up = (frame & 0b00111111);
-        u8_t offset = ((bc.data << 2) | ((frame & 0b11000000) >> 6));
-        VM_DEBUG ("(call-free %x %d)\n", up, offset);
-        object_t obj = (object_t)FREE_VAR (up, offset);
-        if (NEED_VARGS (obj))
-          handle_optional_args (vm, obj);
-        CALL (obj);
-        break;
-      }
-    case CALL_LOCAL:
-      {
-        VM_DEBUG ("(call-local %d)\n", bc.data);
-        object_t obj = (object_t)LOCAL (bc.data);
-        if (NEED_VARGS (obj))
-          handle_optional_args (vm, obj);
-        CALL (obj);
-        break;
-      }
-    case CALL_LOCAL_EXTEND:
+      if (INSN_IS_CALL (vm->insns[pc].op))
+        vm->insns[pc].cache.kind = IC_EMPTY;
+    }
+}
+
+static inline void invalidate_call_caches (vm_t vm, u16_t index)
+{
+  // NOTE: no versions yet while the globals are initialized
+  if (vm->gversion && 0 == ++vm->gversion[index])
+    flush_call_caches (vm);
+}
+#endif
+
+static inline void op_global_assign (vm_t vm, u16_t index)
+{
+  Object var = POP_OBJ ();
+#ifdef ANIMULA_DEBUG
+  if (GLOBAL_REF (vm_verbose))
+    {
+      os_printk ("(global-assign %d ", index);
+      object_printer (&var);
+      os_printk (")\n");
+    }
+#endif
+  GLOBAL_ASSIGN (index, var);
+#ifdef USE_INLINE_CACHE
+  invalidate_call_caches (vm, index);
+#endif
+  PUSH_OBJ (GLOBAL_REF (none_const)); // return NONE object
+}
+
+static inline void op_call_global (vm_t vm, u16_t index)
+{
+  VM_DEBUG ("(call-global %d)\n", index);
+  op_call (vm, &GLOBAL (index));
+}
+
+#ifdef USE_INLINE_CACHE
+static inline void fill_call_cache (call_cache_t *ic, object_t obj,
+                                    u16_t epoch)
+{
+  ic->type = obj->attr.type;
+  ic->value = obj->value;
+  ic->epoch = epoch;
+
+  switch (obj->attr.type)
+    {
+    case procedure:
       {
-        VM_DEBUG ("(call-local %d)\n", bc.data + 16);
-        object_t obj = (object_t)LOCAL (bc.data + 16);
-        if (NEED_VARGS (obj))
-          handle_optional_args (vm, obj);
-        CALL (obj);
+        ic->kind = NEED_VARGS (obj) ? IC_PROC_VARGS : IC_PROC;
+        ic->entry = obj->proc.entry;
         break;
       }
-    case FREE_ASSIGN:
+    case primitive:
       {
-        u8_t frame = NEXT_DATA ();
-        u8_t up = (frame & 0b00111111);
-        u8_t offset = ((bc.data << 2) | ((frame & 0b11000000) >> 6));
-        VM_DEBUG ("(assign-free %x %d)\n", up, offset);
-        object_t obj = (object_t)FREE_VAR (up, offset);
-        *obj = POP_OBJ ();
+        ic->kind = IC_PRIM;
         break;
       }
-    case LOCAL_ASSIGN:
+    case closure_on_heap:
       {
-        u8_t offset_0 = NEXT_DATA ();
-        u8_t offset = ((bc.data << 8) | offset_0);
-        VM_DEBUG ("(assign-local %x)\n", offset);
-        object_t obj = (object_t)LOCAL (offset);
-        *obj = POP_OBJ ();
+        ic->kind = IC_CLOSURE;
         break;
       }
     default:
-      {
-        os_printk ("Invalid bytecode %X\n", bc.all);
-        PANIC ("interp_single_encode panic!\n");
-      }
+      ic->kind = IC_EMPTY;
     }
 }
 
-static void interp_double_encode (vm_t vm, bytecode16_t bc)
+/* NOTE:
+ * Call obj by the checked cache of the call site, so we skip the type switch
+ * of CALL and the NEED_VARGS check. The empty cache goes the slow way.
+ */
+static inline void op_call_cached (vm_t vm, object_t obj, call_cache_t *ic)
 {
-  switch (bc.type)
+  switch (ic->kind)
     {
-    case PRELUDE:
-      {
-        VM_DEBUG ("(prelude %d %d)\n", PROC_MODE (bc.bc2), PROC_ARITY (bc.bc2));
-        SAVE_ENV ();
-        break;
-      }
-    case LOCAL_REF_HIGH:
-      {
-        u8_t offset = bc.bc2 + 32;
-        VM_DEBUG ("(local %d)\n", offset);
-        object_t obj = (object_t)LOCAL (offset);
-        PUSH_OBJ (*obj);
-        break;
-      }
-    case CALL_LOCAL_HIGH:
-      {
-        u8_t offset = bc.bc2 + 32;
-        VM_DEBUG ("(call-local %d)\n", offset);
-        object_t obj = (object_t)LOCAL (offset);
-        if (NEED_VARGS (obj))
-          handle_optional_args (vm, obj);
-        CALL (obj);
-        break;
-      }
-    case GLOBAL_VAR_ASSIGN:
+    case IC_PROC_VARGS:
+      handle_optional_args (vm, obj);
+      /* fall through */
+    case IC_PROC:
       {
-        u8_t index = bc.bc2;
-        Object var = POP_OBJ ();
-#ifdef ANIMULA_DEBUG
-        if (GLOBAL_REF (vm_verbose))
-          {
-            os_printk ("(global-assign %d ", index);
-            object_printer (&var);
-            os_printk (")\n");
-          }
-#endif
-        GLOBAL_ASSIGN (index, var);
-        PUSH_OBJ (GLOBAL_REF (none_const)); // return NONE object
+        FIX_PC ();
+        PROC_CALL (ic->entry);
         break;
       }
-    case GLOBAL_VAR_REF:
+    case IC_PRIM:
       {
-        u8_t index = bc.bc2;
-        VM_DEBUG ("(global %d)\n", index);
-        object_t obj = &GLOBAL (index);
-        PUSH_OBJ (*obj);
+        FIX_PC ();
+        call_prim (vm, (uintptr_t)ic->value);
         break;
       }
-    case CALL_GLOBAL_VAR:
+    case IC_CLOSURE:
       {
-        u8_t index = bc.bc2;
-        VM_DEBUG ("(call-global %d)\n", index);
-        object_t obj = &GLOBAL (index);
-        if (NEED_VARGS (obj))
-          handle_optional_args (vm, obj);
-        CALL (obj);
+        FIX_PC ();
+        call_closure_on_heap (vm, obj);
         break;
       }
     default:
-      {
-        os_printk ("Invalid bytecode %X %X\n", bc.type, bc.data);
-        PANIC ("interp_double_encode panic!\n");
-      }
-    };
+      op_call (vm, obj);
+    }
 }
 
-static void interp_triple_encode (vm_t vm, bytecode24_t bc)
+static inline void op_call_object_cached (vm_t vm, object_t obj,
+                                          call_cache_t *ic)
 {
-  switch (bc.type)
-    {
-    case CALL_PROC:
+  if (IC_EMPTY == ic->kind || ic->type != obj->attr.type
+      || ic->value != obj->value)
+    fill_call_cache (ic, obj, 0);
+
+  op_call_cached (vm, obj, ic);
+}
+
+static inline void op_call_global_cached (vm_t vm, u16_t index,
+                                          call_cache_t *ic)
+{
+  VM_DEBUG ("(call-global %d)\n", index);
+  object_t obj = &GLOBAL (index);
+
+  u16_t version = vm->gversion[index];
+
+  if (IC_EMPTY == ic->kind || ic->epoch != version)
+    fill_call_cache (ic, obj, version);
+
+  op_call_cached (vm, obj, ic);
+}
+#endif
+
+static inline void op_call_proc (vm_t vm, reg_t offset)
+{
+  VM_DEBUG ("(call-proc 0x%x)\n", offset);
+  FIX_PC ();
+  PROC_CALL (offset);
+}
+
+static inline void op_fjump (vm_t vm, reg_t offset)
+{
+  VM_DEBUG ("(fjump 0x%x)\n", offset);
+  Object obj = POP_OBJ ();
+  if (is_false (&obj))
+    {
+      VM_DEBUG ("False! Jump!\n");
+      BRANCH (offset);
+    }
+}
+
+static inline void op_jump (vm_t vm, reg_t offset)
+{
+  VM_DEBUG ("(jump 0x%x)\n", offset);
+  BRANCH (offset);
+}
+
+static inline void op_closure_on_heap (vm_t vm, u8_t arity, u8_t size,
+                                       reg_t entry)
+{
+  VM_DEBUG ("(closure-on-heap %d %d 0x%x)\n", arity, size, entry);
+  closure_t closure = create_closure (vm, arity, size, entry);
+  Object obj = {.attr = {.type = closure_on_heap, .gc = FREE_OBJ},
+                .value = (closure_t)closure};
+  gc_inner_obj_book (closure_on_heap, closure);
+  PUSH_OBJ (obj);
+}
+
+static inline void op_halt (vm_t vm)
+{
+  if (VM_INIT_GLOBALS != vm->state)
+    {
+      VM_DEBUG ("GC clean!\n");
+      gc_clean_cache ();
+      VM_DEBUG ("Halt here!\n");
+    }
+  vm->state = VM_STOP;
+}
+
+static inline void op_prelude (vm_t vm, u8_t desc)
+{
+  VM_DEBUG ("(prelude %d %d)\n", PROC_MODE (desc), PROC_ARITY (desc));
+  SAVE_ENV (desc);
+}
+
+static void interp_single_encode (vm_t vm, const decode_t *d)
+{
+  switch (d->type)
+    {
+    case LOCAL_REF:
       {
-        u32_t offset = bc.data;
-        VM_DEBUG ("(call-proc 0x%x)\n", offset);
-        /* os_printk ("call-proc before fp: %d\n", ((u32_t
-         * *)vm->stack)[vm->fp]);
-         */
-        FIX_PC ();
-        PROC_CALL (offset);
-        /* os_printk ("call-proc after fp: %d\n", ((u32_t *)vm->stack)[vm->fp]);
-         */
+        op_local_ref (vm, d->data);
         break;
       }
-    case F_JMP:
+    case LOCAL_REF_EXTEND:
       {
-        u32_t offset = bc.data;
-        VM_DEBUG ("(fjump 0x%x)\n", offset);
-        Object obj = POP_OBJ ();
-        if (is_false (&obj))
-          {
-            VM_DEBUG ("False! Jump!\n");
-            JUMP (offset);
-          }
+        op_local_ref (vm, d->data + 16);
+        break;
+      }
+    case FREE_REF:
+      {
+        u8_t frame = NEXT_DATA ();
+        u8_t up = (frame & 0b00111111);
+        u8_t offset = ((d->data << 2) | ((frame & 0b11000000) >> 6));
+        op_free_ref (vm, up, offset);
+        break;
+      }
+    case CALL_FREE:
+      {
+        u8_t frame = NEXT_DATA ();
+        u8_t up = (frame & 0b00111111);
+        u8_t offset = ((d->data << 2) | ((frame & 0b11000000) >> 6));
+        op_call_free (vm, up, offset);
+        break;
+      }
+    case CALL_LOCAL:
+      {
+        op_call_local (vm, d->data);
+        break;
+      }
+    case CALL_LOCAL_EXTEND:
+      {
+        op_call_local (vm, d->data + 16);
+        break;
+      }
+    case FREE_ASSIGN:
+      {
+        u8_t frame = NEXT_DATA ();
+        u8_t up = (frame & 0b00111111);
+        u8_t offset = ((d->data << 2) | ((frame & 0b11000000) >> 6));
+        op_free_assign (vm, up, offset);
+        break;
+      }
+    case LOCAL_ASSIGN:
+      {
+        u8_t offset_0 = NEXT_DATA ();
+        op_local_assign (vm, ((d->data << 8) | offset_0));
+        break;
+      }
+    default:
+      {
+        os_printk ("Invalid bytecode %X %X\n", d->type, d->data);
+        PANIC ("interp_single_encode panic!\n");
+      }
+    }
+}
+
+static void interp_double_encode (vm_t vm, u8_t type, u8_t data)
+{
+  switch (type)
+    {
+    case PRELUDE:
+      {
+        op_prelude (vm, data);
+        break;
+      }
+    case LOCAL_REF_HIGH:
+      {
+        op_local_ref (vm, data + 32);
+        break;
+      }
+    case CALL_LOCAL_HIGH:
+      {
+        op_call_local (vm, data + 32);
+        break;
+      }
+    case GLOBAL_VAR_ASSIGN:
+      {
+        op_global_assign (vm, data);
+        break;
+      }
+    case GLOBAL_VAR_REF:
+      {
+        op_global_ref (vm, data);
+        break;
+      }
+    case CALL_GLOBAL_VAR:
+      {
+        op_call_global (vm, data);
+        break;
+      }
+    default:
+      {
+        os_printk ("Invalid bytecode %X %X\n", type, data);
+        PANIC ("interp_double_encode panic!\n");
+      }
+    };
+}
 
+static void interp_triple_encode (vm_t vm, u8_t type, u16_t data)
+{
+  switch (type)
+    {
+    case CALL_PROC:
+      {
+        op_call_proc (vm, data);
+        break;
+      }
+    case F_JMP:
+      {
+        op_fjump (vm, data);
         break;
       }
     case JMP:
       {
-        u32_t offset = bc.data;
-        VM_DEBUG ("(jump 0x%x)\n", offset);
-        JUMP (offset);
+        op_jump (vm, data);
         break;
       }
     case VEC_REF:
@@ -998,74 +1289,53 @@ static void interp_triple_encode (vm_t vm, bytecode24_t bc)
       }
     case GLOBAL_VAR_ASSIGN_EXTEND:
       {
-        u32_t index = NEXT_DATA () + 256;
-        Object var = POP_OBJ ();
-#ifdef ANIMULA_DEBUG
-        os_printk ("(global-assign %d ", index);
-        object_printer (&var);
-        os_printk (")\n");
-#endif
-        GLOBAL_ASSIGN (index, var);
-        PUSH_OBJ (GLOBAL_REF (none_const)); // return NONE object
+        op_global_assign (vm, NEXT_DATA () + 256);
         break;
       }
     case GLOBAL_VAR_REF_EXTEND:
       {
-        u32_t index = NEXT_DATA () + 256;
-        VM_DEBUG ("(global-assign %d)\n", index);
-        object_t obj = &GLOBAL (index);
-        PUSH_OBJ (*obj);
+        op_global_ref (vm, NEXT_DATA () + 256);
         break;
       }
     case CALL_GLOBAL_VAR_EXTEND:
       {
-        u32_t index = NEXT_DATA () + 256;
-        VM_DEBUG ("(call-global %d)\n", index);
-        object_t obj = &GLOBAL (index);
-        if (NEED_VARGS (obj))
-          handle_optional_args (vm, obj);
-        CALL (obj);
+        op_call_global (vm, NEXT_DATA () + 256);
         break;
       }
     default:
       {
-        os_printk ("Invalid bytecode %X, %X, %X\n", bc.bc1, bc.bc2, bc.bc3);
+        os_printk ("Invalid bytecode %X, %X\n", type, data);
         PANIC ("interp_triple_encode panic!\n");
       }
     }
 }
 
-static void interp_quadruple_encode (vm_t vm, bytecode32_t bc)
+static void interp_quadruple_encode (vm_t vm, u8_t type, const u8_t *bc)
 {
-  switch (bc.type)
+  switch (type)
     {
     case VEC_SET:
       {
         PANIC ("VEC_SET hasn't been implemented yet!");
         /* vector_t vec = (vector_t)ss_read_u32 (bc.bc1); */
-        /* object_t obj = (object_t)ss_read_u32 (bc.bc3); */
-        /* VM_DEBUG ("(vec-set! 0x%p %d 0x%p)\n", vec, bc.bc2, obj); */
-        // vector_set (vec, bc.bc2, obj);
+        /* object_t obj = (object_t)ss_read_u32 (bc[1]); */
+        /* VM_DEBUG ("(vec-set! 0x%p %d 0x%p)\n", vec, bc[0], obj); */
+        // vector_set (vec, bc[0], obj);
         break;
       }
     case CLOSURE_ON_HEAP:
       {
-        u8_t size = (bc.bc2 & 0xF);
-        u8_t arity = ((bc.bc2 & 0xF0) >> 4);
-        reg_t entry = ((bc.bc3 << 8) | bc.bc4);
-        VM_DEBUG ("(closure-on-heap %d %d 0x%x)\n", arity, size, entry);
-        closure_t closure = create_closure (vm, arity, size, entry);
-        Object obj = {.attr = {.type = closure_on_heap, .gc = FREE_OBJ},
-                      .value = (closure_t)closure};
-        gc_inner_obj_book (closure_on_heap, closure);
-        PUSH_OBJ (obj);
+        u8_t size = (bc[0] & 0xF);
+        u8_t arity = ((bc[0] & 0xF0) >> 4);
+        reg_t entry = ((bc[1] << 8) | bc[2]);
+        op_closure_on_heap (vm, arity, size, entry);
         break;
       }
     case CLOSURE_ON_STACK:
       {
-        u8_t size = (bc.bc2 & 0xFF);
-        u8_t arity = ((bc.bc2 & 0xFF00) >> 4);
-        reg_t entry = ((bc.bc3 << 8) | bc.bc4);
+        u8_t size = (bc[0] & 0xFF);
+        u8_t arity = ((bc[0] & 0xFF00) >> 4);
+        reg_t entry = ((bc[1] << 8) | bc[2]);
         reg_t env = vm->sp + sizeof (Object); // skip closure object
         VM_DEBUG ("(closure-on-stack %d 0x%x)\n", size, entry);
         Object obj = {.attr = {.type = closure_on_stack, .gc = FREE_OBJ},
@@ -1075,21 +1345,125 @@ static void interp_quadruple_encode (vm_t vm, bytecode32_t bc)
       }
     default:
       {
-        os_printk ("Invalid bytecode %X, %X, %X, %X\n", bc.bc1, bc.bc2, bc.bc3,
-                   bc.bc4);
+        os_printk ("Invalid bytecode %X, %X, %X, %X\n", type, bc[0], bc[1],
+                   bc[2]);
         PANIC ("interp_quadruple_encode panic!\n");
       }
     }
 }
 
-static void interp_special (vm_t vm, bytecode8_t bc)
+#if (4 == PC_SIZE)
+static void interp_wide_encode (vm_t vm, u8_t data)
 {
-  switch (bc.type)
+  switch (data)
+    {
+    case WIDE_CALL_PROC:
+      {
+        op_call_proc (vm, (reg_t)vm_get_uintptr (vm));
+        break;
+      }
+    case WIDE_F_JMP:
+      {
+        op_fjump (vm, (reg_t)vm_get_uintptr (vm));
+        break;
+      }
+    case WIDE_JMP:
+      {
+        op_jump (vm, (reg_t)vm_get_uintptr (vm));
+        break;
+      }
+    case WIDE_CLOSURE_ON_HEAP:
+      {
+        u8_t desc = NEXT_DATA ();
+        reg_t entry = (reg_t)vm_get_uintptr (vm);
+        op_closure_on_heap (vm, ((desc & 0xF0) >> 4), (desc & 0xF), entry);
+        break;
+      }
+    case WIDE_PROCEDURE:
+      {
+        Object obj = {0};
+        obj.attr.gc
+          = (VM_INIT_GLOBALS == vm->state) ? PERMANENT_OBJ : FREE_OBJ;
+        obj.attr.type = procedure;
+        obj.proc.entry = (reg_t)vm_get_uintptr (vm);
+        obj.proc.arity = NEXT_DATA ();
+        obj.proc.opt = NEXT_DATA ();
+        VM_DEBUG ("(push-proc-object 0x%x %d %d)\n", obj.proc.entry,
+                  obj.proc.arity, obj.proc.opt);
+        PUSH_OBJ (obj);
+        break;
+      }
+    default:
+      {
+        os_printk ("Invalid bytecode %X %X\n", WIDE, data);
+        PANIC ("interp_wide_encode panic!\n");
+      }
+    }
+}
+#endif
+
+static void interp_object (vm_t vm, u8_t data)
+{
+  switch (data)
+    {
+    case GENERAL_OBJECT:
+      {
+        Object obj = {0};
+        generate_object (vm, &obj);
+        PUSH_OBJ (obj);
+        break;
+      }
+    case FALSE:
+      {
+        VM_DEBUG ("(push-boolean-false)\n");
+        Object obj = GLOBAL_REF (false_const);
+        PUSH_OBJ (obj);
+        break;
+      }
+    case TRUE:
+      {
+        VM_DEBUG ("(push-boolean-true)\n");
+        Object obj = GLOBAL_REF (true_const);
+        PUSH_OBJ (obj);
+        break;
+      }
+    case SYMBOL:
+      {
+        Object sym
+          = {.attr = {.type = symbol,
+                      .gc = (VM_INIT_GLOBALS == vm->state) ? PERMANENT_OBJ
+                                                           : FREE_OBJ},
+             .value = NULL};
+        u16_t offset = vm_get_u16 (vm);
+        const char *str_buf = GET_SYMBOL (offset);
+        VM_DEBUG ("(push-symbol-object %s)\n", str_buf);
+        make_symbol (str_buf, &sym);
+        PUSH_OBJ (sym);
+        break;
+      }
+    case CHAR:
+      {
+        Object obj
+          = {.attr = {.type = character,
+                      .gc = (VM_INIT_GLOBALS == vm->state) ? PERMANENT_OBJ
+                                                           : FREE_OBJ},
+             .value = NULL};
+        u8_t ch = NEXT_DATA ();
+        obj.value = (void *)ch;
+        PUSH_OBJ (obj);
+        break;
+      }
+    }
+}
+
+static void interp_special (vm_t vm, const decode_t *d)
+{
+  switch (d->type)
     {
     case PRIMITIVE:
       {
-        VM_DEBUG ("(primitive %d %s)\n", bc.data, prim_name (bc.data));
-        call_prim (vm, (pn_t)bc.data);
+        VM_DEBUG ("(primitive %d %s)\n", d->data, prim_name (d->data));
+        call_prim (vm, (pn_t)d->data);
         /* os_printk ("result: "); */
         /* object_printer (TOP_OBJ_PTR ()); */
         /* os_printk ("\n"); */
@@ -1099,7 +1473,7 @@ static void interp_special (vm_t vm, bytecode8_t bc)
     case PRIMITIVE_EXT:
       {
         u8_t pn_low = NEXT_DATA ();
-        u16_t pn = ((bc.data & 0xF) << 8 | pn_low) + 16;
+        u16_t pn = ((d->data & 0xF) << 8 | pn_low) + 16;
         VM_DEBUG ("(primitive-ext %d %s)\n", pn, prim_name (pn));
         call_prim (vm, pn);
         /* os_printk ("result: "); */
@@ -1109,71 +1483,16 @@ static void interp_special (vm_t vm, bytecode8_t bc)
       }
     case OBJECT:
       {
-        switch (bc.data)
-          {
-          case GENERAL_OBJECT:
-            {
-              Object obj = {0};
-              generate_object (vm, &obj);
-              PUSH_OBJ (obj);
-              break;
-            }
-          case FALSE:
-            {
-              VM_DEBUG ("(push-boolean-false)\n");
-              Object obj = GLOBAL_REF (false_const);
-              PUSH_OBJ (obj);
-              break;
-            }
-          case TRUE:
-            {
-              VM_DEBUG ("(push-boolean-true)\n");
-              Object obj = GLOBAL_REF (true_const);
-              PUSH_OBJ (obj);
-              break;
-            }
-          case SYMBOL:
-            {
-              Object sym
-                = {.attr = {.type = symbol,
-                            .gc = (VM_INIT_GLOBALS == vm->state) ? PERMANENT_OBJ
-                                                                 : FREE_OBJ},
-                   .value = NULL};
-              u16_t offset = vm_get_u16 (vm);
-              const char *str_buf = GET_SYMBOL (offset);
-              VM_DEBUG ("(push-symbol-object %s)\n", str_buf);
-              make_symbol (str_buf, &sym);
-              PUSH_OBJ (sym);
-              break;
-            }
-          case CHAR:
-            {
-              Object obj
-                = {.attr = {.type = character,
-                            .gc = (VM_INIT_GLOBALS == vm->state) ? PERMANENT_OBJ
-                                                                 : FREE_OBJ},
-                   .value = NULL};
-              u8_t ch = NEXT_DATA ();
-              obj.value = (void *)ch;
-              PUSH_OBJ (obj);
-              break;
-            }
-          }
+        interp_object (vm, d->data);
         break;
       }
     case CONTROL:
       {
-        switch (bc.data)
+        switch (d->data)
           {
           case HALT:
             {
-              if (VM_INIT_GLOBALS != vm->state)
-                {
-                  VM_DEBUG ("GC clean!\n");
-                  gc_clean_cache ();
-                  VM_DEBUG ("Halt here!\n");
-                }
-              vm->state = VM_STOP;
+              op_halt (vm);
               break;
             }
           default:
@@ -1183,7 +1502,7 @@ static void interp_special (vm_t vm, bytecode8_t bc)
       }
     default:
       {
-        os_printk ("Invalid special bytecode %X, %X\n", bc.type, bc.data);
+        os_printk ("Invalid special bytecode %X, %X\n", d->type, d->data);
         PANIC ("interp_special_encode panic!\n");
       }
     }
@@ -1218,22 +1537,90 @@ void vm_init_environment (vm_t vm)
   vm->state = VM_RUN;
   vm->sp = 0;
   vm->fp = 0;
+  DISPLAY_FLUSH ();
   vm->local = 0;
   vm->attr.shadow = 0;
   vm->attr.mode = NORMAL_CALL;
   vm->cc = NULL;
   vm->closure = NULL;
+#ifdef USE_LEAF_FRAME
+  vm->leaf = 0;
+#endif
+#ifdef USE_BUDGET
+  vm->budget = 0;
+  vm->quantum = 0;
+  vm->nested = 0;
+  vm->preempt = 0;
+#endif
 }
 
 void vm_init (vm_t vm)
 {
+  // NOTE: the offsets on the stack are reg_t
+  if (GLOBAL_REF (VM_STKSEG_SIZE) > NO_PREV_FP)
+    PANIC ("VM_STKSEG_SIZE doesn't fit in PC_SIZE %d!\n", PC_SIZE);
+
   os_memset (vm, 0, sizeof (struct LambdaVM));
   vm_init_environment (vm);
   vm->code = NULL;
+#ifdef USE_STACK_GROW
+  vm->stack_size = GLOBAL_REF (VM_STKSEG_SIZE);
+
+  if (vm->stack_size > VM_STKSEG_INIT)
+    vm->stack_size = VM_STKSEG_INIT;
+
+  vm->stack = (u8_t *)os_malloc (vm->stack_size);
+#else
   vm->stack = (u8_t *)os_malloc (GLOBAL_REF (VM_STKSEG_SIZE));
+#endif
   vm->globals = NULL;
+#ifdef USE_INLINE_CACHE
+  vm->gversion = NULL;
+#endif
+}
+
+#ifdef USE_STACK_GROW
+// Move the used part of the stack to a new one of `size' bytes
+static void stack_resize (vm_t vm, size_t size)
+{
+  u8_t *stack = (u8_t *)os_malloc (size);
+
+  if (!stack)
+    PANIC ("Stack overflow, can't grow to %zu bytes!\n", size);
+
+  os_memcpy (stack, vm->stack, vm->sp);
+  os_free (vm->stack);
+  vm->stack = stack;
+  vm->stack_size = size;
+}
+
+/* NOTE:
+ * Double the stack until `need' bytes fit in. The memory of a VM follows the
+ * actual depth, and VM_STKSEG_SIZE is only the limit now.
+ */
+void vm_stack_grow (vm_t vm, size_t need)
+{
+  size_t limit = GLOBAL_REF (VM_STKSEG_SIZE);
+  size_t size = vm->stack_size;
+
+  if (need > limit)
+    PANIC ("Stack overflow!\n");
+
+  while (size < need)
+    size <<= 1;
+
+  stack_resize (vm, size > limit ? limit : size);
 }
 
+// Called by RESTORE when less than a quarter is used
+void vm_stack_shrink (vm_t vm)
+{
+  size_t size = vm->stack_size >> 1;
+
+  stack_resize (vm, size < VM_STKSEG_INIT ? VM_STKSEG_INIT : size);
+}
+#endif
+
 void vm_clean (vm_t vm)
 {
   /* NOTE: vm->code will be free in LEF */
@@ -1244,6 +1631,32 @@ void vm_clean (vm_t vm)
   os_free (vm->globals);
   vm->globals = NULL;
 
+#ifdef USE_INLINE_CACHE
+  os_free (vm->gversion);
+  vm->gversion = NULL;
+#endif
+
+#ifdef USE_PREDECODE
+  if (vm->insns)
+    os_free (vm->insns);
+
+  vm->insns = NULL;
+#endif
+
+#ifdef USE_JIT
+  if (vm->jit)
+    jit_clean (vm->jit);
+
+  vm->jit = NULL;
+#endif
+
+#ifdef USE_AOT
+  if (vm->aot)
+    os_free (vm->aot);
+
+  vm->aot = NULL;
+#endif
+
   clean_symbol_table ();
   os_free (vm);
   vm = NULL;
@@ -1265,6 +1678,12 @@ void vm_init_globals (vm_t vm, lef_t lef)
   vm->globals = (object_t)os_malloc (size);
   os_memcpy (vm->globals, vm->stack, size);
   vm->code = code; // restore code segment
+#ifdef USE_INLINE_CACHE
+  size_t count = size / sizeof (Object);
+  vm->gversion = (u16_t *)os_malloc (count * sizeof (u16_t));
+  os_memset (vm->gversion, 0, count * sizeof (u16_t));
+  flush_call_caches (vm);
+#endif
 
   /* #ifdef ANIMULA_DEBUG */
   /*   os_printk ("Globals %d: sp: %d\n", vm->sp / sizeof (Object), vm->sp); */
@@ -1290,12 +1709,50 @@ void vm_init_globals (vm_t vm, lef_t lef)
 
 void vm_load_lef (vm_t vm, lef_t lef)
 {
+  // NOTE: the pcs from RESUME_PC are reserved, see vm.h
+  if (lef->psize >= RESUME_PC || lef->gsize >= RESUME_PC)
+    PANIC ("The LEF doesn't fit in PC_SIZE %d!\n", PC_SIZE);
+
   GLOBAL_SET (VM_CODESEG_SIZE, lef->psize);
   GLOBAL_SET (VM_GLOBALSEG_SIZE, lef->gsize);
 
   create_symbol_table (&lef->symtab);
   // FIXME: not all mem section is data seg
 
+#ifdef USE_PREDECODE
+  if (vm->insns)
+    os_free (vm->insns);
+
+  vm->insns = predecode_program (LEF_PROG (lef), lef->psize);
+#endif
+
+#ifdef USE_JIT
+  if (vm->jit)
+    jit_clean (vm->jit);
+
+  vm->jit = vm->insns ? jit_init (lef->psize) : NULL;
+#endif
+
+#ifdef USE_AOT
+  // NOTE: it's installed by vm_load_aot for the translated program only
+  if (vm->aot)
+    os_free (vm->aot);
+
+  vm->aot = NULL;
+#endif
+
+#ifdef USE_VERIFIER
+  insn_t *globals = predecode_program (LEF_GLOBAL (lef), lef->gsize);
+  bool verified = verify_program (vm->insns, lef->psize, lef->entry, globals,
+                                  lef->gsize);
+
+  if (globals)
+    os_free (globals);
+
+  if (!verified)
+    PANIC ("The bytecode verification failed!\n");
+#endif
+
   vm_init_globals (vm, lef);
 
   vm->code = LEF_PROG (lef);
@@ -1315,82 +1772,1229 @@ void vm_restart (vm_t vm)
   vm_init_environment (vm);
 }
 
-static encode_t pre_fetch (vm_t vm, bytecode8_t bytecode)
+static void dispatch (vm_t vm, bytecode8_t bc)
 {
-  //  VM_DEBUG("Prefetch: %x\n", bytecode.all);
-  if (SINGLE_ENCODE (bytecode))
-    {
-      return SINGLE;
-    }
-  else if (DOUBLE_ENCODE (bytecode))
-    {
-      return DOUBLE;
-    }
-  else if (TRIPLE_ENCODE (bytecode))
-    {
-      return TRIPLE;
-    }
-  else if (QUADRUPLE_ENCODE (bytecode))
-    {
-      return QUADRUPLE;
-    }
-  else if (IS_SPECIAL (bytecode))
-    {
-      return SPECIAL;
-    }
-
-  VM_DEBUG ("Invalid encode %x\n", bytecode.type);
-  PANIC ("BUG in pre_fetch: it's impossible to be here!");
-  return -1;
-}
-
-static void dispatch (vm_t vm, bytecode8_t bc)
-{
-  switch (pre_fetch (vm, bc))
+  const decode_t *d = DECODE (bc.all);
+
+  switch (d->encode)
     {
     case SINGLE:
       {
-        interp_single_encode (vm, bc);
+        interp_single_encode (vm, d);
         break;
       }
     case DOUBLE:
       {
-        bytecode16_t bc16;
-        bc16.bc1 = bc.all;
-        bc16.bc2 = NEXT_DATA ();
-        interp_double_encode (vm, bc16);
+        interp_double_encode (vm, d->data, NEXT_DATA ());
         break;
       }
     case TRIPLE:
       {
-        bytecode24_t bc24;
-        bc24.bc1 = bc.all;
-        bc24.bc2 = NEXT_DATA ();
-        bc24.bc3 = NEXT_DATA ();
-        interp_triple_encode (vm, bc24);
+        u16_t data = NEXT_DATA () << 8;
+        data |= NEXT_DATA ();
+        interp_triple_encode (vm, d->data, data);
         break;
       }
     case QUADRUPLE:
       {
-        bytecode32_t bc32;
-        bc32.bc1 = bc.all;
-        bc32.bc2 = NEXT_DATA ();
-        bc32.bc3 = NEXT_DATA ();
-        bc32.bc4 = NEXT_DATA ();
-        interp_quadruple_encode (vm, bc32);
+        u8_t operands[3];
+        operands[0] = NEXT_DATA ();
+        operands[1] = NEXT_DATA ();
+        operands[2] = NEXT_DATA ();
+        interp_quadruple_encode (vm, d->data, operands);
         break;
       }
+#if (4 == PC_SIZE)
+    case WIDE:
+      interp_wide_encode (vm, d->data);
+      break;
+#endif
     case SPECIAL:
-      interp_special (vm, bc);
+      interp_special (vm, d);
       break;
     default:
       {
-        os_printk ("Invalid bytecode type!\n");
+        os_printk ("Invalid bytecode %X!\n", bc.all);
         PANIC ("vm_run panic!\n");
       }
     };
 }
 
+#ifdef VM_THREADED_DISPATCH
+/* NOTE:
+ * Each opcode byte indexes its handler label directly, so there's only one
+ * indirect jump for each instruction, rather than the nested switches in
+ * dispatch. The handlers share the op_* bodies with dispatch.
+ * The decode table gives the fixed size of each instruction, so the code
+ * segment bound is checked once per instruction, then the operands are read
+ * from vm->code directly. The rare instructions fall back to dispatch, which
+ * fetches its operands with the usual checks.
+ * When `proc' is true, we run a procedure for apply_proc, which stops before
+ * the `restore' primitive.
+ */
+#  define THREADED_OPERAND() (vm->code[vm->pc++])
+
+#  if (4 == PC_SIZE)
+// The 4 bytes address of the wide encoding, in big endian
+#    define THREADED_WIDE_OPERAND()                       \
+      ({                                                  \
+        reg_t wide = (reg_t)THREADED_OPERAND () << 24;    \
+        wide |= (reg_t)THREADED_OPERAND () << 16;         \
+        wide |= (reg_t)THREADED_OPERAND () << 8;          \
+        wide | THREADED_OPERAND ();                       \
+      })
+#  endif
+
+#  define THREADED_NEXT()                                                 \
+    do                                                                    \
+      {                                                                   \
+        if (!proc && 0 == vm->sp)                                         \
+          {                                                               \
+            VM_DEBUG ("stack is empty, try to recycle once!\n");          \
+            gc_try_to_recycle ();                                         \
+            VM_DEBUG ("done\n");                                          \
+          }                                                               \
+        goto next;                                                        \
+      }                                                                   \
+    while (0)
+
+static void run_threaded (vm_t vm, bool proc)
+{
+  static void *labels[256] = {NULL};
+  bytecode8_t bc = {0};
+  const decode_t *d = NULL;
+  size_t limit = (VM_INIT_GLOBALS == vm->state) ? GLOBAL_REF (VM_GLOBALSEG_SIZE)
+                                                : GLOBAL_REF (VM_CODESEG_SIZE);
+
+  if (NULL == labels[0])
+    {
+      for (int i = 0; i < 256; i++)
+        {
+          const decode_t *b = DECODE (i);
+          void *label = &&slow;
+
+          if (SINGLE == b->encode)
+            {
+              static void *const singles[8]
+                = {&&local_ref,   &&local_ref_ext,  &&free_ref,
+                   &&call_free,   &&call_local,     &&call_local_ext,
+                   &&free_assign, &&local_assign};
+              label = singles[b->type];
+            }
+          else if (DOUBLE == b->encode && CALL_GLOBAL_VAR >= b->data)
+            {
+              static void *const doubles[6]
+                = {&&prelude,       &&local_ref_high, &&call_local_high,
+                   &&global_assign, &&global_ref,     &&call_global};
+              label = doubles[b->data];
+            }
+          else if (TRIPLE == b->encode && JMP >= b->data)
+            {
+              static void *const triples[3] = {&&call_proc, &&fjump, &&jump};
+              label = triples[b->data];
+            }
+#  if (4 == PC_SIZE)
+          else if (WIDE == b->encode && WIDE_JMP >= b->data)
+            {
+              static void *const wides[3]
+                = {&&call_proc_wide, &&fjump_wide, &&jump_wide};
+              label = wides[b->data];
+            }
+#  endif
+          else if (PRIMITIVE == b->type)
+            label = (restore == b->data) ? &&prim_restore : &&prim;
+          else if (PRIMITIVE_EXT == b->type)
+            label = &&prim_ext;
+          else if (OBJECT == b->type)
+            label = &&object;
+          else if (CONTROL == b->type)
+            label = (HALT == b->data) ? &&halt : &&nop;
+
+          labels[i] = label;
+        }
+    }
+
+next:
+  if (!(VM_RUN == vm->state || (!proc && VM_INIT_GLOBALS == vm->state)))
+    return;
+
+  if (RESUME_PC == vm->pc)
+    {
+      tramp_resume (vm);
+      goto next;
+    }
+
+  if (vm->pc >= limit || vm->pc + DECODE (vm->code[vm->pc])->len > limit)
+    {
+      os_printk ("Oops, no more bytecode! pc: %d, global: %d, code: %d\n",
+                 vm->pc, GLOBAL_REF (VM_GLOBALSEG_SIZE),
+                 GLOBAL_REF (VM_CODESEG_SIZE));
+      VM_PANIC ();
+      return;
+    }
+
+  bc.all = THREADED_OPERAND ();
+  d = DECODE (bc.all);
+  goto *labels[bc.all];
+
+local_ref:
+  op_local_ref (vm, d->data);
+  THREADED_NEXT ();
+
+local_ref_ext:
+  op_local_ref (vm, d->data + 16);
+  THREADED_NEXT ();
+
+free_ref:
+  {
+    u8_t frame = THREADED_OPERAND ();
+    op_free_ref (vm, (frame & 0b00111111),
+                 ((d->data << 2) | ((frame & 0b11000000) >> 6)));
+    THREADED_NEXT ();
+  }
+
+call_free:
+  {
+    u8_t frame = THREADED_OPERAND ();
+    op_call_free (vm, (frame & 0b00111111),
+                  ((d->data << 2) | ((frame & 0b11000000) >> 6)));
+    THREADED_NEXT ();
+  }
+
+call_local:
+  op_call_local (vm, d->data);
+  THREADED_NEXT ();
+
+call_local_ext:
+  op_call_local (vm, d->data + 16);
+  THREADED_NEXT ();
+
+free_assign:
+  {
+    u8_t frame = THREADED_OPERAND ();
+    op_free_assign (vm, (frame & 0b00111111),
+                    ((d->data << 2) | ((frame & 0b11000000) >> 6)));
+    THREADED_NEXT ();
+  }
+
+local_assign:
+  {
+    u8_t offset_0 = THREADED_OPERAND ();
+    op_local_assign (vm, ((d->data << 8) | offset_0));
+    THREADED_NEXT ();
+  }
+
+prelude:
+  op_prelude (vm, THREADED_OPERAND ());
+  THREADED_NEXT ();
+
+local_ref_high:
+  op_local_ref (vm, THREADED_OPERAND () + 32);
+  THREADED_NEXT ();
+
+call_local_high:
+  op_call_local (vm, THREADED_OPERAND () + 32);
+  THREADED_NEXT ();
+
+global_assign:
+  op_global_assign (vm, THREADED_OPERAND ());
+  THREADED_NEXT ();
+
+global_ref:
+  op_global_ref (vm, THREADED_OPERAND ());
+  THREADED_NEXT ();
+
+call_global:
+  op_call_global (vm, THREADED_OPERAND ());
+  THREADED_NEXT ();
+
+call_proc:
+  {
+    reg_t offset = THREADED_OPERAND () << 8;
+    offset |= THREADED_OPERAND ();
+    op_call_proc (vm, offset);
+    THREADED_NEXT ();
+  }
+
+fjump:
+  {
+    reg_t offset = THREADED_OPERAND () << 8;
+    offset |= THREADED_OPERAND ();
+    op_fjump (vm, offset);
+    THREADED_NEXT ();
+  }
+
+jump:
+  {
+    reg_t offset = THREADED_OPERAND () << 8;
+    offset |= THREADED_OPERAND ();
+    op_jump (vm, offset);
+    THREADED_NEXT ();
+  }
+
+#  if (4 == PC_SIZE)
+call_proc_wide:
+  op_call_proc (vm, THREADED_WIDE_OPERAND ());
+  THREADED_NEXT ();
+
+fjump_wide:
+  op_fjump (vm, THREADED_WIDE_OPERAND ());
+  THREADED_NEXT ();
+
+jump_wide:
+  op_jump (vm, THREADED_WIDE_OPERAND ());
+  THREADED_NEXT ();
+#  endif
+
+prim_restore:
+  if (proc)
+    return;
+  /* fall through */
+prim:
+  VM_DEBUG ("(primitive %d %s)\n", d->data, prim_name (d->data));
+  call_prim (vm, (pn_t)d->data);
+  THREADED_NEXT ();
+
+prim_ext:
+  {
+    u16_t pn = ((d->data & 0xF) << 8 | THREADED_OPERAND ()) + 16;
+    VM_DEBUG ("(primitive-ext %d %s)\n", pn, prim_name (pn));
+    call_prim (vm, pn);
+    THREADED_NEXT ();
+  }
+
+object:
+  interp_object (vm, d->data);
+  THREADED_NEXT ();
+
+halt:
+  op_halt (vm);
+  THREADED_NEXT ();
+
+nop:
+  THREADED_NEXT ();
+
+slow:
+  dispatch (vm, bc);
+  THREADED_NEXT ();
+}
+#endif
+
+#ifdef USE_PREDECODE
+/* NOTE:
+ * The superinstructions and the quickened ops call the primitive directly on
+ * the operands, rather than push them, see fuse_program in predecode.c.
+ */
+static inline void op_prim2 (vm_t vm, pn_t pn, object_t o1, object_t o2)
+{
+  prim_t prim = GLOBAL_REF (prim_table)[pn];
+
+  VM_DEBUG ("(primitive %d %s)\n", pn, prim_name (pn));
+
+  if (PRIM_IS_LOGIC2 (pn))
+    {
+      if (prim_logic2 (prim, o1, o2))
+        PUSH_OBJ (GLOBAL_REF (true_const));
+      else
+        PUSH_OBJ (GLOBAL_REF (false_const));
+    }
+  else
+    PUSH_OBJ (prim_arith2 (vm, prim, o1, o2));
+}
+
+static inline void op_prim2_fjump (vm_t vm, pn_t pn, object_t o1, object_t o2,
+                                   reg_t offset)
+{
+  VM_DEBUG ("(primitive %d %s)\n(fjump 0x%x)\n", pn, prim_name (pn), offset);
+
+  if (!prim_logic2 (GLOBAL_REF (prim_table)[pn], o1, o2))
+    {
+      VM_DEBUG ("False! Jump!\n");
+      BRANCH (offset);
+    }
+}
+
+#  ifdef USE_QUICKENING
+#    define QUICKEN_THRESHOLD 4
+
+static const u8_t quickened_op[INSN_OP_MAX]
+  = {[INSN_PRIMITIVE] = INSN_PRIM_INT,
+     [INSN_LOCAL_PRIM] = INSN_LOCAL_PRIM_INT,
+     [INSN_CONST_PRIM] = INSN_CONST_PRIM_INT,
+     [INSN_LOCAL_CONST_PRIM] = INSN_LOCAL_CONST_PRIM_INT,
+     [INSN_PRIM_FJUMP] = INSN_PRIM_FJUMP_INT,
+     [INSN_LOCAL_CONST_FJUMP] = INSN_LOCAL_CONST_FJUMP_INT};
+
+static const u8_t generic_op[INSN_OP_MAX]
+  = {[INSN_PRIM_INT] = INSN_PRIMITIVE,
+     [INSN_LOCAL_PRIM_INT] = INSN_LOCAL_PRIM,
+     [INSN_CONST_PRIM_INT] = INSN_CONST_PRIM,
+     [INSN_LOCAL_CONST_PRIM_INT] = INSN_LOCAL_CONST_PRIM,
+     [INSN_PRIM_FJUMP_INT] = INSN_PRIM_FJUMP,
+     [INSN_LOCAL_CONST_FJUMP_INT] = INSN_LOCAL_CONST_FJUMP};
+
+/* NOTE:
+ * The generic op counts the fixnum operands in the hit bits of the flags,
+ * and it's rewritten into the quickened op in place after QUICKEN_THRESHOLD
+ * hits in a row.
+ */
+static inline void quicken (insn_t *insn, pn_t pn, object_t o1, object_t o2)
+{
+  if (!PRIM_IS_QUICK (pn))
+    return;
+
+  if (imm_int != o1->attr.type || imm_int != o2->attr.type)
+    {
+      insn->flags &= ~INSN_HITS;
+      return;
+    }
+
+  insn->flags += INSN_HIT;
+
+  if (QUICKEN_THRESHOLD * INSN_HIT == (insn->flags & INSN_HITS))
+    {
+      insn->flags &= ~INSN_HITS;
+      insn->op = quickened_op[insn->op];
+    }
+}
+
+/* NOTE:
+ * When the guard fails, the op is turned back into the generic one, which
+ * may be quickened again later.
+ */
+static inline void op_prim2_int (vm_t vm, insn_t *insn, pn_t pn, object_t o1,
+                                 object_t o2)
+{
+  Object ret;
+
+  if (prim2_int (pn, o1, o2, &ret))
+    {
+      PUSH_OBJ (ret);
+      return;
+    }
+
+  insn->op = generic_op[insn->op];
+  op_prim2 (vm, pn, o1, o2);
+}
+
+static inline void op_prim2_fjump_int (vm_t vm, insn_t *insn, pn_t pn,
+                                       object_t o1, object_t o2, reg_t offset)
+{
+  Object ret;
+
+  if (prim2_int (pn, o1, o2, &ret))
+    {
+      if (is_false (&ret))
+        BRANCH (offset);
+      return;
+    }
+
+  insn->op = generic_op[insn->op];
+  op_prim2_fjump (vm, pn, o1, o2, offset);
+}
+
+#    define QUICKEN(insn, pn, o1, o2) quicken ((insn), (pn), (o1), (o2))
+#  else
+#    define QUICKEN(insn, pn, o1, o2)
+#  endif
+
+#  ifdef USE_REGISTER_IR
+static inline Object reg_read (vm_t vm, const insn_t *insn, u16_t reg)
+{
+  switch (REG_KIND (reg))
+    {
+    case REG_LOCAL:
+      return *(object_t)LOCAL (REG_INDEX (reg));
+    case REG_CONST:
+      return insn->obj;
+    case REG_GLOBAL:
+      return GLOBAL (REG_INDEX (reg));
+    default:
+      return POP_OBJ ();
+    }
+}
+
+/* NOTE:
+ * The register form tries the fixnum fast path first, so it needs no
+ * quickening, see to_register_form in predecode.c.
+ * The second operand is read first, since it's above the first one when both
+ * of them are on the stack.
+ */
+static inline void op_prim_reg (vm_t vm, const insn_t *insn)
+{
+  // NOTE: the copies, since some primitives cast the arguments in place
+  Object o2 = reg_read (vm, insn, insn->c);
+  Object o1 = reg_read (vm, insn, insn->a);
+  Object ret;
+
+  if (PRIM_IS_QUICK (insn->b) && prim2_int (insn->b, &o1, &o2, &ret))
+    PUSH_OBJ (ret);
+  else
+    op_prim2 (vm, insn->b, &o1, &o2);
+}
+
+static inline void op_prim_reg_fjump (vm_t vm, const insn_t *insn,
+                                      reg_t offset)
+{
+  Object o2 = reg_read (vm, insn, insn->c);
+  Object o1 = reg_read (vm, insn, insn->a);
+  Object ret;
+
+  if (PRIM_IS_QUICK (insn->b) && prim2_int (insn->b, &o1, &o2, &ret))
+    {
+      if (is_false (&ret))
+        BRANCH (offset);
+    }
+  else
+    op_prim2_fjump (vm, insn->b, &o1, &o2, offset);
+}
+#  endif
+
+#  ifdef USE_TAIL_MOVE
+static inline Object tail_arg (vm_t vm, const insn_t *arg)
+{
+  switch (arg->op)
+    {
+    case INSN_LOCAL_REF:
+      return *(object_t)LOCAL (arg->a);
+    case INSN_FREE_REF:
+      return *(object_t)FREE_VAR (arg->a, arg->b);
+    case INSN_GLOBAL_REF:
+      return GLOBAL (arg->a);
+#    ifdef USE_REGISTER_IR
+    case INSN_PRIM_REG:
+      op_prim_reg (vm, arg);
+      return POP_OBJ ();
+#    endif
+    default:
+      return arg->obj;
+    }
+}
+
+/* NOTE:
+ * All the args are computed from the old locals before any of them is
+ * overwritten, so it's a parallel move, and the arg which is the same local
+ * is not moved at all. The temporaries are safe from the GC, since the args
+ * never allocate, see is_tail_arg in predecode.c.
+ * The frame ends up as PROC_CALL leaves it after COPY_SHADOW_FRAME.
+ */
+static inline void op_tail_move (vm_t vm, insn_t *insns, insn_t *insn)
+{
+  u8_t arity = insn->a;
+  reg_t entry = insns[vm->pc - 3].target;
+  const insn_t *arg = insn + insn->c;
+  Object args[TAIL_MOVE_MAX];
+  u8_t moved = 0;
+
+  VM_DEBUG ("(tail-move %d 0x%x)\n", arity, entry);
+
+  for (u8_t i = 0; i < arity; i++)
+    {
+      args[i] = tail_arg (vm, arg);
+
+      if (vm->closure || INSN_LOCAL_REF != arg->op || i != arg->a)
+        moved |= 1 << i;
+
+      arg += arg->len;
+    }
+
+  FIX_PC ();
+
+  object_t local = (object_t) (vm->stack + vm->local);
+
+  for (u8_t i = 0; i < arity; i++)
+    if (moved & (1 << i))
+      local[i] = args[i];
+
+  vm->attr.shadow = arity;
+  vm->attr.mode = TAIL_REC;
+  vm->sp = vm->local + arity * sizeof (Object);
+  PROC_ENTER (entry);
+}
+#  endif
+
+/* NOTE:
+ * Execute the pre-decoded instruction insn as op, and vm->pc has been moved to
+ * the next instruction. It's always inlined, so the switch is folded for the
+ * constant op of the JIT helpers, see jit.c.
+ * Return false when the procedure of apply_proc ends.
+ */
+static inline __attribute__ ((always_inline)) bool
+exec_insn (vm_t vm, insn_t *insns, insn_t *insn, u8_t op, bool proc)
+{
+  switch (op)
+    {
+    case INSN_RAW:
+      {
+        bytecode8_t bc = FETCH_NEXT_BYTECODE ();
+
+        if (proc && IS_PROC_END (bc))
+          return false;
+
+        dispatch (vm, bc);
+        break;
+      }
+    case INSN_NOP:
+      break;
+    case INSN_LOCAL_REF:
+      op_local_ref (vm, insn->a);
+      break;
+    case INSN_LOCAL_ASSIGN:
+      op_local_assign (vm, insn->a);
+      break;
+    case INSN_FREE_REF:
+      op_free_ref (vm, insn->a, insn->b);
+      break;
+    case INSN_FREE_ASSIGN:
+      op_free_assign (vm, insn->a, insn->b);
+      break;
+#  ifdef USE_INLINE_CACHE
+    case INSN_CALL_LOCAL:
+      VM_DEBUG ("(call-local %d)\n", insn->a);
+      op_call_object_cached (vm, (object_t)LOCAL (insn->a), &insn->cache);
+      break;
+    case INSN_CALL_FREE:
+      VM_DEBUG ("(call-free %x %d)\n", insn->a, insn->b);
+      op_call_object_cached (vm, (object_t)FREE_VAR (insn->a, insn->b),
+                             &insn->cache);
+      break;
+    case INSN_CALL_GLOBAL:
+      op_call_global_cached (vm, insn->a, &insn->cache);
+      break;
+#  else
+    case INSN_CALL_LOCAL:
+      op_call_local (vm, insn->a);
+      break;
+    case INSN_CALL_FREE:
+      op_call_free (vm, insn->a, insn->b);
+      break;
+    case INSN_CALL_GLOBAL:
+      op_call_global (vm, insn->a);
+      break;
+#  endif
+    case INSN_PRELUDE:
+      op_prelude (vm, insn->b);
+      break;
+    case INSN_GLOBAL_REF:
+      op_global_ref (vm, insn->a);
+      break;
+    case INSN_GLOBAL_ASSIGN:
+      op_global_assign (vm, insn->a);
+      break;
+    case INSN_CALL_PROC:
+      op_call_proc (vm, insn->target);
+      break;
+    case INSN_FJUMP:
+      op_fjump (vm, insn->target);
+      break;
+    case INSN_JUMP:
+      op_jump (vm, insn->target);
+      break;
+    case INSN_CLOSURE_ON_HEAP:
+      op_closure_on_heap (vm, insn->a, insn->b, insn->target);
+      break;
+    case INSN_RESTORE:
+      if (proc)
+        return false;
+      /* fall through */
+    case INSN_PRIMITIVE:
+#  ifdef USE_QUICKENING
+      if (PRIM_IS_QUICK (insn->a) && vm->sp >= 2 * sizeof (Object))
+        quicken (insn, insn->a,
+                 (object_t)(vm->stack + vm->sp - 2 * sizeof (Object)),
+                 TOP_OBJ_PTR ());
+#  endif
+      VM_DEBUG ("(primitive %d %s)\n", insn->a, prim_name (insn->a));
+      invoke_prim (vm, insn->a, insn->prim);
+      break;
+    case INSN_PUSH_CONST:
+      PUSH_OBJ (insn->obj);
+      break;
+    case INSN_HALT:
+      op_halt (vm);
+      break;
+#  ifdef USE_SUPERINSN
+    case INSN_LOCAL_PRIM:
+      {
+        // NOTE: some primitives cast the arguments in place, so copy them
+        Object o2 = *(object_t)LOCAL (insn->a);
+        Object o1 = POP_OBJ ();
+        QUICKEN (insn, insn->b, &o1, &o2);
+        op_prim2 (vm, insn->b, &o1, &o2);
+        break;
+      }
+    case INSN_CONST_PRIM:
+      {
+        Object o1 = POP_OBJ ();
+        Object o2 = insn->obj;
+        QUICKEN (insn, insn->b, &o1, &o2);
+        op_prim2 (vm, insn->b, &o1, &o2);
+        break;
+      }
+    case INSN_LOCAL_CONST_PRIM:
+      {
+        Object o1 = *(object_t)LOCAL (insn->a);
+        Object o2 = insn->obj;
+        QUICKEN (insn, insn->b, &o1, &o2);
+        op_prim2 (vm, insn->b, &o1, &o2);
+        break;
+      }
+    case INSN_PRIM_FJUMP:
+      {
+        Object o2 = POP_OBJ ();
+        Object o1 = POP_OBJ ();
+        QUICKEN (insn, insn->b, &o1, &o2);
+        op_prim2_fjump (vm, insn->b, &o1, &o2,
+                        insns[vm->pc - 3].target);
+        break;
+      }
+    case INSN_LOCAL_CONST_FJUMP:
+      {
+        Object o1 = *(object_t)LOCAL (insn->a);
+        Object o2 = insn->obj;
+        QUICKEN (insn, insn->b, &o1, &o2);
+        op_prim2_fjump (vm, insn->b, &o1, &o2, insns[vm->pc - 3].target);
+        break;
+      }
+    case INSN_GLOBAL_CALL_GLOBAL:
+      op_global_ref (vm, insn->a);
+#    ifdef USE_INLINE_CACHE
+      op_call_global_cached (vm, insn->b, &insn->cache);
+#    else
+      op_call_global (vm, insn->b);
+#    endif
+      break;
+#  endif
+#  ifdef USE_QUICKENING
+    case INSN_PRIM_INT:
+      {
+        Object o2 = POP_OBJ ();
+        Object o1 = POP_OBJ ();
+        op_prim2_int (vm, insn, insn->a, &o1, &o2);
+        break;
+      }
+    case INSN_LOCAL_PRIM_INT:
+      {
+        Object o2 = *(object_t)LOCAL (insn->a);
+        Object o1 = POP_OBJ ();
+        op_prim2_int (vm, insn, insn->b, &o1, &o2);
+        break;
+      }
+    case INSN_CONST_PRIM_INT:
+      {
+        Object o1 = POP_OBJ ();
+        Object o2 = insn->obj;
+        op_prim2_int (vm, insn, insn->b, &o1, &o2);
+        break;
+      }
+    case INSN_LOCAL_CONST_PRIM_INT:
+      {
+        Object o1 = *(object_t)LOCAL (insn->a);
+        Object o2 = insn->obj;
+        op_prim2_int (vm, insn, insn->b, &o1, &o2);
+        break;
+      }
+    case INSN_PRIM_FJUMP_INT:
+      {
+        Object o2 = POP_OBJ ();
+        Object o1 = POP_OBJ ();
+        op_prim2_fjump_int (vm, insn, insn->b, &o1, &o2,
+                            insns[vm->pc - 3].target);
+        break;
+      }
+    case INSN_LOCAL_CONST_FJUMP_INT:
+      {
+        Object o1 = *(object_t)LOCAL (insn->a);
+        Object o2 = insn->obj;
+        op_prim2_fjump_int (vm, insn, insn->b, &o1, &o2,
+                            insns[vm->pc - 3].target);
+        break;
+      }
+#  endif
+#  ifdef USE_REGISTER_IR
+    case INSN_PRIM_REG:
+      op_prim_reg (vm, insn);
+      break;
+    case INSN_PRIM_REG_FJUMP:
+      op_prim_reg_fjump (vm, insn, insns[vm->pc - 3].target);
+      break;
+#  endif
+#  ifdef USE_TAIL_MOVE
+    case INSN_TAIL_MOVE:
+      op_tail_move (vm, insns, insn);
+      break;
+#  endif
+#  ifdef USE_LEAF_FRAME
+    case INSN_LEAF_CALL:
+      VM_DEBUG ("(leaf-call %d 0x%x)\n", insn->a, insn->target);
+      LEAF_CALL (insn->a, insn->target);
+      break;
+#  endif
+    default:
+      {
+        os_printk ("Invalid instruction %d at %d\n", insn->op, vm->pc);
+        PANIC ("run_predecoded panic!\n");
+      }
+    }
+
+  return true;
+}
+
+#  ifdef USE_JIT
+#    define JIT_HELPER(op)                              \
+      static void jit_##op (vm_t vm, insn_t *insn)      \
+      {                                                 \
+        exec_insn (vm, vm->insns, insn, op, false);     \
+      }
+
+JIT_HELPER (INSN_NOP)
+JIT_HELPER (INSN_LOCAL_REF)
+JIT_HELPER (INSN_LOCAL_ASSIGN)
+JIT_HELPER (INSN_FREE_REF)
+JIT_HELPER (INSN_FREE_ASSIGN)
+JIT_HELPER (INSN_CALL_LOCAL)
+JIT_HELPER (INSN_CALL_FREE)
+JIT_HELPER (INSN_PRELUDE)
+JIT_HELPER (INSN_GLOBAL_REF)
+JIT_HELPER (INSN_GLOBAL_ASSIGN)
+JIT_HELPER (INSN_CALL_GLOBAL)
+JIT_HELPER (INSN_CALL_PROC)
+JIT_HELPER (INSN_FJUMP)
+JIT_HELPER (INSN_JUMP)
+JIT_HELPER (INSN_CLOSURE_ON_HEAP)
+JIT_HELPER (INSN_PRIMITIVE)
+JIT_HELPER (INSN_PUSH_CONST)
+JIT_HELPER (INSN_RESTORE)
+JIT_HELPER (INSN_LOCAL_PRIM)
+JIT_HELPER (INSN_CONST_PRIM)
+JIT_HELPER (INSN_LOCAL_CONST_PRIM)
+JIT_HELPER (INSN_PRIM_FJUMP)
+JIT_HELPER (INSN_LOCAL_CONST_FJUMP)
+JIT_HELPER (INSN_GLOBAL_CALL_GLOBAL)
+JIT_HELPER (INSN_PRIM_INT)
+JIT_HELPER (INSN_LOCAL_PRIM_INT)
+JIT_HELPER (INSN_CONST_PRIM_INT)
+JIT_HELPER (INSN_LOCAL_CONST_PRIM_INT)
+JIT_HELPER (INSN_PRIM_FJUMP_INT)
+JIT_HELPER (INSN_LOCAL_CONST_FJUMP_INT)
+JIT_HELPER (INSN_PRIM_REG)
+JIT_HELPER (INSN_PRIM_REG_FJUMP)
+JIT_HELPER (INSN_TAIL_MOVE)
+JIT_HELPER (INSN_LEAF_CALL)
+
+/* NOTE:
+ * INSN_RAW and INSN_HALT have no helper, they're left to the interpreter,
+ * see jit.c.
+ */
+const jit_helper_t jit_helpers[INSN_OP_MAX]
+  = {[INSN_NOP] = jit_INSN_NOP,
+     [INSN_LOCAL_REF] = jit_INSN_LOCAL_REF,
+     [INSN_LOCAL_ASSIGN] = jit_INSN_LOCAL_ASSIGN,
+     [INSN_FREE_REF] = jit_INSN_FREE_REF,
+     [INSN_FREE_ASSIGN] = jit_INSN_FREE_ASSIGN,
+     [INSN_CALL_LOCAL] = jit_INSN_CALL_LOCAL,
+     [INSN_CALL_FREE] = jit_INSN_CALL_FREE,
+     [INSN_PRELUDE] = jit_INSN_PRELUDE,
+     [INSN_GLOBAL_REF] = jit_INSN_GLOBAL_REF,
+     [INSN_GLOBAL_ASSIGN] = jit_INSN_GLOBAL_ASSIGN,
+     [INSN_CALL_GLOBAL] = jit_INSN_CALL_GLOBAL,
+     [INSN_CALL_PROC] = jit_INSN_CALL_PROC,
+     [INSN_FJUMP] = jit_INSN_FJUMP,
+     [INSN_JUMP] = jit_INSN_JUMP,
+     [INSN_CLOSURE_ON_HEAP] = jit_INSN_CLOSURE_ON_HEAP,
+     [INSN_PRIMITIVE] = jit_INSN_PRIMITIVE,
+     [INSN_PUSH_CONST] = jit_INSN_PUSH_CONST,
+     [INSN_RESTORE] = jit_INSN_RESTORE,
+     [INSN_LOCAL_PRIM] = jit_INSN_LOCAL_PRIM,
+     [INSN_CONST_PRIM] = jit_INSN_CONST_PRIM,
+     [INSN_LOCAL_CONST_PRIM] = jit_INSN_LOCAL_CONST_PRIM,
+     [INSN_PRIM_FJUMP] = jit_INSN_PRIM_FJUMP,
+     [INSN_LOCAL_CONST_FJUMP] = jit_INSN_LOCAL_CONST_FJUMP,
+     [INSN_GLOBAL_CALL_GLOBAL] = jit_INSN_GLOBAL_CALL_GLOBAL,
+     [INSN_PRIM_INT] = jit_INSN_PRIM_INT,
+     [INSN_LOCAL_PRIM_INT] = jit_INSN_LOCAL_PRIM_INT,
+     [INSN_CONST_PRIM_INT] = jit_INSN_CONST_PRIM_INT,
+     [INSN_LOCAL_CONST_PRIM_INT] = jit_INSN_LOCAL_CONST_PRIM_INT,
+     [INSN_PRIM_FJUMP_INT] = jit_INSN_PRIM_FJUMP_INT,
+     [INSN_LOCAL_CONST_FJUMP_INT] = jit_INSN_LOCAL_CONST_FJUMP_INT,
+     [INSN_PRIM_REG] = jit_INSN_PRIM_REG,
+     [INSN_PRIM_REG_FJUMP] = jit_INSN_PRIM_REG_FJUMP,
+     [INSN_TAIL_MOVE] = jit_INSN_TAIL_MOVE,
+     [INSN_LEAF_CALL] = jit_INSN_LEAF_CALL};
+#  endif
+
+#  ifdef USE_AOT
+/* NOTE:
+ * The translated code runs the instructions it can't expand inline by this,
+ * see lef2c.c. The instruction is never a superinstruction.
+ */
+void vm_exec_insn (vm_t vm, insn_t *insn)
+{
+  exec_insn (vm, vm->insns, insn, insn->op, false);
+}
+
+void vm_load_aot (vm_t vm, const struct AotImage *image)
+{
+  size_t size = GLOBAL_REF (VM_CODESEG_SIZE);
+
+  if (!vm->insns)
+    {
+      os_printk ("AOT: the program wasn't decoded, run it in the VM!\n");
+      return;
+    }
+
+  if (vm->aot)
+    os_free (vm->aot);
+
+  vm->aot = (aot_proc_t *)os_calloc (size, sizeof (aot_proc_t));
+
+  if (!vm->aot)
+    {
+      os_printk ("AOT: no memory, run it in the VM!\n");
+      return;
+    }
+
+  for (size_t i = 0; i < image->cnt; i++)
+    {
+      const aot_entry_t *entry = &image->entries[i];
+
+      if (entry->pc >= size)
+        PANIC ("AOT: invalid entry 0x%x!\n", entry->pc);
+
+      vm->aot[entry->pc] = entry->proc;
+    }
+}
+#  endif
+
+#  ifdef USE_CACHED_REGS
+#    ifdef USE_VERIFIER
+#      define CACHED_STACK_CHECK()
+#    else
+#      define CACHED_STACK_CHECK()                        \
+        do                                                \
+          {                                               \
+            if (VM_STACK_SIZE () < sp + sizeof (Object))  \
+              {                                           \
+                vm->sp = sp;                              \
+                vm_stack_check (vm);                      \
+                stack = vm->stack;                        \
+              }                                           \
+          }                                               \
+        while (0)
+#    endif
+
+#    define CACHED_PUSH(obj)                    \
+      do                                        \
+        {                                       \
+          *((object_t) (stack + sp)) = (obj);   \
+          sp += sizeof (Object);                \
+          CACHED_STACK_CHECK ();                \
+        }                                       \
+      while (0)
+
+#    define CACHED_TOP(n) ((object_t) (stack + sp - (n) * sizeof (Object)))
+
+// NOTE: the operands on the stack are only peeked, and popped from top
+#    define CACHED_REG(reg)                                            \
+      (REG_STACK == REG_KIND (reg)                                     \
+         ? (top -= sizeof (Object), (object_t) (stack + top))          \
+         : REG_LOCAL == REG_KIND (reg)                                 \
+             ? cached_local (stack, local, closure, REG_INDEX (reg))   \
+             : REG_CONST == REG_KIND (reg) ? &insn->obj                \
+                                           : &globals[REG_INDEX (reg)])
+
+/* NOTE:
+ * Write the registers back for the instruction which needs the full VM, then
+ * read them again, since it may move the pc and the sp, or run the GC.
+ */
+#    define CACHED_SLOW(call)                        \
+      do                                             \
+        {                                            \
+          vm->pc = pc + insn->len;                   \
+          vm->sp = sp;                               \
+          call;                                      \
+          stack = vm->stack;                         \
+          pc = vm->pc;                               \
+          sp = vm->sp;                               \
+          if (VM_RUN != vm->state || 0 == sp         \
+              || local != vm->local                  \
+              || closure != vm->closure)             \
+            return true;                             \
+        }                                            \
+      while (0)
+
+/* NOTE:
+ * The pc is still on the jump here, so the target <= pc is a backward one.
+ * We leave with the pc on the target when the budget runs out.
+ */
+#    ifdef USE_BUDGET
+#      define CACHED_BRANCH(target)                   \
+        do                                           \
+          {                                          \
+            reg_t to = (target);                     \
+            if (to <= pc)                            \
+              {                                      \
+                BUDGET_TICK ();                      \
+                if (VM_RUN != vm->state)             \
+                  {                                  \
+                    pc = to;                         \
+                    goto out;                        \
+                  }                                  \
+              }                                      \
+            pc = to;                                 \
+          }                                          \
+        while (0)
+#    else
+#      define CACHED_BRANCH(target) pc = (target)
+#    endif
+
+// The instructions run by run_cached
+static const bool cached_ops[INSN_OP_MAX]
+  = {[INSN_NOP] = true,       [INSN_LOCAL_REF] = true, [INSN_GLOBAL_REF] = true,
+     [INSN_PUSH_CONST] = true, [INSN_JUMP] = true,     [INSN_FJUMP] = true,
+     [INSN_PRIMITIVE] = true,
+#    ifdef USE_REGISTER_IR
+     [INSN_PRIM_REG] = true,   [INSN_PRIM_REG_FJUMP] = true
+#    endif
+};
+
+// The same as LOCAL, but on the cached registers
+static inline object_t cached_local (u8_t *stack, reg_t local,
+                                     closure_t closure, u16_t offset)
+{
+  if (closure)
+    {
+      if (offset >= closure->frame_size)
+        return &((object_t) (stack + local))[offset - closure->frame_size];
+
+      return &closure->env[offset];
+    }
+
+  return &((object_t) (stack + local))[offset];
+}
+
+/* NOTE:
+ * vm_t is packed, and any store to the stack may alias it, so the compiler
+ * has to reload the registers through vm after each push. Here we run the
+ * simple instructions with the registers kept in the locals, until the one
+ * which needs the full VM, say, the calls, the GC safepoint or an exit. Then
+ * the registers are written back, and run_predecoded executes that
+ * instruction as usual. The slow path of the primitives is called here with
+ * the registers written back, see CACHED_SLOW, and we leave if it enters a
+ * procedure, say, apply or map.
+ * The fp, the state and the frames are never changed here.
+ * Return false if it stops where it started.
+ */
+static __attribute__ ((noinline)) bool run_cached (vm_t vm, insn_t *insns)
+{
+  u8_t *stack = vm->stack;
+  object_t globals = vm->globals;
+  closure_t closure = vm->closure;
+  reg_t local = vm->local;
+  reg_t start = vm->pc;
+  reg_t pc = vm->pc;
+  reg_t sp = vm->sp;
+
+  for (;;)
+    {
+#    ifndef USE_VERIFIER
+      if (pc >= GLOBAL_REF (VM_CODESEG_SIZE))
+        break;
+#    endif
+
+      insn_t *insn = &insns[pc];
+      Object ret;
+
+      switch (insn->op)
+        {
+        case INSN_NOP:
+          pc += insn->len;
+          continue;
+        case INSN_LOCAL_REF:
+          VM_DEBUG ("(local %d)\n", insn->a);
+          CACHED_PUSH (*cached_local (stack, local, closure, insn->a));
+          pc += insn->len;
+          continue;
+        case INSN_GLOBAL_REF:
+          VM_DEBUG ("(global %d)\n", insn->a);
+          CACHED_PUSH (globals[insn->a]);
+          pc += insn->len;
+          continue;
+        case INSN_PUSH_CONST:
+          CACHED_PUSH (insn->obj);
+          pc += insn->len;
+          continue;
+        case INSN_JUMP:
+          VM_DEBUG ("(jump 0x%x)\n", insn->target);
+          CACHED_BRANCH (insn->target);
+          continue;
+        case INSN_FJUMP:
+          {
+            VM_DEBUG ("(fjump 0x%x)\n", insn->target);
+            sp -= sizeof (Object);
+
+            if (is_false (CACHED_TOP (0)))
+              CACHED_BRANCH (insn->target);
+            else
+              pc += insn->len;
+
+            // the GC safepoint of run_predecoded
+            if (0 == sp)
+              goto out;
+            continue;
+          }
+        case INSN_PRIMITIVE:
+          {
+            if (!PRIM_IS_QUICK (insn->a) || sp < 2 * sizeof (Object)
+                || !prim2_int (insn->a, CACHED_TOP (2), CACHED_TOP (1), &ret))
+              {
+                VM_DEBUG ("(primitive %d %s)\n", insn->a, prim_name (insn->a));
+                CACHED_SLOW (invoke_prim (vm, insn->a, insn->prim));
+                continue;
+              }
+
+            VM_DEBUG ("(primitive %d %s)\n", insn->a, prim_name (insn->a));
+            sp -= 2 * sizeof (Object);
+            CACHED_PUSH (ret);
+            pc += insn->len;
+            continue;
+          }
+#    ifdef USE_REGISTER_IR
+        case INSN_PRIM_REG:
+        case INSN_PRIM_REG_FJUMP:
+          {
+            reg_t top = sp;
+            object_t o2 = CACHED_REG (insn->c);
+            object_t o1 = CACHED_REG (insn->a);
+
+            if (!PRIM_IS_QUICK (insn->b) || !prim2_int (insn->b, o1, o2, &ret))
+              {
+                if (INSN_PRIM_REG == insn->op)
+                  CACHED_SLOW (op_prim_reg (vm, insn));
+                else
+                  CACHED_SLOW (op_prim_reg_fjump (
+                    vm, insn, insns[pc + insn->len - 3].target));
+                continue;
+              }
+
+            VM_DEBUG ("(primitive %d %s)\n", insn->b, prim_name (insn->b));
+            sp = top;
+
+            if (INSN_PRIM_REG == insn->op)
+              {
+                CACHED_PUSH (ret);
+                pc += insn->len;
+                continue;
+              }
+
+            if (is_false (&ret))
+              CACHED_BRANCH (insns[pc + insn->len - 3].target);
+            else
+              pc += insn->len;
+
+            if (0 == sp)
+              goto out;
+            continue;
+          }
+#    endif
+        default:
+          goto out;
+        }
+    }
+
+out:
+  vm->pc = pc;
+  vm->sp = sp;
+  return pc != start;
+}
+#  endif
+
+/* NOTE:
+ * Run the pre-decoded program, the operands were decoded by predecode_program
+ * at loading time, so each instruction is only a switch on its op.
+ * INSN_RAW falls back to dispatch on the raw bytecode.
+ * When `proc' is true, we run a procedure for apply_proc, which stops before
+ * the `restore' primitive.
+ */
+static void run_predecoded (vm_t vm, bool proc)
+{
+  insn_t *insns = vm->insns;
+
+  ENTRY_STACK_CHECK (vm->pc);
+
+  while (VM_RUN == vm->state)
+    {
+      if (RESUME_PC == vm->pc)
+        {
+          tramp_resume (vm);
+          continue;
+        }
+
+#ifndef USE_VERIFIER
+      /* NOTE:
+       * The verified program never leaves the code segment, see verifier.c
+       */
+      if (vm->pc >= GLOBAL_REF (VM_CODESEG_SIZE))
+        {
+          os_printk ("Oops, no more bytecode! pc: %d, code: %d\n", vm->pc,
+                     GLOBAL_REF (VM_CODESEG_SIZE));
+          VM_PANIC ();
+          break;
+        }
+#endif
+
+#  ifdef USE_AOT
+      // NOTE: the translated code doesn't stop at `restore' for apply_proc
+      if (!proc && vm->aot && vm->aot[vm->pc])
+        {
+          vm->aot[vm->pc](vm);
+          continue;
+        }
+#  endif
+
+#  ifdef USE_JIT
+      if (vm->jit && vm->jit->map[vm->pc])
+        {
+          u8_t outer = vm->jit->proc;
+          vm->jit->proc = proc;
+          vm->jit->enter (vm, vm->jit->map[vm->pc]);
+          vm->jit->proc = outer;
+
+          /* NOTE:
+           * The native code exits before `restore' for apply_proc, and
+           * we must not enter it again.
+           */
+          if (proc && INSN_RESTORE == insns[vm->pc].op)
+            return;
+
+          continue;
+        }
+#  endif
+
+#  ifdef USE_CACHED_REGS
+      if (cached_ops[insns[vm->pc].op] && run_cached (vm, insns))
+        goto safepoint;
+#  endif
+
+      insn_t *insn = &insns[vm->pc];
+      vm->pc += insn->len;
+
+      if (!exec_insn (vm, insns, insn, insn->op, proc))
+        return;
+
+#  ifdef USE_CACHED_REGS
+    safepoint:
+#  endif
+      if (!proc && 0 == vm->sp)
+        {
+          VM_DEBUG ("stack is empty, try to recycle once!\n");
+          gc_try_to_recycle ();
+          VM_DEBUG ("done\n");
+        }
+    }
+}
+#endif
+
 void vm_load_compiled_file (const char *filename)
 {
   os_printk ("Animula hasn't supported file loading yet!\n");
@@ -1400,11 +3004,28 @@ void vm_run (vm_t vm)
 {
   VM_DEBUG ("VM run!\n");
 
+#ifdef USE_PREDECODE
+  if (vm->insns && VM_RUN == vm->state)
+    {
+      run_predecoded (vm, false);
+      return;
+    }
+#endif
+
+#ifdef VM_THREADED_DISPATCH
+  run_threaded (vm, false);
+#else
   while (VM_RUN == vm->state || VM_INIT_GLOBALS == vm->state)
     {
       /* TODO:
        * 1. Add debug info
        */
+      if (RESUME_PC == vm->pc)
+        {
+          tramp_resume (vm);
+          continue;
+        }
+
       dispatch (vm, FETCH_NEXT_BYTECODE ());
       /* os_printk ("pc: %d, local: %d, sp: %d, fp: %d\n", vm->pc, vm->local, */
       /*            vm->sp, vm->fp); */
@@ -1437,17 +3058,98 @@ void vm_run (vm_t vm)
           VM_DEBUG ("done\n");
         }
     }
+#endif
+}
+
+#ifdef USE_BUDGET
+/* NOTE:
+ * The budget ran out, we pause the VM and vm_run returns to the host with the
+ * pc on the next instruction, the frames and the stack are kept as they are.
+ * The nested loop of apply_proc can't be left halfway, and the globals must
+ * be initialized in a run, so we defer it to the next tick.
+ */
+void vm_yield (vm_t vm)
+{
+  if (vm->nested || VM_RUN != vm->state)
+    {
+      // The preempt flag is kept till the yield
+      if (!vm->preempt)
+        vm->budget = 1;
+
+      return;
+    }
+
+  VM_DEBUG ("VM yield at pc: %d\n", vm->pc);
+  vm->preempt = 0;
+  vm->state = VM_PAUSE;
 }
 
+/* NOTE:
+ * Run at most `quantum' calls and backward branches before each yield,
+ * 0 means never to yield.
+ */
+void vm_set_budget (vm_t vm, u32_t quantum)
+{
+  vm->quantum = quantum;
+  vm->budget = quantum;
+}
+
+/* NOTE:
+ * It only sets the preempt flag, so it's safe to call it from an interrupt
+ * or a signal handler, the VM yields at the next call or backward branch.
+ */
+void vm_preempt (vm_t vm)
+{
+  vm->preempt = 1;
+}
+
+/* NOTE:
+ * Resume the paused VM with a new quantum.
+ * Return true if it yields again, false if the program is over.
+ */
+bool vm_resume (vm_t vm)
+{
+  if (VM_PAUSE == vm->state)
+    {
+      vm->state = VM_RUN;
+      vm->budget = vm->quantum;
+      vm_run (vm);
+    }
+
+  return VM_PAUSE == vm->state;
+}
+#endif
+
+/* NOTE:
+ * Run the procedure in a nested interpreter loop, it's only used by
+ * with-exception-handler now, map and for-each are trampolined.
+ */
 void apply_proc (vm_t vm, object_t proc, object_t ret)
 {
   // TODO: run proc with a new stack, and the code snippet of
-  u16_t entry = proc->proc.entry;
+  reg_t entry = proc->proc.entry;
 
   vm->pc = proc->proc.entry;
+#ifdef USE_BUDGET
+  vm->nested++;
+#endif
 
+#ifdef USE_PREDECODE
+  if (vm->insns)
+    run_predecoded (vm, true);
+  else
+#endif
+#ifdef VM_THREADED_DISPATCH
+  run_threaded (vm, true);
+#else
   while (VM_RUN == vm->state)
     {
+      if (RESUME_PC == vm->pc)
+        {
+          tramp_resume (vm);
+          continue;
+        }
+
       bytecode8_t bc = FETCH_NEXT_BYTECODE ();
 
       if (IS_PROC_END (bc))
@@ -1469,6 +3171,11 @@ void apply_proc (vm_t vm, object_t proc, object_t ret)
       /* os_printk ("------------END-----------\n"); */
       /* getchar (); */
     }
+#endif
+
+#ifdef USE_BUDGET
+  vm->nested--;
+#endif
 
   // FIXME: optimize it to reduce redundant copying
   if (ret)